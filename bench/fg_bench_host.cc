@@ -0,0 +1,1103 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+// A minimal libecap host that loads one of the adapters and pushes
+// transactions through it as fast as it can, for measuring the adapters
+// against fg_mock_ecapguardian (or a real ecapguardian):
+//
+//   fg_bench_host -a src/fg_reqmod.so -o ecapguardian_listen_socket=/tmp/fg_reqmod.sock -n 100000 -c 200
+//
+// With both services loaded (-p both), every transaction goes through
+// REQMOD and then, unless blocked, RESPMOD, and the REQMOD transaction's
+// -x option is handed to RESPMOD like Squid's adaptation_masterx_shared_names.
+//
+// Like Squid, it runs everything on one thread: adapter calls back into the
+// host are queued and handled after the call returns, virgin bodies are
+// handed over in chunks, and an adapter that makes asynchronous
+// transactions gets the suspend()/resume() treatment of the Squid main
+// loop. At the end it prints the rate, the latency percentiles, and the
+// system calls (made through the PLT, from any thread) and operator new
+// calls per transaction.
+#undef _FORTIFY_SOURCE // the fortified read() would hide the one defined below
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <libecap/common/area.h>
+#include <libecap/common/body.h>
+#include <libecap/common/delay.h>
+#include <libecap/common/header.h>
+#include <libecap/common/log.h>
+#include <libecap/common/message.h>
+#include <libecap/common/name.h>
+#include <libecap/common/named_values.h>
+#include <libecap/common/names.h>
+#include <libecap/common/options.h>
+#include <libecap/common/registry.h>
+#include <libecap/adapter/service.h>
+#include <libecap/adapter/xaction.h>
+#include <libecap/host/host.h>
+#include <libecap/host/xaction.h>
+
+//
+// Counting system calls and allocations
+//
+
+namespace {
+
+enum {
+	scRead, scWrite, scReadv, scWritev, scSend, scRecv, scSendmsg, scRecvmsg,
+	scSocket, scConnect, scClose, scPoll, scEpollWait, scCount
+};
+const char *SyscallNames[scCount] = {
+	"read", "write", "readv", "writev", "send", "recv", "sendmsg", "recvmsg",
+	"socket", "connect", "close", "poll", "epoll_wait"
+};
+std::atomic<uint64_t> syscalls[scCount];
+std::atomic<uint64_t> allocations(0);
+
+} // namespace
+
+// Defined here, these take the place of the libc functions for the adapter
+// (link with -rdynamic), count the call and pass it on. spec repeats the
+// exception specification of the libc declaration.
+#define INTERPOSE_SPEC(index, type, name, params, args, spec) \
+	extern "C" type name params spec { \
+		typedef type (*Real) params; \
+		static const Real real = reinterpret_cast<Real>(dlsym(RTLD_NEXT, #name)); \
+		syscalls[index].fetch_add(1, std::memory_order_relaxed); \
+		return real args; \
+	}
+#define INTERPOSE(index, type, name, params, args) INTERPOSE_SPEC(index, type, name, params, args, )
+
+INTERPOSE(scRead, ssize_t, read, (int fd, void *buf, size_t count), (fd, buf, count))
+INTERPOSE(scWrite, ssize_t, write, (int fd, const void *buf, size_t count), (fd, buf, count))
+INTERPOSE(scReadv, ssize_t, readv, (int fd, const struct iovec *iov, int iovcnt), (fd, iov, iovcnt))
+INTERPOSE(scWritev, ssize_t, writev, (int fd, const struct iovec *iov, int iovcnt), (fd, iov, iovcnt))
+INTERPOSE(scSend, ssize_t, send, (int fd, const void *buf, size_t len, int flags), (fd, buf, len, flags))
+INTERPOSE(scRecv, ssize_t, recv, (int fd, void *buf, size_t len, int flags), (fd, buf, len, flags))
+INTERPOSE(scSendmsg, ssize_t, sendmsg, (int fd, const struct msghdr *msg, int flags), (fd, msg, flags))
+INTERPOSE(scRecvmsg, ssize_t, recvmsg, (int fd, struct msghdr *msg, int flags), (fd, msg, flags))
+INTERPOSE_SPEC(scSocket, int, socket, (int domain, int type, int protocol), (domain, type, protocol), throw())
+INTERPOSE(scConnect, int, connect, (int fd, const struct sockaddr *addr, socklen_t len), (fd, addr, len))
+INTERPOSE(scClose, int, close, (int fd), (fd))
+INTERPOSE(scPoll, int, poll, (struct pollfd *fds, nfds_t nfds, int timeout), (fds, nfds, timeout))
+INTERPOSE(scEpollWait, int, epoll_wait, (int epfd, struct epoll_event *events, int maxevents, int timeout),
+	(epfd, events, maxevents, timeout))
+
+// out of line, so that the compiler does not pair new with free() here
+__attribute__((noinline)) void *operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+
+__attribute__((noinline)) void *operator new(size_t size, const std::nothrow_t &) noexcept {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &nothrow) noexcept {
+	return operator new(size, nothrow);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept {
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept {
+	free(p);
+}
+
+namespace {
+
+uint64_t MonotonicMicros() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool SameName(const std::string &a, const std::string &b) {
+	return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+//
+// Messages
+//
+
+class Message;
+
+class Header: public libecap::Header {
+	public:
+		typedef std::vector<std::pair<std::string, std::string> > Fields;
+
+		explicit Header(const Message &aMessage): message(aMessage) {}
+
+		virtual bool hasAny(const libecap::Name &name) const;
+		virtual Value value(const libecap::Name &name) const;
+		virtual void add(const libecap::Name &name, const Value &value);
+		virtual void removeAny(const libecap::Name &name);
+		virtual void visitEach(libecap::NamedValueVisitor &visitor) const;
+		virtual libecap::Area image() const; // with the first line, like Squid's
+		virtual void parse(const libecap::Area &buf);
+
+		Fields fields;
+
+	private:
+		const Message &message;
+};
+
+// HTTP/1.1
+libecap::Version Http11() {
+	libecap::Version version;
+	version.majr = 1;
+	version.minr = 1;
+	version.micr = 0;
+	return version;
+}
+
+class RequestLine: public libecap::RequestLine {
+	public:
+		virtual libecap::Version version() const { return Http11(); }
+		virtual void version(const libecap::Version &) {}
+		virtual libecap::Name protocol() const { return libecap::protocolHttp; }
+		virtual void protocol(const libecap::Name &) {}
+		virtual libecap::Area uri() const { return libecap::Area::FromTempString(theUri); }
+		virtual void uri(const libecap::Area &aUri) { theUri = aUri.toString(); }
+		virtual libecap::Name method() const { return libecap::Name(theMethod); }
+		virtual void method(const libecap::Name &aMethod) { theMethod = aMethod.image(); }
+
+		std::string theUri;
+		std::string theMethod;
+};
+
+class StatusLine: public libecap::StatusLine {
+	public:
+		StatusLine(): code(200), reason("OK") {}
+
+		virtual libecap::Version version() const { return Http11(); }
+		virtual void version(const libecap::Version &) {}
+		virtual libecap::Name protocol() const { return libecap::protocolHttp; }
+		virtual void protocol(const libecap::Name &) {}
+		virtual int statusCode() const { return code; }
+		virtual void statusCode(int aCode) { code = aCode; }
+		virtual libecap::Area reasonPhrase() const { return libecap::Area::FromTempString(reason); }
+		virtual void reasonPhrase(const libecap::Area &aReason) { reason = aReason.toString(); }
+
+		int code;
+		std::string reason;
+};
+
+class Body: public libecap::Body {
+	public:
+		Body(): size(0) {}
+		virtual libecap::BodySize bodySize() const { return libecap::BodySize(size); }
+
+		libecap::size_type size;
+};
+
+class Message: public libecap::Message {
+	public:
+		explicit Message(bool aRequest): request(aRequest), hasBody(false), theHeader(*this) {}
+
+		virtual libecap::shared_ptr<libecap::Message> clone() const;
+		virtual libecap::FirstLine &firstLine();
+		virtual const libecap::FirstLine &firstLine() const;
+		virtual libecap::Header &header() { return theHeader; }
+		virtual const libecap::Header &header() const { return theHeader; }
+		virtual void addBody() { hasBody = true; }
+		virtual libecap::Body *body() { return hasBody ? &theBody : 0; }
+		virtual const libecap::Body *body() const { return hasBody ? &theBody : 0; }
+		virtual void addTrailer() {}
+		virtual libecap::Header *trailer() { return 0; }
+		virtual const libecap::Header *trailer() const { return 0; }
+
+		std::string firstLineImage() const;
+
+		bool request;
+		bool hasBody;
+		RequestLine requestLine;
+		StatusLine statusLine;
+		Header theHeader;
+		Body theBody;
+};
+
+libecap::shared_ptr<libecap::Message> Message::clone() const {
+	Message *copy = new Message(request);
+	copy->hasBody = hasBody;
+	copy->requestLine = requestLine;
+	copy->statusLine = statusLine;
+	copy->theHeader.fields = theHeader.fields;
+	copy->theBody = theBody;
+	return libecap::shared_ptr<libecap::Message>(copy);
+}
+
+libecap::FirstLine &Message::firstLine() {
+	if (request) {
+		return requestLine;
+	}
+	return statusLine;
+}
+
+const libecap::FirstLine &Message::firstLine() const {
+	if (request) {
+		return requestLine;
+	}
+	return statusLine;
+}
+
+std::string Message::firstLineImage() const {
+	if (request) {
+		return requestLine.theMethod + " " + requestLine.theUri + " HTTP/1.1";
+	}
+	return "HTTP/1.1 " + std::to_string(statusLine.code) + " " + statusLine.reason;
+}
+
+bool Header::hasAny(const libecap::Name &name) const {
+	for (Fields::const_iterator i = fields.begin(); i != fields.end(); ++i) {
+		if (SameName(i->first, name.image())) {
+			return true;
+		}
+	}
+	return false;
+}
+
+Header::Value Header::value(const libecap::Name &name) const {
+	std::string joined;
+	for (Fields::const_iterator i = fields.begin(); i != fields.end(); ++i) {
+		if (SameName(i->first, name.image())) {
+			joined += (joined.empty() ? "" : ", ") + i->second;
+		}
+	}
+	return libecap::Area::FromTempString(joined);
+}
+
+void Header::add(const libecap::Name &name, const Value &value) {
+	fields.push_back(std::make_pair(name.image(), value.toString()));
+}
+
+void Header::removeAny(const libecap::Name &name) {
+	Fields kept;
+	for (Fields::const_iterator i = fields.begin(); i != fields.end(); ++i) {
+		if (!SameName(i->first, name.image())) {
+			kept.push_back(*i);
+		}
+	}
+	fields.swap(kept);
+}
+
+void Header::visitEach(libecap::NamedValueVisitor &visitor) const {
+	for (Fields::const_iterator i = fields.begin(); i != fields.end(); ++i) {
+		visitor.visit(libecap::Name(i->first), libecap::Area::FromTempString(i->second));
+	}
+}
+
+libecap::Area Header::image() const {
+	std::string text = message.firstLineImage() + "\r\n";
+	for (Fields::const_iterator i = fields.begin(); i != fields.end(); ++i) {
+		text += i->first + ": " + i->second + "\r\n";
+	}
+	text += "\r\n";
+	return libecap::Area::FromTempString(text);
+}
+
+// the whole header, first line included; "\r\n" or "\n" line ends
+void Header::parse(const libecap::Area &buf) {
+	Message &owner = const_cast<Message&>(message);
+	const std::string text = buf.toString();
+	fields.clear();
+	std::string::size_type pos = 0;
+	bool first = true;
+	while (pos < text.size()) {
+		std::string::size_type end = text.find('\n', pos);
+		if (end == std::string::npos) {
+			end = text.size();
+		}
+		std::string line = text.substr(pos, end - pos);
+		pos = end + 1;
+		if (!line.empty() && line[line.size() - 1] == '\r') {
+			line.erase(line.size() - 1);
+		}
+		if (line.empty()) {
+			break;
+		}
+		if (first) {
+			first = false;
+			std::string::size_type space = line.find(' ');
+			if (line.compare(0, 5, "HTTP/") == 0) {
+				owner.request = false;
+				owner.statusLine.code = atoi(line.c_str() + (space == std::string::npos ? line.size() : space + 1));
+				space = line.find(' ', space + 1);
+				owner.statusLine.reason = space == std::string::npos ? "" : line.substr(space + 1);
+			} else {
+				owner.request = true;
+				owner.requestLine.theMethod = line.substr(0, space);
+				const std::string::size_type uriEnd = line.find(' ', space + 1);
+				owner.requestLine.theUri = line.substr(space + 1, uriEnd == std::string::npos ? std::string::npos : uriEnd - space - 1);
+			}
+			continue;
+		}
+		const std::string::size_type colon = line.find(':');
+		if (colon == std::string::npos) {
+			continue;
+		}
+		const std::string::size_type valueStart = line.find_first_not_of(" \t", colon + 1);
+		fields.push_back(std::make_pair(line.substr(0, colon),
+			valueStart == std::string::npos ? std::string() : line.substr(valueStart)));
+	}
+}
+
+//
+// Host and options
+//
+
+class Host: public libecap::host::Host {
+	public:
+		virtual std::string uri() const { return "ecap://filtergizmo.com/ecapguardian/bench"; }
+		virtual void describe(std::ostream &os) const { os << "fg_ecap benchmark host"; }
+		virtual void noteVersionedService(const char *, const libecap::weak_ptr<libecap::adapter::Service> &s) {
+			services.push_back(s.lock());
+		}
+		virtual std::ostream *openDebug(libecap::LogVerbosity) { return 0; }
+		virtual void closeDebug(std::ostream *) {}
+		virtual libecap::shared_ptr<libecap::Message> newRequest() const {
+			return libecap::shared_ptr<libecap::Message>(new Message(true));
+		}
+		virtual libecap::shared_ptr<libecap::Message> newResponse() const {
+			return libecap::shared_ptr<libecap::Message>(new Message(false));
+		}
+
+		std::vector<libecap::shared_ptr<libecap::adapter::Service> > services;
+};
+
+// what squid.conf would say on the ecap_service line
+class Options: public libecap::Options {
+	public:
+		virtual const libecap::Area option(const libecap::Name &name) const {
+			const std::map<std::string, std::string>::const_iterator i = values.find(name.image());
+			return i == values.end() ? libecap::Area() : libecap::Area::FromTempString(i->second);
+		}
+		virtual void visitEachOption(libecap::NamedValueVisitor &visitor) const {
+			for (std::map<std::string, std::string>::const_iterator i = values.begin(); i != values.end(); ++i) {
+				visitor.visit(libecap::Name(i->first), libecap::Area::FromTempString(i->second));
+			}
+		}
+
+		std::map<std::string, std::string> values;
+};
+
+//
+// Transactions
+//
+
+struct Settings {
+	bool reqmod = true; // the transactions have a REQMOD phase
+	bool respmod = false; // and/or a RESPMOD one
+	std::string sharedName; // REQMOD transaction option passed on to RESPMOD
+	size_t concurrency = 100;
+	libecap::size_type bodySize = 0;
+	libecap::size_type chunkSize = 16384;
+	size_t urls = 1000; // distinct URLs, for the verdict cache
+	size_t clients = 64; // distinct client addresses
+};
+
+// what Squid keeps of a virgin body before it waits for the adapter
+const libecap::size_type HOST_BUFFER = 65536;
+
+class Driver;
+
+class Xaction: public libecap::host::Xaction, public std::enable_shared_from_this<Xaction> {
+	public:
+		typedef enum { resNone, resVirgin, resAdapted, resBlocked, resAborted, resSkipped } Result;
+
+		Xaction(Driver &aDriver, size_t anIndex);
+
+		// host::Xaction
+		virtual libecap::Message &virgin() { return *virginMessage; }
+		virtual const libecap::Message &cause() { return *causeMessage; }
+		virtual libecap::Message &adapted() { return *adaptedMessage; }
+		virtual void useVirgin();
+		virtual void useAdapted(const libecap::shared_ptr<libecap::Message> &msg);
+		virtual void blockVirgin();
+		virtual void adaptationDelayed(const libecap::Delay &) {}
+		virtual void adaptationAborted();
+		virtual void resume();
+		virtual void vbDiscard() { vbWanted = false; }
+		virtual void vbMake();
+		virtual void vbStopMaking() { vbWanted = false; }
+		virtual void vbMakeMore();
+		virtual libecap::Area vbContent(libecap::size_type offset, libecap::size_type size);
+		virtual void vbContentShift(libecap::size_type size);
+		virtual void noteAbContentDone(bool atEnd);
+		virtual void noteAbContentAvailable();
+		// Options
+		virtual const libecap::Area option(const libecap::Name &name) const;
+		virtual void visitEachOption(libecap::NamedValueVisitor &visitor) const;
+
+		// jobs, run by the Driver
+		void start();
+		void deliverVb();
+		void drainAb();
+		void resumeAdapter();
+		void close();
+
+		void finish(Result aResult);
+		void nextPhase();
+
+		const size_t index;
+		const uint64_t startedAt;
+		Result result;
+
+	private:
+		void post(void (Xaction::*job)());
+		const libecap::shared_ptr<libecap::adapter::Service> &service() const;
+
+		Driver &driver;
+		bool inRespmod; // the phase, see Settings
+		libecap::shared_ptr<Message> virginMessage;
+		libecap::shared_ptr<Message> causeMessage;
+		libecap::shared_ptr<Message> responseMessage; // the RESPMOD virgin message, while in REQMOD
+		std::string shared; // the REQMOD adapter's Settings::sharedName option
+		libecap::shared_ptr<libecap::Message> adaptedMessage;
+		libecap::adapter::Service::MadeXactionPointer adapter;
+		std::string clientIp;
+
+		libecap::size_type vbEnd; // handed to the host so far
+		libecap::size_type vbShifted; // consumed by the adapter
+		bool vbWanted;
+		bool vbDone;
+		bool vbPending; // a deliverVb() job is queued
+		bool abMade;
+		bool abDone;
+		bool closing;
+};
+
+class Driver {
+	public:
+		typedef void (Xaction::*Job)();
+
+		typedef libecap::shared_ptr<libecap::adapter::Service> ServicePointer;
+
+		Driver(const ServicePointer &aReqmodService, const ServicePointer &aRespmodService, const Settings &aSettings);
+
+		// runs count transactions, keeping concurrency of them going
+		void run(size_t count);
+		void post(const std::weak_ptr<Xaction> &xaction, Job job) { jobs.push_back(std::make_pair(xaction, job)); }
+		void done(Xaction &xaction);
+		void error(const std::string &what) { errors[what]++; }
+		void reset();
+		void report(uint64_t elapsed) const;
+
+		const ServicePointer reqmodService; // null unless Settings::reqmod
+		const ServicePointer respmodService; // null unless Settings::respmod
+		const Settings settings;
+		std::string body; // every virgin body is a prefix of this
+
+	private:
+		bool runJobs();
+		bool makesAsyncXactions() const;
+		void suspend(timeval &timeout);
+		void resume();
+
+		std::deque<std::pair<std::weak_ptr<Xaction>, Job> > jobs;
+		std::map<size_t, std::shared_ptr<Xaction> > live;
+		size_t nextIndex;
+		size_t finished;
+		std::vector<uint64_t> latencies;
+		uint64_t results[Xaction::resSkipped + 1];
+		std::map<std::string, size_t> errors;
+};
+
+Xaction::Xaction(Driver &aDriver, size_t anIndex):
+	index(anIndex), startedAt(MonotonicMicros()), result(resNone), driver(aDriver), inRespmod(!aDriver.settings.reqmod),
+	vbEnd(0), vbShifted(0), vbWanted(false), vbDone(false), vbPending(false),
+	abMade(false), abDone(false), closing(false) {
+	const Settings &settings = driver.settings;
+	const std::string host = "bench" + std::to_string(anIndex % settings.urls % 16) + ".example.com";
+	const std::string uri = "http://" + host + "/page/" + std::to_string(anIndex % settings.urls);
+	clientIp = "10.0." + std::to_string(anIndex % settings.clients / 250) + "." + std::to_string(anIndex % settings.clients % 250 + 1);
+
+	libecap::shared_ptr<Message> request(new Message(true));
+	request->requestLine.theMethod = settings.respmod || !settings.bodySize ? "GET" : "POST";
+	request->requestLine.theUri = uri;
+	Header::Fields &fields = request->theHeader.fields;
+	fields.push_back(std::make_pair("Host", host));
+	fields.push_back(std::make_pair("User-Agent", "fg_bench_host/1.0"));
+	fields.push_back(std::make_pair("Accept", "text/html,application/xhtml+xml,*/*;q=0.8"));
+	fields.push_back(std::make_pair("Accept-Encoding", "gzip, deflate"));
+	if (!settings.respmod && settings.bodySize) {
+		fields.push_back(std::make_pair("Content-Type", "application/x-www-form-urlencoded"));
+		fields.push_back(std::make_pair("Content-Length", std::to_string(settings.bodySize)));
+		request->addBody();
+		request->theBody.size = settings.bodySize;
+	}
+
+	virginMessage = request;
+	causeMessage = request;
+	if (!settings.respmod) {
+		return;
+	}
+	responseMessage.reset(new Message(false));
+	Header::Fields &responseFields = responseMessage->theHeader.fields;
+	responseFields.push_back(std::make_pair("Content-Type", "text/html; charset=utf-8"));
+	responseFields.push_back(std::make_pair("Content-Length", std::to_string(settings.bodySize)));
+	responseFields.push_back(std::make_pair("Cache-Control", "private, max-age=0"));
+	if (settings.bodySize) {
+		responseMessage->addBody();
+		responseMessage->theBody.size = settings.bodySize;
+	}
+	if (inRespmod) {
+		virginMessage.swap(responseMessage);
+	}
+}
+
+void Xaction::post(void (Xaction::*job)()) {
+	driver.post(shared_from_this(), job);
+}
+
+const libecap::shared_ptr<libecap::adapter::Service> &Xaction::service() const {
+	return inRespmod ? driver.respmodService : driver.reqmodService;
+}
+
+void Xaction::start() {
+	if (!service()->wantsUrl(causeMessage->requestLine.theUri.c_str())) {
+		finish(resSkipped);
+		return;
+	}
+	adapter = service()->makeXaction(this);
+	adapter->start();
+}
+
+// the request was let through: on to RESPMOD with a fresh virgin body
+void Xaction::nextPhase() {
+	inRespmod = true;
+	virginMessage.swap(responseMessage);
+	adaptedMessage.reset();
+	vbEnd = vbShifted = 0;
+	vbWanted = vbDone = vbPending = false;
+	abMade = abDone = closing = false;
+	result = resNone;
+	post(&Xaction::start);
+}
+
+void Xaction::useVirgin() {
+	// as in Squid, whose preserveVb() insists on an untouched virgin body
+	if (vbShifted) {
+		throw std::logic_error("useVirgin() after the adapter consumed " + std::to_string(vbShifted) + " virgin body bytes");
+	}
+	finish(resVirgin);
+}
+
+void Xaction::useAdapted(const libecap::shared_ptr<libecap::Message> &msg) {
+	adaptedMessage = msg;
+	if (!msg->body()) {
+		finish(resAdapted);
+		return;
+	}
+	abMade = true;
+	post(&Xaction::drainAb);
+}
+
+void Xaction::blockVirgin() {
+	finish(resBlocked);
+}
+
+void Xaction::adaptationAborted() {
+	finish(resAborted);
+}
+
+void Xaction::resume() {
+	post(&Xaction::resumeAdapter);
+}
+
+void Xaction::resumeAdapter() {
+	if (adapter && !closing) {
+		adapter->resume();
+	}
+}
+
+void Xaction::vbMake() {
+	vbWanted = true;
+	vbMakeMore();
+}
+
+void Xaction::vbMakeMore() {
+	if (!vbPending) {
+		vbPending = true;
+		post(&Xaction::deliverVb);
+	}
+}
+
+// another chunk of the virgin body "arrives from the network"
+void Xaction::deliverVb() {
+	vbPending = false;
+	if (!vbWanted || vbDone || closing) {
+		return;
+	}
+	const libecap::size_type size = virginMessage->theBody.size;
+	if (vbEnd < size) {
+		if (vbEnd - vbShifted >= HOST_BUFFER) {
+			return; // vbContentShift() asks for more
+		}
+		vbEnd += std::min(driver.settings.chunkSize, size - vbEnd);
+		vbMakeMore();
+		adapter->noteVbContentAvailable();
+		return;
+	}
+	vbDone = true;
+	adapter->noteVbContentDone(true);
+}
+
+libecap::Area Xaction::vbContent(libecap::size_type offset, libecap::size_type size) {
+	const libecap::size_type available = vbEnd - vbShifted;
+	if (offset >= available) {
+		return libecap::Area();
+	}
+	return libecap::Area(driver.body.data() + vbShifted + offset, std::min(size, available - offset));
+}
+
+void Xaction::vbContentShift(libecap::size_type size) {
+	vbShifted += std::min(size, vbEnd - vbShifted);
+	if (vbWanted && !vbDone) {
+		vbMakeMore();
+	}
+}
+
+void Xaction::noteAbContentDone(bool) {
+	abDone = true;
+	post(&Xaction::drainAb);
+}
+
+void Xaction::noteAbContentAvailable() {
+	post(&Xaction::drainAb);
+}
+
+// "sends the adapted body to the client"
+void Xaction::drainAb() {
+	if (closing) {
+		return;
+	}
+	if (abMade) {
+		abMade = false;
+		adapter->abMake();
+	}
+	for (;;) {
+		const libecap::Area area = adapter->abContent(0, libecap::nsize);
+		if (!area.size) {
+			break;
+		}
+		adapter->abContentShift(area.size);
+	}
+	if (abDone) {
+		finish(resAdapted);
+	}
+}
+
+const libecap::Area Xaction::option(const libecap::Name &name) const {
+	if (name == libecap::metaClientIp) {
+		return libecap::Area::FromTempString(clientIp);
+	}
+	if (inRespmod && !shared.empty() && name.image() == driver.settings.sharedName) {
+		return libecap::Area::FromTempString(shared);
+	}
+	return libecap::Area();
+}
+
+void Xaction::visitEachOption(libecap::NamedValueVisitor &visitor) const {
+	visitor.visit(libecap::metaClientIp, libecap::Area::FromTempString(clientIp));
+	if (inRespmod && !shared.empty()) {
+		visitor.visit(libecap::Name(driver.settings.sharedName), libecap::Area::FromTempString(shared));
+	}
+}
+
+void Xaction::finish(Result aResult) {
+	if (closing) {
+		return;
+	}
+	closing = true;
+	result = aResult;
+	if (!inRespmod && adapter && !driver.settings.sharedName.empty()) {
+		// Squid reads the shared names when the adapter is done with the message
+		shared = adapter->option(libecap::Name(driver.settings.sharedName)).toString();
+	}
+	post(&Xaction::close);
+}
+
+// what Squid does when it is done with a transaction: stop the adapter's
+// side and let go of it
+void Xaction::close() {
+	if (adapter) {
+		libecap::adapter::Service::MadeXactionPointer stopping = adapter;
+		adapter.reset();
+		try {
+			stopping->stop();
+		} catch (const std::exception &e) {
+			driver.error(std::string("Xaction::stop: ") + e.what());
+		}
+	}
+	// a block page or other response made in REQMOD goes straight to the client
+	const bool satisfied = result == resAdapted && !dynamic_cast<const libecap::RequestLine*>(&adaptedMessage->firstLine());
+	if (!inRespmod && driver.settings.respmod && (result == resVirgin || result == resSkipped || (result == resAdapted && !satisfied))) {
+		nextPhase();
+		return;
+	}
+	driver.done(*this);
+}
+
+Driver::Driver(const ServicePointer &aReqmodService, const ServicePointer &aRespmodService, const Settings &aSettings):
+	reqmodService(aReqmodService), respmodService(aRespmodService), settings(aSettings), nextIndex(0), finished(0) {
+	body.assign(settings.bodySize, 'x');
+	for (libecap::size_type i = 80; i < body.size(); i += 81) {
+		body[i] = '\n';
+	}
+	reset();
+}
+
+void Driver::reset() {
+	latencies.clear();
+	for (size_t i = 0; i <= Xaction::resSkipped; ++i) {
+		results[i] = 0;
+	}
+	errors.clear();
+	finished = 0;
+	for (size_t i = 0; i < scCount; ++i) {
+		syscalls[i].store(0, std::memory_order_relaxed);
+	}
+	allocations.store(0, std::memory_order_relaxed);
+}
+
+// runs queued jobs, including those they queue; false if there were none
+bool Driver::runJobs() {
+	if (jobs.empty()) {
+		return false;
+	}
+	while (!jobs.empty()) {
+		const std::pair<std::weak_ptr<Xaction>, Job> job = jobs.front();
+		jobs.pop_front();
+		if (std::shared_ptr<Xaction> xaction = job.first.lock()) {
+			try {
+				((*xaction).*job.second)();
+			} catch (const std::exception &e) {
+				error(e.what());
+				xaction->finish(Xaction::resAborted); // Squid aborts it too
+			}
+		}
+	}
+	return true;
+}
+
+bool Driver::makesAsyncXactions() const {
+	return (reqmodService && reqmodService->makesAsyncXactions()) ||
+		(respmodService && respmodService->makesAsyncXactions());
+}
+
+void Driver::suspend(timeval &timeout) {
+	if (reqmodService && reqmodService->makesAsyncXactions()) {
+		reqmodService->suspend(timeout);
+	}
+	if (respmodService && respmodService->makesAsyncXactions()) {
+		respmodService->suspend(timeout);
+	}
+}
+
+void Driver::resume() {
+	const ServicePointer services[] = { reqmodService, respmodService };
+	for (size_t i = 0; i < 2; ++i) {
+		if (!services[i] || !services[i]->makesAsyncXactions()) {
+			continue;
+		}
+		try {
+			services[i]->resume();
+		} catch (const std::exception &e) {
+			error(std::string("Service::resume: ") + e.what());
+		}
+	}
+}
+
+void Driver::run(size_t count) {
+	const size_t last = nextIndex + count;
+	const size_t goal = finished + count;
+	uint64_t lastProgress = MonotonicMicros();
+	size_t lastFinished = finished;
+	while (finished < goal) {
+		while (live.size() < settings.concurrency && nextIndex < last) {
+			std::shared_ptr<Xaction> xaction(new Xaction(*this, nextIndex));
+			live[nextIndex++] = xaction;
+			post(xaction, &Xaction::start);
+		}
+		const bool worked = runJobs();
+
+		if (makesAsyncXactions()) {
+			// the Squid main loop: nap unless there is work, then resume the services
+			struct timeval timeout;
+			timeout.tv_sec = 1;
+			timeout.tv_usec = 0;
+			suspend(timeout);
+			if (!worked) {
+				struct timespec nap;
+				nap.tv_sec = timeout.tv_sec;
+				nap.tv_nsec = timeout.tv_usec * 1000;
+				nanosleep(&nap, 0);
+			}
+			resume();
+		}
+
+		if (finished != lastFinished) {
+			lastFinished = finished;
+			lastProgress = MonotonicMicros();
+		} else if (!worked && (!makesAsyncXactions() || MonotonicMicros() - lastProgress > 30000000)) {
+			std::cerr << "fg_bench_host: " << live.size() << " transactions are stuck, giving up" << std::endl;
+			exit(1);
+		}
+	}
+}
+
+void Driver::done(Xaction &xaction) {
+	if (!live.erase(xaction.index)) {
+		return;
+	}
+	latencies.push_back(MonotonicMicros() - xaction.startedAt);
+	results[xaction.result]++;
+	finished++;
+}
+
+void Driver::report(uint64_t elapsed) const {
+	std::vector<uint64_t> sorted = latencies;
+	std::sort(sorted.begin(), sorted.end());
+	const size_t n = sorted.size();
+	if (!n) {
+		std::cout << "no transactions" << std::endl;
+		return;
+	}
+	const double seconds = elapsed / 1e6;
+	printf("transactions: %zu in %.3f s, %.0f/s, concurrency %zu\n", n, seconds, n / seconds, settings.concurrency);
+	printf("latency (us): p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+		static_cast<unsigned long long>(sorted[n / 2]),
+		static_cast<unsigned long long>(sorted[n * 90 / 100]),
+		static_cast<unsigned long long>(sorted[n * 99 / 100]),
+		static_cast<unsigned long long>(sorted[n - 1]));
+	printf("results: virgin %llu, adapted %llu, blocked %llu, aborted %llu, skipped %llu\n",
+		static_cast<unsigned long long>(results[Xaction::resVirgin]),
+		static_cast<unsigned long long>(results[Xaction::resAdapted]),
+		static_cast<unsigned long long>(results[Xaction::resBlocked]),
+		static_cast<unsigned long long>(results[Xaction::resAborted]),
+		static_cast<unsigned long long>(results[Xaction::resSkipped]));
+	uint64_t total = 0;
+	std::string breakdown;
+	for (size_t i = 0; i < scCount; ++i) {
+		const uint64_t calls = syscalls[i].load(std::memory_order_relaxed);
+		total += calls;
+		if (calls) {
+			char item[64];
+			snprintf(item, sizeof(item), "%s%s %.2f", breakdown.empty() ? "" : ", ", SyscallNames[i], calls / static_cast<double>(n));
+			breakdown += item;
+		}
+	}
+	printf("per transaction: %.2f system calls (%s), %.2f allocations\n",
+		total / static_cast<double>(n), breakdown.c_str(),
+		allocations.load(std::memory_order_relaxed) / static_cast<double>(n));
+	for (std::map<std::string, size_t>::const_iterator i = errors.begin(); i != errors.end(); ++i) {
+		printf("error (%zu times): %s\n", i->second, i->first.c_str());
+	}
+}
+
+void Usage(const char *program) {
+	fprintf(stderr,
+		"usage: %s -a adapter.so [-a adapter.so] [-p reqmod|respmod|both] [-x shared option]\n"
+		"          [-o name=value ...] [-n transactions] [-w warmup transactions] [-c concurrency]\n"
+		"          [-b body size] [-k body chunk size] [-u distinct URLs] [-i distinct client IPs]\n"
+		"  -p picks the services to run when the adapters register both (default: both);\n"
+		"  -o reqmod.name=value and -o respmod.name=value configure only that service;\n"
+		"  -x defaults to the correlation_option value\n",
+		program);
+	exit(2);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	Settings settings;
+	Options options[2]; // REQMOD, RESPMOD
+	std::vector<std::string> adapterPaths;
+	std::string phases;
+	bool sharedNameSet = false;
+	size_t count = 10000;
+	size_t warmup = 1000;
+	bool bodySizeSet = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:x:o:n:w:c:b:k:u:i:")) != -1) {
+		switch (opt) {
+			case 'a':
+				adapterPaths.push_back(optarg);
+				break;
+			case 'p':
+				phases = optarg;
+				if (phases != "reqmod" && phases != "respmod" && phases != "both") {
+					Usage(argv[0]);
+				}
+				break;
+			case 'x':
+				settings.sharedName = optarg;
+				sharedNameSet = true;
+				break;
+			case 'o': {
+				const char *equals = strchr(optarg, '=');
+				if (!equals) {
+					Usage(argv[0]);
+				}
+				std::string name(optarg, equals - optarg);
+				for (int i = 0; i < 2; ++i) {
+					const std::string prefix = i ? "respmod." : "reqmod.";
+					if (name.compare(0, prefix.size(), prefix) == 0) {
+						options[i].values[name.substr(prefix.size())] = equals + 1;
+						name.clear();
+					}
+				}
+				if (!name.empty()) {
+					options[0].values[name] = options[1].values[name] = equals + 1;
+				}
+				break;
+			}
+			case 'n':
+				count = strtoul(optarg, 0, 10);
+				break;
+			case 'w':
+				warmup = strtoul(optarg, 0, 10);
+				break;
+			case 'c':
+				settings.concurrency = std::max(1ul, strtoul(optarg, 0, 10));
+				break;
+			case 'b':
+				settings.bodySize = strtoull(optarg, 0, 10);
+				bodySizeSet = true;
+				break;
+			case 'k':
+				settings.chunkSize = std::max(1ull, strtoull(optarg, 0, 10));
+				break;
+			case 'u':
+				settings.urls = std::max(1ul, strtoul(optarg, 0, 10));
+				break;
+			case 'i':
+				settings.clients = std::max(1ul, strtoul(optarg, 0, 10));
+				break;
+			default:
+				Usage(argv[0]);
+		}
+	}
+	if (adapterPaths.empty() || !count) {
+		Usage(argv[0]);
+	}
+	if (!sharedNameSet) {
+		settings.sharedName = options[1].values["correlation_option"];
+	}
+
+	// the adapters register their services from static initializers, which
+	// tell the host if there is one already
+	libecap::shared_ptr<Host> host(new Host);
+	libecap::RegisterHost(host);
+	for (std::vector<std::string>::const_iterator i = adapterPaths.begin(); i != adapterPaths.end(); ++i) {
+		if (!dlopen(i->c_str(), RTLD_NOW | RTLD_GLOBAL)) {
+			fprintf(stderr, "%s\n", dlerror());
+			return 1;
+		}
+	}
+	Driver::ServicePointer reqmodService;
+	Driver::ServicePointer respmodService;
+	for (std::vector<Driver::ServicePointer>::const_iterator i = host->services.begin(); i != host->services.end(); ++i) {
+		if (!*i) {
+			continue;
+		}
+		Driver::ServicePointer &kind = (*i)->uri().find("respmod") != std::string::npos ? respmodService : reqmodService;
+		if (!kind) {
+			kind = *i;
+		}
+	}
+	if (!reqmodService && !respmodService) {
+		fprintf(stderr, "the adapters registered no eCAP service\n");
+		return 1;
+	}
+	if (phases.empty()) {
+		phases = !respmodService ? "reqmod" : !reqmodService ? "respmod" : "both";
+	}
+	settings.reqmod = phases != "respmod";
+	settings.respmod = phases != "reqmod";
+	if ((settings.reqmod && !reqmodService) || (settings.respmod && !respmodService)) {
+		fprintf(stderr, "the adapters do not register the %s service\n", settings.reqmod && !reqmodService ? "REQMOD" : "RESPMOD");
+		return 1;
+	}
+	if (!settings.reqmod) {
+		reqmodService.reset();
+	}
+	if (!settings.respmod) {
+		respmodService.reset();
+	}
+	if (settings.respmod && !bodySizeSet) {
+		settings.bodySize = 65536;
+	}
+	const Driver::ServicePointer services[] = { reqmodService, respmodService };
+	for (size_t i = 0; i < 2; ++i) {
+		if (!services[i]) {
+			continue;
+		}
+		try {
+			services[i]->configure(options[i]);
+			services[i]->start();
+		} catch (const std::exception &e) {
+			fprintf(stderr, "%s: %s\n", services[i]->uri().c_str(), e.what());
+			return 1;
+		}
+	}
+
+	Driver driver(reqmodService, respmodService, settings);
+	if (warmup) {
+		driver.run(warmup); // fills the connection pool and the caches
+		driver.reset();
+	}
+	const uint64_t start = MonotonicMicros();
+	driver.run(count);
+	const uint64_t elapsed = MonotonicMicros() - start;
+
+	for (size_t i = 0; i < 2; ++i) {
+		if (services[i]) {
+			services[i]->stop();
+			services[i]->retire();
+		}
+	}
+	driver.report(elapsed);
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+// Google Benchmark suite for the per-chunk data paths of the adapters:
+// buffering a body and handing it to the host (BodyStore), and finding
+// the end of what ecapguardian sends back (Reply). Each has a "String"
+// twin that does what the adapters did before those classes existed, so
+// the difference stays measurable:
+//
+//   bench/fg_microbench --benchmark_filter=BodyStore
+//
+// Body sizes go from 1 KB to 100 MB; the String twins stop at 4 MB (the
+// end scan at 1 MB), past which their quadratic copying takes minutes.
+#include <algorithm>
+#include <string>
+
+#include <benchmark/benchmark.h>
+#include <libecap/common/area.h>
+
+#include "../src/fg_body_store.h"
+#include "../src/fg_protocol.h"
+#include "../src/fg_reply.h"
+
+using Adapter::BodyStore;
+using Adapter::Reply;
+
+namespace {
+
+// what the Squid body pipe takes per abContent() call
+const size_t HOST_PULL = 64*1024;
+
+const std::string &Body(size_t size) {
+	static std::string body;
+	if (body.size() < size) {
+		body.assign(size, 'x');
+		for (size_t i = 80; i < size; i += 81) {
+			body[i] = '\n'; // lines, but never an empty one
+		}
+	}
+	return body;
+}
+
+// ecapguardian's replacement body for a 'b' or 'm' verdict in v1: size
+// bytes ending with the empty line
+std::string V1Body(size_t size) {
+	std::string body = Body(size).substr(0, size > 2 ? size - 2 : 0);
+	return body + "\n\n";
+}
+
+// drains the store the way Squid does: abContent(0, nsize), taking at most
+// what fits in its pipe
+size_t Drain(BodyStore &store) {
+	size_t drained = 0;
+	while (!store.empty()) {
+		const libecap::Area area = store.content(0, libecap::nsize);
+		const size_t used = std::min<size_t>(area.size, HOST_PULL);
+		benchmark::DoNotOptimize(area.start);
+		store.shift(used);
+		drained += used;
+	}
+	return drained;
+}
+
+// virgin body in, adapted body out: chunks from the host are appended to
+// the store, then the host takes it back
+void BM_BodyStore(benchmark::State &state) {
+	const size_t size = state.range(0);
+	const size_t chunk = state.range(1);
+	const std::string &body = Body(size);
+	for (auto _ : state) {
+		BodyStore store;
+		for (size_t offset = 0; offset < size; offset += chunk) {
+			store.append(body.data() + offset, std::min(chunk, size - offset));
+		}
+		benchmark::DoNotOptimize(Drain(store));
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+}
+
+// the same with a std::string: vb.toString(), buffer += chunk, and
+// FromTempString(buffer.substr()) / buffer.erase() for every host pull
+void BM_StringBuffer(benchmark::State &state) {
+	const size_t size = state.range(0);
+	const size_t chunk = state.range(1);
+	const std::string &body = Body(size);
+	for (auto _ : state) {
+		std::string buffer;
+		for (size_t offset = 0; offset < size; offset += chunk) {
+			const libecap::Area vb(body.data() + offset, std::min(chunk, size - offset));
+			buffer += vb.toString();
+		}
+		while (!buffer.empty()) {
+			const libecap::Area area = libecap::Area::FromTempString(buffer.substr(0, libecap::nsize));
+			const size_t used = std::min<size_t>(area.size, HOST_PULL);
+			benchmark::DoNotOptimize(area.start);
+			buffer.erase(0, used);
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+}
+
+// a RESPMOD 'm' body verdict with a rewritten body of range(0) bytes, read
+// from the socket range(1) bytes at a time
+void ReplyBenchmark(benchmark::State &state, int version) {
+	const size_t size = state.range(0);
+	const size_t readSize = state.range(1);
+	const std::string header = "HTTP/1.1 200 OK\nContent-Type: text/html\n\n";
+	const std::string body = V1Body(size);
+	std::string wire;
+	if (version == Adapter::PROTOCOL_V1) {
+		wire = "m" + header + body;
+	} else {
+		wire = Adapter::FrameHeader('m', 0) + Adapter::FrameHeader(Adapter::FRAME_HEADER, header.size()) + header +
+			Adapter::FrameHeader(Adapter::FRAME_BODY, body.size()) + body;
+	}
+	for (auto _ : state) {
+		Reply reply(Reply::rkRespmodBody, version);
+		for (size_t offset = 0; offset < wire.size() && !reply.complete(); offset += readSize) {
+			reply.feed(wire.data() + offset, std::min(readSize, wire.size() - offset));
+			while (reply.needsAck()) {
+				reply.acked();
+			}
+		}
+		if (!reply.complete() || reply.body.size() != body.size()) {
+			state.SkipWithError("the reply did not parse");
+			return;
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * wire.size());
+}
+
+void BM_ReplyV1(benchmark::State &state) {
+	ReplyBenchmark(state, Adapter::PROTOCOL_V1);
+}
+
+void BM_ReplyV2(benchmark::State &state) {
+	ReplyBenchmark(state, Adapter::PROTOCOL_V2);
+}
+
+// the v1 body the way the adapters used to read it: append every read to
+// the buffer and rfind(FLAG_END) over all of it
+void BM_StringEndScan(benchmark::State &state) {
+	const size_t size = state.range(0);
+	const size_t readSize = state.range(1);
+	const std::string body = V1Body(size);
+	const std::string FLAG_END = "\n\n";
+	for (auto _ : state) {
+		std::string buffer;
+		for (size_t offset = 0; offset < body.size(); offset += readSize) {
+			buffer.append(body.data() + offset, std::min(readSize, body.size() - offset));
+			if (buffer.rfind(FLAG_END) != std::string::npos) {
+				break;
+			}
+		}
+		benchmark::DoNotOptimize(buffer.data());
+	}
+	state.SetBytesProcessed(state.iterations() * body.size());
+}
+
+const int64_t KB = 1024;
+const int64_t MB = 1024*1024;
+
+} // namespace
+
+BENCHMARK(BM_BodyStore)->ArgsProduct({{KB, 64*KB, MB, 16*MB, 100*MB}, {4*KB, 16*KB, 64*KB}});
+BENCHMARK(BM_StringBuffer)->ArgsProduct({{KB, 64*KB, MB, 4*MB}, {4*KB, 16*KB, 64*KB}});
+BENCHMARK(BM_ReplyV1)->ArgsProduct({{KB, 64*KB, MB, 16*MB, 100*MB}, {4*KB, 64*KB}});
+BENCHMARK(BM_ReplyV2)->ArgsProduct({{KB, 64*KB, MB, 16*MB, 100*MB}, {4*KB, 64*KB}});
+BENCHMARK(BM_StringEndScan)->ArgsProduct({{KB, 64*KB, MB}, {4*KB, 64*KB}});
+
+BENCHMARK_MAIN();
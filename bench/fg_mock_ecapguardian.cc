@@ -0,0 +1,817 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+// A stand-in for ecapguardian that answers the adapters with scripted
+// verdicts, for benchmarking them without a content filter behind them.
+//
+//   fg_mock_ecapguardian -s /tmp/fg_reqmod.sock -k reqmod -V v:90,m:5,b:5 -d 200
+//   fg_mock_ecapguardian -s /tmp/fg_respmod.sock -k respmod -V v:50,s:50 -B v:95,m:5
+//   fg_mock_ecapguardian -s /tmp/fg_reqmod.sock -R /tmp/fg_respmod.sock -H v:50,s:50
+//
+// Every connection gets a thread and may carry any number of transactions,
+// in protocol v1 or (after a hello) v2. Verdicts are drawn at random with
+// the given weights; REQMOD understands 'v', 'u', 'm' and 'b', the RESPMOD
+// header verdict 'v' and 's', and the RESPMOD body verdict 'v' and 'm'.
+// In v1 the end of a RESPMOD body is found through its Content-Length,
+// so that header must be present (and no scan limit may cut the body).
+// With -R it serves RESPMOD on a second socket, and remembers the requests
+// REQMOD named with a correlation ID for the RESPMOD phase (v2 only).
+// A multiplexing adapter gets its answers in whatever order they are
+// ready, shuffled per read, so that streams overtake each other.
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../src/fg_protocol.h"
+
+using namespace Adapter;
+
+namespace {
+
+typedef std::vector<std::pair<char, unsigned> > Weights;
+
+struct Settings {
+	std::string socketPath;
+	bool respmod = false;
+	std::string respmodSocketPath; // -R: RESPMOD next to REQMOD
+	int highestVersion = PROTOCOL_V2;
+	Weights verdicts; // REQMOD verdicts
+	Weights headerVerdicts; // RESPMOD header verdicts
+	Weights bodyVerdicts; // RESPMOD body verdicts
+	size_t correlations = 65536; // requests remembered by correlation ID; 0: no FEATURE_CORRELATION
+	bool multiplex = true; // accept FEATURE_MULTIPLEX
+	bool noAcks = true; // accept FEATURE_NO_ACKS
+	uint32_t scanBytes = 0; // -S: scan hint on 's' (and FEATURE_SCAN_HINTS accepted); 0: none
+	uint32_t scanHintFlags = 0;
+	unsigned delayMicros = 0; // before every verdict
+	size_t pageSize = 1024; // block page and rewritten response body
+};
+
+Settings settings;
+
+// The REQMOD requests by correlation ID, oldest forgotten first
+class Correlations {
+	public:
+		void remember(const std::string &id, const std::string &request) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!requests.insert(std::make_pair(id, request)).second) {
+				return;
+			}
+			order.push_back(id);
+			while (order.size() > settings.correlations) {
+				requests.erase(order.front());
+				order.pop_front();
+			}
+		}
+
+		bool recall(const std::string &id, std::string &request) {
+			std::lock_guard<std::mutex> lock(mutex);
+			std::map<std::string, std::string>::const_iterator i = requests.find(id);
+			if (i == requests.end()) {
+				return false;
+			}
+			request = i->second;
+			return true;
+		}
+
+	private:
+		std::mutex mutex;
+		std::map<std::string, std::string> requests;
+		std::deque<std::string> order;
+};
+
+Correlations correlations;
+
+// "v:90,m:10" into weights; false on garbage
+bool ParseWeights(const std::string &text, const std::string &allowed, Weights &weights) {
+	weights.clear();
+	std::string::size_type pos = 0;
+	while (pos < text.size()) {
+		std::string::size_type end = text.find(',', pos);
+		if (end == std::string::npos) {
+			end = text.size();
+		}
+		const std::string item = text.substr(pos, end - pos);
+		if (item.size() < 3 || item[1] != ':' || allowed.find(item[0]) == std::string::npos) {
+			return false;
+		}
+		weights.push_back(std::make_pair(item[0], static_cast<unsigned>(strtoul(item.c_str() + 2, 0, 10))));
+		pos = end + 1;
+	}
+	return !weights.empty();
+}
+
+char Draw(const Weights &weights, std::mt19937 &random) {
+	unsigned total = 0;
+	for (Weights::const_iterator i = weights.begin(); i != weights.end(); ++i) {
+		total += i->second;
+	}
+	unsigned pick = total ? random() % total : 0;
+	for (Weights::const_iterator i = weights.begin(); i != weights.end(); ++i) {
+		if (pick < i->second) {
+			return i->first;
+		}
+		pick -= i->second;
+	}
+	return weights.front().first;
+}
+
+// One adapter connection, read through a buffer
+class Connection {
+	public:
+		Connection(int aHandle, bool aRespmod): handle(aHandle), respmod(aRespmod), version(PROTOCOL_V1), multiplexed(false), acks(true), scanHints(false), random(aHandle) {}
+		~Connection() { close(handle); }
+
+		void serve();
+
+	private:
+		bool fill();
+		bool skipPadding();
+		bool readBlock(std::string &block);
+		bool readExactly(size_t size, std::string &data);
+		bool readFrame(char &type, std::string &payload);
+		bool takeFrame(char &type, uint32_t &stream, std::string &payload);
+		bool readPart(char frameType, std::string &part);
+		bool readNamedPart(char frameType, std::string &id, std::string &part);
+		bool readAck();
+		bool send(const std::string &data);
+		bool sendVerdict(char verdict);
+		std::string headerVerdictFrame(char verdict, uint32_t stream = 0) const;
+		bool sendPart(char frameType, const std::string &part);
+		void delay() const;
+
+		bool serveReqmod();
+		bool serveRespmod();
+
+		// FEATURE_MULTIPLEX: what each stream got so far
+		struct Stream {
+			typedef enum { stStart, stResponse, stCause, stBody } State;
+			Stream(): state(stStart) {}
+			State state;
+			std::string id; // correlation ID
+			std::string request;
+			std::string response;
+		};
+		bool serveMultiplexed();
+		bool takeStreamFrame(uint32_t stream, char type, const std::string &payload, std::string &answer);
+		bool respmodStreamFrame(uint32_t stream, char type, const std::string &payload, std::string &answer);
+		std::string headerVerdict(uint32_t stream);
+
+		int handle;
+		bool respmod;
+		int version;
+		bool multiplexed;
+		bool acks; // the adapter acks each part
+		bool scanHints; // 's' carries settings.scanBytes
+		std::map<uint32_t, Stream> streams;
+		std::string in; // read but not used yet
+		std::mt19937 random;
+};
+
+bool Connection::fill() {
+	char buffer[65536];
+	for (;;) {
+		const ssize_t s = read(handle, buffer, sizeof(buffer));
+		if (s > 0) {
+			in.append(buffer, s);
+			return true;
+		}
+		if (s < 0 && errno == EINTR) {
+			continue;
+		}
+		return false;
+	}
+}
+
+// the NUL the adapters may send past a v1 header
+bool Connection::skipPadding() {
+	for (;;) {
+		std::string::size_type used = in.find_first_not_of('\0');
+		if (used != std::string::npos) {
+			in.erase(0, used);
+			return true;
+		}
+		in.clear();
+		if (!fill()) {
+			return false;
+		}
+	}
+}
+
+// v1: up to and including the empty line ending an HTTP header
+bool Connection::readBlock(std::string &block) {
+	if (!skipPadding()) {
+		return false;
+	}
+	for (;;) {
+		std::string::size_type end = in.find("\r\n\r\n");
+		std::string::size_type endSize = 4;
+		const std::string::size_type bare = in.find("\n\n");
+		if (bare < end) {
+			end = bare;
+			endSize = 2;
+		}
+		if (end != std::string::npos) {
+			block = in.substr(0, end + endSize);
+			in.erase(0, end + endSize);
+			return true;
+		}
+		if (!fill()) {
+			return false;
+		}
+	}
+}
+
+bool Connection::readExactly(size_t size, std::string &data) {
+	while (in.size() < size) {
+		if (!fill()) {
+			return false;
+		}
+	}
+	data = in.substr(0, size);
+	in.erase(0, size);
+	return true;
+}
+
+bool Connection::readFrame(char &type, std::string &payload) {
+	std::string header;
+	unsigned char flags;
+	uint32_t stream;
+	uint32_t length;
+	if (!readExactly(FRAME_HEADER_SIZE, header) || !ParseFrameHeader(header.data(), type, flags, stream, length) || stream) {
+		return false;
+	}
+	return readExactly(length, payload);
+}
+
+// a whole frame if one is buffered already, without reading
+bool Connection::takeFrame(char &type, uint32_t &stream, std::string &payload) {
+	unsigned char flags;
+	uint32_t length;
+	if (in.size() < FRAME_HEADER_SIZE || !ParseFrameHeader(in.data(), type, flags, stream, length) ||
+		in.size() - FRAME_HEADER_SIZE < length) {
+		return false;
+	}
+	payload = in.substr(FRAME_HEADER_SIZE, length);
+	in.erase(0, FRAME_HEADER_SIZE + length);
+	return true;
+}
+
+// a header from the adapter, as a frame of the given type in v2
+bool Connection::readPart(char frameType, std::string &part) {
+	if (version == PROTOCOL_V1) {
+		return readBlock(part);
+	}
+	char type;
+	return readFrame(type, part) && type == frameType;
+}
+
+// readPart() for a part that may come after a correlation ID frame
+bool Connection::readNamedPart(char frameType, std::string &id, std::string &part) {
+	id.clear();
+	if (version == PROTOCOL_V1) {
+		return readBlock(part);
+	}
+	char type;
+	if (!readFrame(type, part)) {
+		return false;
+	}
+	if (type == FRAME_CORRELATION) {
+		id.swap(part);
+		if (!readFrame(type, part)) {
+			return false;
+		}
+	}
+	return type == frameType;
+}
+
+bool Connection::readAck() {
+	if (!acks) {
+		return true;
+	}
+	if (version == PROTOCOL_V1) {
+		std::string ack;
+		return readExactly(1, ack) && ack[0] == 'r';
+	}
+	char type;
+	std::string payload;
+	return readFrame(type, payload) && type == FRAME_ACK;
+}
+
+bool Connection::send(const std::string &data) {
+	size_t written = 0;
+	while (written < data.size()) {
+		const ssize_t s = ::send(handle, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+		if (s < 0 && errno == EINTR) {
+			continue;
+		}
+		if (s <= 0) {
+			return false;
+		}
+		written += s;
+	}
+	return true;
+}
+
+// v2 has a flag for what v1 says with 'u'
+std::string VerdictFrame(char verdict, uint32_t stream = 0) {
+	if (verdict == 'u') {
+		return FrameHeader('v', 0, FRAME_FLAG_UNCACHEABLE, stream);
+	}
+	return FrameHeader(verdict, 0, 0, stream);
+}
+
+std::string PartFrame(char frameType, const std::string &part, uint32_t stream = 0) {
+	return FrameHeader(frameType, part.size(), 0, stream) + part;
+}
+
+// v2 RESPMOD: an 's' with the scan hints, if the adapter takes them
+std::string Connection::headerVerdictFrame(char verdict, uint32_t stream) const {
+	if (verdict != 's' || !scanHints) {
+		return VerdictFrame(verdict, stream);
+	}
+	return PartFrame('s', ScanHints(settings.scanBytes, settings.scanHintFlags), stream);
+}
+
+bool Connection::sendVerdict(char verdict) {
+	if (version == PROTOCOL_V1) {
+		return send(std::string(1, verdict));
+	}
+	return send(VerdictFrame(verdict));
+}
+
+// a header or body for the adapter: v1 ends it with an empty line
+bool Connection::sendPart(char frameType, const std::string &part) {
+	if (version == PROTOCOL_V1) {
+		return send(part);
+	}
+	return send(PartFrame(frameType, part));
+}
+
+void Connection::delay() const {
+	if (settings.delayMicros) {
+		std::this_thread::sleep_for(std::chrono::microseconds(settings.delayMicros));
+	}
+}
+
+// a page of pageSize bytes; in v1 it ends with the only empty line in it
+std::string Page() {
+	std::string page(settings.pageSize > 2 ? settings.pageSize - 2 : 0, 'x');
+	return page + "\n\n";
+}
+
+std::string PageHeader(const char *status) {
+	return std::string("HTTP/1.1 ") + status + "\nContent-Type: text/html\nContent-Length: " +
+		std::to_string(Page().size()) + "\n\n";
+}
+
+// the request with one more header field
+std::string Modified(const std::string &request) {
+	std::string::size_type end = request.rfind("\r\n\r\n");
+	if (end == std::string::npos) {
+		end = request.rfind("\n\n");
+	}
+	return request.substr(0, end) + "\nX-FG-Mock: modified\n\n";
+}
+
+bool Connection::serveReqmod() {
+	std::string id;
+	std::string request;
+	if (!readNamedPart(FRAME_HEADER, id, request)) {
+		return false;
+	}
+	if (!id.empty()) {
+		correlations.remember(id, request);
+	}
+	delay();
+	const char verdict = Draw(settings.verdicts, random);
+	if (!sendVerdict(verdict)) {
+		return false;
+	}
+	if (verdict == 'm') {
+		return sendPart(FRAME_HEADER, Modified(request)) && readAck();
+	}
+	if (verdict == 'b') {
+		return sendPart(FRAME_HEADER, PageHeader("403 Forbidden")) && readAck() &&
+			sendPart(FRAME_BODY, Page()) && readAck();
+	}
+	return true;
+}
+
+size_t ContentLength(const std::string &header) {
+	static const char name[] = "\ncontent-length:";
+	std::string lower = header;
+	for (std::string::iterator i = lower.begin(); i != lower.end(); ++i) {
+		*i = tolower(*i);
+	}
+	const std::string::size_type pos = lower.find(name);
+	return pos == std::string::npos ? 0 : strtoul(header.c_str() + pos + sizeof(name) - 1, 0, 10);
+}
+
+bool Connection::serveRespmod() {
+	std::string request;
+	std::string response;
+	if (version == PROTOCOL_V1) {
+		if (!readBlock(request) || !readBlock(response)) {
+			return false;
+		}
+	} else {
+		char type;
+		if (!readFrame(type, request)) {
+			return false;
+		}
+		if (type == FRAME_CORRELATION) {
+			// the ID REQMOD gave the request stands in for the cause header
+			const std::string id = request;
+			if (!readPart(FRAME_RESPONSE_HEADER, response)) {
+				return false;
+			}
+			if (!correlations.recall(id, request) &&
+				(!sendVerdict('c') || !readPart(FRAME_HEADER, request))) {
+				return false;
+			}
+		} else if (type != FRAME_HEADER || !readPart(FRAME_RESPONSE_HEADER, response)) {
+			return false;
+		}
+	}
+	delay();
+	const char verdict = Draw(settings.headerVerdicts, random);
+	if (!(version == PROTOCOL_V1 ? sendVerdict(verdict) : send(headerVerdictFrame(verdict))) || !readAck()) {
+		return false;
+	}
+	if (verdict != 's') {
+		return true;
+	}
+
+	if (version == PROTOCOL_V1) {
+		std::string body;
+		if (!readExactly(ContentLength(response), body)) {
+			return false;
+		}
+	} else {
+		for (;;) {
+			char type;
+			std::string piece;
+			if (!readFrame(type, piece)) {
+				return false;
+			}
+			if (type == FRAME_END_OF_BODY) {
+				break;
+			}
+		}
+	}
+	delay();
+	const char bodyVerdict = Draw(settings.bodyVerdicts, random);
+	if (!sendVerdict(bodyVerdict) || !readAck()) {
+		return false;
+	}
+	if (bodyVerdict == 'm') {
+		return sendPart(FRAME_HEADER, PageHeader("200 OK")) && readAck() &&
+			sendPart(FRAME_BODY, Page()) && readAck();
+	}
+	return true;
+}
+
+// Reads whatever frames came, for any stream, and answers those that are
+// due once nothing more is buffered. No acks go either way.
+bool Connection::serveMultiplexed() {
+	std::vector<std::string> answers;
+	for (;;) {
+		char type;
+		uint32_t stream;
+		std::string payload;
+		while (takeFrame(type, stream, payload)) {
+			std::string answer;
+			if (!takeStreamFrame(stream, type, payload, answer)) {
+				return false;
+			}
+			if (!answer.empty()) {
+				answers.push_back(answer);
+			}
+		}
+		if (!answers.empty()) {
+			delay();
+			std::shuffle(answers.begin(), answers.end(), random);
+			std::string out;
+			for (std::vector<std::string>::const_iterator i = answers.begin(); i != answers.end(); ++i) {
+				out += *i;
+			}
+			answers.clear();
+			if (!send(out)) {
+				return false;
+			}
+		}
+		if (!fill()) {
+			return false;
+		}
+	}
+}
+
+// one frame of a stream; answer gets what the stream has to say now
+bool Connection::takeStreamFrame(uint32_t stream, char type, const std::string &payload, std::string &answer) {
+	if (!stream) {
+		return false;
+	}
+	if (type == FRAME_CANCEL) {
+		streams.erase(stream);
+		return true;
+	}
+	if (respmod) {
+		return respmodStreamFrame(stream, type, payload, answer);
+	}
+	if (type == FRAME_CORRELATION) {
+		streams[stream].id = payload;
+		return true;
+	}
+	if (type != FRAME_HEADER) {
+		return false;
+	}
+	const std::map<uint32_t, Stream>::iterator named = streams.find(stream);
+	if (named != streams.end()) {
+		correlations.remember(named->second.id, payload);
+		streams.erase(named);
+	}
+	const char verdict = Draw(settings.verdicts, random);
+	answer = VerdictFrame(verdict, stream);
+	if (verdict == 'm') {
+		answer += PartFrame(FRAME_HEADER, Modified(payload), stream);
+	} else if (verdict == 'b') {
+		answer += PartFrame(FRAME_HEADER, PageHeader("403 Forbidden"), stream) + PartFrame(FRAME_BODY, Page(), stream);
+	}
+	return true;
+}
+
+bool Connection::respmodStreamFrame(uint32_t stream, char type, const std::string &payload, std::string &answer) {
+	Stream &s = streams[stream];
+	switch (s.state) {
+		case Stream::stStart:
+			if (type == FRAME_CORRELATION) {
+				s.id = payload;
+			} else if (type == FRAME_HEADER) {
+				s.request = payload;
+			} else {
+				return false;
+			}
+			s.state = Stream::stResponse;
+			return true;
+		case Stream::stResponse:
+			if (type != FRAME_RESPONSE_HEADER) {
+				return false;
+			}
+			s.response = payload;
+			if (!s.id.empty() && !correlations.recall(s.id, s.request)) {
+				s.state = Stream::stCause;
+				answer = VerdictFrame('c', stream);
+				return true;
+			}
+			answer = headerVerdict(stream);
+			return true;
+		case Stream::stCause:
+			if (type != FRAME_HEADER) {
+				return false;
+			}
+			s.request = payload;
+			answer = headerVerdict(stream);
+			return true;
+		case Stream::stBody:
+			if (type == FRAME_BODY) {
+				return true;
+			}
+			if (type != FRAME_END_OF_BODY) {
+				return false;
+			}
+			break;
+	}
+	streams.erase(stream);
+	const char bodyVerdict = Draw(settings.bodyVerdicts, random);
+	answer = VerdictFrame(bodyVerdict, stream);
+	if (bodyVerdict == 'm') {
+		answer += PartFrame(FRAME_HEADER, PageHeader("200 OK"), stream) + PartFrame(FRAME_BODY, Page(), stream);
+	}
+	return true;
+}
+
+// the RESPMOD header verdict; the stream waits for the body after an 's'
+std::string Connection::headerVerdict(uint32_t stream) {
+	const char verdict = Draw(settings.headerVerdicts, random);
+	if (verdict == 's') {
+		streams[stream].state = Stream::stBody;
+	} else {
+		streams.erase(stream);
+	}
+	return headerVerdictFrame(verdict, stream);
+}
+
+void Connection::serve() {
+	// a v2 adapter starts with a hello, a v1 one with a header (or the reset byte)
+	std::string hello;
+	if (!readExactly(3, hello)) {
+		return;
+	}
+	if (hello == "FGP") {
+		std::string rest;
+		if (!readExactly(HELLO_SIZE - 3, rest)) {
+			return;
+		}
+		version = std::min<int>(rest[0], settings.highestVersion);
+		uint32_t features;
+		memcpy(&features, rest.data() + 1, sizeof(features));
+		features = ntohl(features) & ((settings.correlations ? FEATURE_CORRELATION : 0) |
+			(settings.multiplex ? FEATURE_MULTIPLEX : 0) | (settings.noAcks ? FEATURE_NO_ACKS : 0) |
+			(settings.scanBytes ? FEATURE_SCAN_HINTS : 0));
+		if (version == PROTOCOL_V1) {
+			features = 0;
+		}
+		multiplexed = features & FEATURE_MULTIPLEX;
+		acks = !(features & (FEATURE_MULTIPLEX | FEATURE_NO_ACKS));
+		scanHints = features & FEATURE_SCAN_HINTS;
+		features = htonl(features);
+		std::string answer("FGP", 3);
+		answer += static_cast<char>(version);
+		answer.append(reinterpret_cast<const char*>(&features), sizeof(features));
+		if (!send(answer)) {
+			return;
+		}
+	} else {
+		in.insert(0, hello);
+	}
+	if (multiplexed) {
+		serveMultiplexed();
+		return;
+	}
+
+	for (;;) {
+		if (version == PROTOCOL_V1) {
+			if (!skipPadding()) {
+				return;
+			}
+			if (in[0] == 'n') {
+				in.erase(0, 1); // transaction reset on a pooled connection
+			}
+		}
+		if (!(respmod ? serveRespmod() : serveReqmod())) {
+			return;
+		}
+	}
+}
+
+void Usage(const char *program) {
+	fprintf(stderr,
+		"usage: %s -s socket [-k reqmod|respmod] [-R respmod socket] [-V verdicts]\n"
+		"          [-H header verdicts] [-B body verdicts] [-d delay microseconds]\n"
+		"          [-p page size] [-P highest protocol version] [-C correlations] [-M] [-K]\n"
+		"          [-S scan bytes[:prefix]]\n"
+		"  verdicts are weighted, e.g. v:90,m:5,b:5 (REQMOD, default v:1) or\n"
+		"  v:50,s:50 (RESPMOD headers, default s:1); -B v:95,m:5 (RESPMOD body, default v:1)\n"
+		"  -R serves REQMOD on socket and RESPMOD on respmod socket, -V is then the REQMOD\n"
+		"  verdicts and -H the RESPMOD header verdicts; -C is how many correlated requests\n"
+		"  to remember (default 65536, 0 refuses correlation); -M refuses multiplexing,\n"
+		"  -K refuses to do without acks; -S sends a scan hint with every 's'\n",
+		program);
+	exit(2);
+}
+
+int Listen(const std::string &path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+	unlink(path.c_str());
+	const int listenHandle = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenHandle < 0 || bind(listenHandle, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+		listen(listenHandle, SOMAXCONN) < 0) {
+		perror(path.c_str());
+		exit(1);
+	}
+	fprintf(stderr, "listening on %s\n", path.c_str());
+	return listenHandle;
+}
+
+void Accept(int listenHandle, bool respmod) {
+	for (;;) {
+		const int handle = accept4(listenHandle, 0, 0, SOCK_CLOEXEC);
+		if (handle < 0) {
+			if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+				continue;
+			}
+			perror("accept");
+			exit(1);
+		}
+		std::thread([handle, respmod]() {
+			Connection connection(handle, respmod);
+			connection.serve();
+		}).detach();
+	}
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	std::string verdicts;
+	std::string headerVerdicts;
+	std::string bodyVerdicts = "v:1";
+	int opt;
+	while ((opt = getopt(argc, argv, "s:k:R:V:H:B:d:p:P:C:MKS:")) != -1) {
+		switch (opt) {
+			case 's':
+				settings.socketPath = optarg;
+				break;
+			case 'k':
+				if (strcmp(optarg, "reqmod") && strcmp(optarg, "respmod")) {
+					Usage(argv[0]);
+				}
+				settings.respmod = strcmp(optarg, "respmod") == 0;
+				break;
+			case 'R':
+				settings.respmodSocketPath = optarg;
+				break;
+			case 'V':
+				verdicts = optarg;
+				break;
+			case 'H':
+				headerVerdicts = optarg;
+				break;
+			case 'B':
+				bodyVerdicts = optarg;
+				break;
+			case 'd':
+				settings.delayMicros = strtoul(optarg, 0, 10);
+				break;
+			case 'p':
+				settings.pageSize = strtoul(optarg, 0, 10);
+				break;
+			case 'P':
+				settings.highestVersion = atoi(optarg);
+				if (settings.highestVersion != PROTOCOL_V1 && settings.highestVersion != PROTOCOL_V2) {
+					Usage(argv[0]);
+				}
+				break;
+			case 'C':
+				settings.correlations = strtoul(optarg, 0, 10);
+				break;
+			case 'M':
+				settings.multiplex = false;
+				break;
+			case 'K':
+				settings.noAcks = false;
+				break;
+			case 'S': {
+				char *end;
+				settings.scanBytes = strtoul(optarg, &end, 10);
+				if (!strcmp(end, ":prefix")) {
+					settings.scanHintFlags = SCAN_HINT_PREFIX;
+				} else if (*end) {
+					Usage(argv[0]);
+				}
+				break;
+			}
+			default:
+				Usage(argv[0]);
+		}
+	}
+	if (settings.socketPath.empty() || (settings.respmod && !settings.respmodSocketPath.empty())) {
+		Usage(argv[0]);
+	}
+	if (settings.respmod && !verdicts.empty()) {
+		headerVerdicts = verdicts; // -k respmod -V means the header verdicts
+		verdicts.clear();
+	}
+	if (verdicts.empty()) {
+		verdicts = "v:1";
+	}
+	if (headerVerdicts.empty()) {
+		headerVerdicts = "s:1";
+	}
+	if (!ParseWeights(verdicts, "vumb", settings.verdicts) ||
+		!ParseWeights(headerVerdicts, "vs", settings.headerVerdicts) ||
+		!ParseWeights(bodyVerdicts, "vm", settings.bodyVerdicts)) {
+		Usage(argv[0]);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	const int listenHandle = Listen(settings.socketPath);
+	if (!settings.respmodSocketPath.empty()) {
+		const int respmodHandle = Listen(settings.respmodSocketPath);
+		std::thread([respmodHandle]() {
+			Accept(respmodHandle, true);
+		}).detach();
+	}
+	Accept(listenHandle, settings.respmod);
+}
@@ -0,0 +1,115 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <functional>
+
+#include "fg_balancer.h"
+
+Adapter::Backend::Backend(const std::string &aSocketPath, size_t anIndex):
+	socketPath(aSocketPath), index(anIndex), outstanding(0) {
+}
+
+Adapter::Balancer::Balancer(): method(bmLeastOutstanding), started(false), draws(0) {
+}
+
+Adapter::Balancer::~Balancer() {
+	stop();
+}
+
+void Adapter::Balancer::configure(const std::vector<std::string> &socketPaths, Method aMethod) {
+	stop(); // transactions still holding the old backends will close their connections
+	all.clear();
+	for (size_t i = 0; i < socketPaths.size(); ++i) {
+		all.push_back(Pointer(new Backend(socketPaths[i], i)));
+	}
+	method = aMethod;
+}
+
+void Adapter::Balancer::start() {
+	for (size_t i = 0; i < all.size(); ++i) {
+		all[i]->pool.start();
+		all[i]->breaker.start();
+	}
+	started = true;
+}
+
+void Adapter::Balancer::stop() {
+	for (size_t i = 0; i < all.size(); ++i) {
+		all[i]->breaker.stop();
+		all[i]->pool.stop();
+	}
+	started = false;
+}
+
+Adapter::Balancer::Pointer Adapter::Balancer::pick(const std::string &clientIp) const {
+	const size_t count = all.size();
+	if (count == 0) {
+		return Pointer();
+	}
+	if (count == 1) {
+		return all[0]->breaker.closed() ? all[0] : Pointer();
+	}
+	if (method == bmClientIp && !clientIp.empty()) {
+		const size_t home = std::hash<std::string>()(clientIp) % count;
+		for (size_t i = 0; i < count; ++i) {
+			const Pointer &candidate = all[(home + i) % count];
+			if (candidate->breaker.closed()) {
+				return candidate;
+			}
+		}
+		return Pointer();
+	}
+	uint64_t draw = draws.fetch_add(1, std::memory_order_relaxed);
+	if (method == bmTwoChoices) {
+		// splitmix64, so that consecutive draws pick unrelated pairs
+		draw += 0x9E3779B97F4A7C15ULL;
+		draw = (draw ^ (draw >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		draw = (draw ^ (draw >> 27)) * 0x94D049BB133111EBULL;
+		draw ^= draw >> 31;
+		const Pointer &first = all[draw % count];
+		const Pointer &second = all[(draw / count % (count - 1) + 1 + first->index) % count];
+		const bool firstUp = first->breaker.closed();
+		const bool secondUp = second->breaker.closed();
+		if (firstUp && secondUp) {
+			return second->outstanding.load(std::memory_order_relaxed) <
+				first->outstanding.load(std::memory_order_relaxed) ? second : first;
+		}
+		if (firstUp || secondUp) {
+			return firstUp ? first : second;
+		}
+		// both down: look at all of them
+	}
+	return leastOutstanding(draw % count);
+}
+
+Adapter::Balancer::Pointer Adapter::Balancer::next(const Backend &failed) const {
+	const size_t count = all.size();
+	for (size_t i = 1; i < count; ++i) {
+		const Pointer &candidate = all[(failed.index + i) % count];
+		if (candidate.get() != &failed && candidate->breaker.closed()) {
+			return candidate;
+		}
+	}
+	return Pointer();
+}
+
+Adapter::Balancer::Pointer Adapter::Balancer::leastOutstanding(size_t from) const {
+	const size_t count = all.size();
+	Pointer best;
+	size_t bestLoad = 0;
+	for (size_t i = 0; i < count; ++i) {
+		const Pointer &candidate = all[(from + i) % count];
+		if (!candidate->breaker.closed()) {
+			continue;
+		}
+		const size_t load = candidate->outstanding.load(std::memory_order_relaxed);
+		if (!best || load < bestLoad) {
+			best = candidate;
+			bestLoad = load;
+			if (!load) {
+				break; // nothing beats an idle backend
+			}
+		}
+	}
+	return best;
+}
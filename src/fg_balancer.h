@@ -0,0 +1,85 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_BALANCER_H
+#define FG_BALANCER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fg_circuit_breaker.h"
+#include "fg_connection_pool.h"
+#include "fg_event_loop.h"
+
+namespace Adapter {
+
+// One ecapguardian listener: its connections, its health, and how many
+// transactions hold one of its connections (or streams) right now.
+class Backend {
+	public:
+		Backend(const std::string &aSocketPath, size_t anIndex);
+
+		const std::string socketPath;
+		const size_t index; // in ecapguardian_listen_socket
+		ConnectionPool pool;
+		CircuitBreaker breaker; // probes through pool, so it is destroyed first
+		std::atomic<size_t> outstanding;
+		std::vector<ChannelPointer> channels; // host thread: multiplexed connections
+};
+
+// Spreads transactions over several ecapguardian listeners.
+//
+// pick() only considers backends whose circuit breaker is closed, and
+// chooses among them by method:
+//  - bmLeastOutstanding: the one with the fewest transactions in flight,
+//    scanning from a rotating start so that ties take turns
+//  - bmTwoChoices: the less busy of two drawn at random, which needs no
+//    scan however many backends there are
+//  - bmClientIp: the one the client IP hashes to, so that a client's
+//    transactions meet the same ecapguardian (and its per-client state);
+//    while that one is down the client moves on to the next healthy one
+//
+// A transaction keeps the Backend it picked alive until it releases the
+// connection, so a reconfiguration never pulls a pool from under it; the
+// old pools just stop keeping connections.
+class Balancer {
+	public:
+		typedef enum { bmLeastOutstanding, bmTwoChoices, bmClientIp } Method;
+		typedef std::shared_ptr<Backend> Pointer;
+
+		Balancer();
+		~Balancer();
+
+		// stops and replaces the backends; configure their pools and
+		// breakers before start()ing the new ones
+		void configure(const std::vector<std::string> &socketPaths, Method aMethod);
+		void start(); // pools and breakers of all backends
+		void stop();
+
+		bool running() const { return started; }
+		bool byClientIp() const { return method == bmClientIp; }
+
+		// a backend whose breaker is closed, or null if all of them are open;
+		// clientIp only matters for bmClientIp
+		Pointer pick(const std::string &clientIp) const;
+		// the first backend with a closed breaker after failed, going round;
+		// null if there is none but failed itself
+		Pointer next(const Backend &failed) const;
+
+		const std::vector<Pointer> &backends() const { return all; }
+
+	private:
+		Pointer leastOutstanding(size_t from) const;
+
+		std::vector<Pointer> all;
+		Method method;
+		bool started; // start() was called, stop() was not
+		mutable std::atomic<uint64_t> draws; // rotates starts, seeds random choices
+};
+
+} // namespace Adapter
+
+#endif
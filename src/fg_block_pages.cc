@@ -0,0 +1,122 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <string>
+
+#include <libecap/common/registry.h>
+#include <libecap/common/header.h>
+#include <libecap/common/names.h>
+#include <libecap/host/host.h>
+
+#include "fg_block_pages.h"
+
+static const std::string PLACEHOLDER_START = "${";
+static const std::string PLACEHOLDER_END = "}";
+
+static Adapter::BodyStore::ChunkPointer TextChunk(const std::string &text) {
+	Adapter::BodyStore::ChunkPointer chunk(new Adapter::BodyStore::Chunk);
+	chunk->data = text;
+	return chunk;
+}
+
+Adapter::BlockPage::BlockPage(const std::string &header, const std::string &body) {
+	prototype = libecap::MyHost().newResponse();
+	prototype->header().parse(libecap::Area::FromTempString(header));
+	prototype->addBody();
+
+	std::string::size_type pos = 0;
+	for (;;) {
+		Piece piece;
+		const std::string::size_type start = body.find(PLACEHOLDER_START, pos);
+		const std::string::size_type end = start == std::string::npos ? start : body.find(PLACEHOLDER_END, start);
+		if (end == std::string::npos) {
+			piece.text = TextChunk(body.substr(pos));
+			pieces.push_back(piece);
+			return;
+		}
+		piece.text = TextChunk(body.substr(pos, start - pos));
+		piece.name = body.substr(start + PLACEHOLDER_START.size(), end - start - PLACEHOLDER_START.size());
+		pieces.push_back(piece);
+		pos = end + PLACEHOLDER_END.size();
+	}
+}
+
+std::string Adapter::BlockPage::Id(const std::string &reference) {
+	return reference.substr(0, reference.find('\0'));
+}
+
+libecap::shared_ptr<libecap::Message> Adapter::BlockPage::render(const std::string &reference, BodyStore &store) const {
+	std::map<std::string, std::string> values;
+	std::string::size_type pos = reference.find('\0');
+	while (pos != std::string::npos) {
+		const std::string::size_type nameEnd = reference.find('\0', pos + 1);
+		if (nameEnd == std::string::npos) {
+			break; // a name without a value
+		}
+		const std::string::size_type valueEnd = reference.find('\0', nameEnd + 1);
+		values[reference.substr(pos + 1, nameEnd - pos - 1)] =
+			reference.substr(nameEnd + 1, valueEnd == std::string::npos ? std::string::npos : valueEnd - nameEnd - 1);
+		pos = valueEnd;
+	}
+
+	const BodyStore::size_type before = store.size();
+	for (std::vector<Piece>::const_iterator i = pieces.begin(); i != pieces.end(); ++i) {
+		store.share(i->text);
+		if (!i->name.empty()) {
+			const std::map<std::string, std::string>::const_iterator value = values.find(i->name);
+			if (value != values.end()) {
+				store.append(value->second.data(), value->second.size());
+			}
+		}
+	}
+
+	libecap::shared_ptr<libecap::Message> response = prototype->clone();
+	const std::string length = std::to_string(store.size() - before);
+	response->header().removeAny(libecap::headerContentLength);
+	response->header().add(libecap::headerContentLength, libecap::Area::FromTempString(length));
+	return response;
+}
+
+Adapter::BlockPageCache::BlockPageCache(): capacity(0) {
+}
+
+void Adapter::BlockPageCache::configure(size_t aCapacity) {
+	std::lock_guard<std::mutex> lock(mutex);
+	capacity = aCapacity;
+	entries.clear();
+	index.clear();
+}
+
+Adapter::BlockPagePointer Adapter::BlockPageCache::find(const std::string &id) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	const std::map<std::string, Entries::iterator>::const_iterator i = index.find(id);
+	if (i == index.end()) {
+		return BlockPagePointer();
+	}
+	entries.splice(entries.begin(), entries, i->second);
+	return i->second->second;
+}
+
+void Adapter::BlockPageCache::insert(const std::string &id, const BlockPagePointer &page) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!capacity) {
+		return;
+	}
+	const std::map<std::string, Entries::iterator>::iterator i = index.find(id);
+	if (i != index.end()) {
+		entries.erase(i->second);
+		index.erase(i);
+	}
+	entries.push_front(std::make_pair(id, page));
+	index[id] = entries.begin();
+	while (entries.size() > capacity) {
+		index.erase(entries.back().first);
+		entries.pop_back();
+	}
+}
+
+void Adapter::BlockPageCache::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.clear();
+	index.clear();
+}
@@ -0,0 +1,77 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_BLOCK_PAGES_H
+#define FG_BLOCK_PAGES_H
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <libecap/common/message.h>
+
+#include "fg_body_store.h"
+
+namespace Adapter {
+
+// A block page template as ecapguardian sent it once: a response header,
+// parsed into a message that is cloned for every use, and a body with
+// ${name} placeholders, split into shared text chunks and the names
+// between them. Rendering copies neither the header text nor the body text.
+//
+// Must be made on the host thread (it asks the host for a message).
+class BlockPage {
+	public:
+		// throws libecap::TextException when the header does not parse
+		BlockPage(const std::string &header, const std::string &body);
+
+		// A response with the body going to store. reference is what came
+		// with the 't' verdict: the template ID, then NUL separated names
+		// and values; placeholders without a value are left empty.
+		libecap::shared_ptr<libecap::Message> render(const std::string &reference, BodyStore &store) const;
+
+		// the ID part of a template reference
+		static std::string Id(const std::string &reference);
+
+	private:
+		struct Piece {
+			BodyStore::ChunkPointer text; // literal text, or
+			std::string name; // the placeholder that follows it, if any
+		};
+
+		libecap::shared_ptr<libecap::Message> prototype;
+		std::vector<Piece> pieces;
+};
+
+typedef std::shared_ptr<const BlockPage> BlockPagePointer;
+
+// The block page templates seen so far, by ID, least recently used ones
+// dropped first. ecapguardian must give a changed page a new ID.
+// Thread-safe: the event loop thread looks templates up while parsing.
+class BlockPageCache {
+	public:
+		BlockPageCache();
+
+		// capacity == 0 disables the cache; drops all templates
+		void configure(size_t capacity);
+		bool enabled() const { return capacity > 0; }
+
+		BlockPagePointer find(const std::string &id) const;
+		void insert(const std::string &id, const BlockPagePointer &page);
+		void clear();
+
+	private:
+		typedef std::list<std::pair<std::string, BlockPagePointer> > Entries;
+
+		mutable std::mutex mutex; // protects entries and index
+		mutable Entries entries; // most recently used first
+		std::map<std::string, Entries::iterator> index;
+		size_t capacity;
+};
+
+} // namespace Adapter
+
+#endif
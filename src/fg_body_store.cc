@@ -0,0 +1,76 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <algorithm>
+
+#include "fg_body_store.h"
+
+const Adapter::BodyStore::size_type Adapter::BodyStore::CHUNK_SIZE;
+
+Adapter::BodyStore::BodyStore(): head(0), bytes(0), sharedTail(false) {
+}
+
+void Adapter::BodyStore::append(const char *data, size_type size) {
+	bytes += size;
+	while (size > 0) {
+		// Areas handed out earlier point into the chunk data, so a chunk
+		// is only appended to while that does not reallocate it
+		if (chunks.empty() || sharedTail || chunks.back()->data.size() == chunks.back()->data.capacity()) {
+			chunks.push_back(ChunkPointer(new Chunk));
+			chunks.back()->data.reserve(CHUNK_SIZE);
+			sharedTail = false;
+		}
+		std::string &tail = chunks.back()->data;
+		const size_type used = std::min(size, tail.capacity() - tail.size());
+		tail.append(data, used);
+		data += used;
+		size -= used;
+	}
+}
+
+void Adapter::BodyStore::adopt(std::string &data) {
+	if (data.empty()) {
+		return;
+	}
+	bytes += data.size();
+	chunks.push_back(ChunkPointer(new Chunk));
+	chunks.back()->data.swap(data);
+	sharedTail = false;
+}
+
+void Adapter::BodyStore::share(const ChunkPointer &chunk) {
+	if (chunk->data.empty()) {
+		return;
+	}
+	bytes += chunk->data.size();
+	chunks.push_back(chunk);
+	sharedTail = true;
+}
+
+libecap::Area Adapter::BodyStore::content(size_type offset, size_type size) const {
+	offset += head;
+	for (std::deque<ChunkPointer>::const_iterator i = chunks.begin(); i != chunks.end(); ++i) {
+		const std::string &data = (*i)->data;
+		if (offset < data.size()) {
+			return libecap::Area(data.data() + offset, std::min(size, data.size() - offset), *i);
+		}
+		offset -= data.size();
+	}
+	return libecap::Area();
+}
+
+void Adapter::BodyStore::shift(size_type size) {
+	size = std::min(size, bytes);
+	bytes -= size;
+	head += size;
+	while (!chunks.empty() && head >= chunks.front()->data.size()) {
+		head -= chunks.front()->data.size();
+		chunks.pop_front();
+	}
+}
+
+void Adapter::BodyStore::clear() {
+	chunks.clear();
+	head = bytes = 0;
+	sharedTail = false;
+}
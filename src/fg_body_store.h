@@ -0,0 +1,62 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_BODY_STORE_H
+#define FG_BODY_STORE_H
+
+#include <deque>
+#include <string>
+#include <libecap/common/area.h>
+
+namespace Adapter {
+
+// Adapted body waiting for the host to take it: the buffered virgin body,
+// a block page or a rewritten body.
+//
+// The bytes live in a queue of reference counted chunks. content() hands
+// out areas that point into a chunk and share its ownership, so the host
+// may keep them after shift() without us copying anything, and shift()
+// only drops chunks from the front instead of moving the rest of the body.
+class BodyStore {
+	public:
+		typedef libecap::size_type size_type;
+
+		class Chunk: public libecap::AreaDetails {
+			public:
+				std::string data; // never grows past its capacity, see append()
+		};
+		typedef libecap::shared_ptr<Chunk> ChunkPointer;
+
+		BodyStore();
+
+		// copies data to the end, filling up the last chunk first
+		void append(const char *data, size_type size);
+		// appends the string as a chunk of its own, without copying it;
+		// data is left empty
+		void adopt(std::string &data);
+		// appends a chunk that other stores may hold as well; it is
+		// never appended to
+		void share(const ChunkPointer &chunk);
+
+		// up to size bytes starting at offset; may return less than
+		// asked when the range spans chunks, an empty area past the end
+		libecap::Area content(size_type offset, size_type size) const;
+		// forgets the first size bytes
+		void shift(size_type size);
+
+		size_type size() const { return bytes; }
+		bool empty() const { return bytes == 0; }
+		void clear();
+
+		static const size_type CHUNK_SIZE = 64*1024;
+
+	private:
+		std::deque<ChunkPointer> chunks;
+		size_type head; // bytes of chunks.front() already shifted out
+		size_type bytes; // bytes stored and not shifted out
+		bool sharedTail; // chunks.back() came from share()
+};
+
+} // namespace Adapter
+
+#endif
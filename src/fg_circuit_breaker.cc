@@ -0,0 +1,115 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <chrono>
+
+#include "fg_circuit_breaker.h"
+
+Adapter::CircuitBreaker::CircuitBreaker():
+	failureLimit(0), slowMicros(0), probeInterval(1000), metrics(0),
+	state(stClosed), failures(0), stopping(false) {
+}
+
+Adapter::CircuitBreaker::~CircuitBreaker() {
+	stop();
+	if (metrics && !closed()) {
+		metrics->breakerOpen.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+void Adapter::CircuitBreaker::configure(size_t aFailureLimit, uint64_t aSlowMicros, unsigned aProbeInterval,
+	std::function<bool()> aProbe, Metrics *aMetrics) {
+	const bool running = thread.joinable();
+	stop();
+	if (metrics && !closed()) {
+		metrics->breakerOpen.fetch_sub(1, std::memory_order_relaxed);
+	}
+	failureLimit = aFailureLimit;
+	slowMicros = aSlowMicros;
+	probeInterval = aProbeInterval > 0 ? aProbeInterval : 1;
+	probe = aProbe;
+	metrics = aMetrics;
+	state.store(stClosed, std::memory_order_relaxed);
+	failures.store(0, std::memory_order_relaxed);
+	if (running) {
+		start();
+	}
+}
+
+void Adapter::CircuitBreaker::start() {
+	if (!failureLimit || thread.joinable()) {
+		return;
+	}
+	stopping = false;
+	thread = std::thread(&CircuitBreaker::run, this);
+}
+
+void Adapter::CircuitBreaker::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	if (thread.joinable()) {
+		thread.join();
+	}
+}
+
+void Adapter::CircuitBreaker::success(uint64_t latencyMicros) {
+	if (slowMicros && latencyMicros > slowMicros) {
+		failure();
+		return;
+	}
+	if (failures.load(std::memory_order_relaxed)) {
+		failures.store(0, std::memory_order_relaxed);
+	}
+}
+
+void Adapter::CircuitBreaker::failure() {
+	if (!failureLimit) {
+		return;
+	}
+	if (failures.fetch_add(1, std::memory_order_relaxed) + 1 < failureLimit) {
+		return;
+	}
+	int expected = stClosed;
+	if (state.compare_exchange_strong(expected, stOpen)) {
+		if (metrics) {
+			metrics->breakerTrips.fetch_add(1, std::memory_order_relaxed);
+			metrics->breakerOpen.fetch_add(1, std::memory_order_relaxed);
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex); // run() is waiting, not between closed() and wait()
+		}
+		wakeup.notify_all();
+	}
+}
+
+// Runs on its own thread: sleeps while the breaker is closed, probes
+// ecapguardian every probeInterval while it is open.
+void Adapter::CircuitBreaker::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopping) {
+		if (closed()) {
+			wakeup.wait(lock);
+			continue;
+		}
+		wakeup.wait_for(lock, std::chrono::milliseconds(probeInterval));
+		if (stopping) {
+			break;
+		}
+		state.store(stHalfOpen, std::memory_order_relaxed);
+		lock.unlock();
+		const bool back = probe && probe();
+		lock.lock();
+		if (back) {
+			failures.store(0, std::memory_order_relaxed);
+			state.store(stClosed, std::memory_order_relaxed);
+			if (metrics) {
+				metrics->breakerOpen.fetch_sub(1, std::memory_order_relaxed);
+			}
+		} else {
+			state.store(stOpen, std::memory_order_relaxed);
+		}
+	}
+}
@@ -0,0 +1,71 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_CIRCUIT_BREAKER_H
+#define FG_CIRCUIT_BREAKER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "fg_metrics.h"
+
+namespace Adapter {
+
+// Keeps transactions away from an ecapguardian that is down or struggling.
+//
+// Closed, every transaction talks to ecapguardian and reports how that went.
+// After failureLimit failures in a row (a reply slower than slowMicros
+// counts as one) the breaker opens: closed() turns false, and transactions
+// skip ecapguardian without so much as a connect(). Its thread then
+// half-opens the breaker every probeInterval milliseconds to try the probe;
+// the first probe that succeeds closes it again.
+//
+// closed() and success() are a relaxed atomic load or two, so a running
+// breaker costs next to nothing per transaction; with failureLimit 0 it
+// stays closed and the thread is not started.
+class CircuitBreaker {
+	public:
+		CircuitBreaker();
+		~CircuitBreaker();
+
+		// probe is called on the breaker thread and says whether
+		// ecapguardian is back; metrics, if set, counts trips and rejections
+		void configure(size_t failureLimit, uint64_t slowMicros, unsigned probeInterval,
+			std::function<bool()> probe, Metrics *metrics);
+		void start(); // does nothing unless failureLimit is set
+		void stop();
+		bool running() const { return thread.joinable(); }
+
+		bool closed() const { return state.load(std::memory_order_relaxed) == stClosed; }
+
+		// what a transaction saw of ecapguardian
+		void success(uint64_t latencyMicros);
+		void failure();
+
+	private:
+		typedef enum { stClosed, stOpen, stHalfOpen } State;
+
+		void run();
+
+		size_t failureLimit;
+		uint64_t slowMicros;
+		unsigned probeInterval; // milliseconds
+		std::function<bool()> probe;
+		Metrics *metrics;
+
+		std::atomic<int> state; // State
+		std::atomic<size_t> failures; // in a row
+
+		std::mutex mutex; // for wakeup and stopping
+		std::condition_variable wakeup;
+		bool stopping;
+		std::thread thread;
+};
+
+} // namespace Adapter
+
+#endif
@@ -0,0 +1,50 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include <libecap/common/errors.h>
+
+#include "fg_config.h"
+
+Adapter::size_type Adapter::ParseSize(const std::string &errorPrefix, const libecap::Name &name, const std::string &value) {
+	char *end = 0;
+	errno = 0;
+	const unsigned long long result = strtoull(value.c_str(), &end, 10);
+	if (value.empty() || value[0] == '-' || errno || *end != '\0') {
+		throw libecap::TextException(errorPrefix + name.image() +
+			" expects a non-negative number, got '" + value + "'");
+	}
+	return result;
+}
+
+bool Adapter::ParseBool(const std::string &errorPrefix, const libecap::Name &name, const std::string &value) {
+	if (value == "on" || value == "true" || value == "yes" || value == "1") {
+		return true;
+	}
+	if (value == "off" || value == "false" || value == "no" || value == "0") {
+		return false;
+	}
+	throw libecap::TextException(errorPrefix + name.image() +
+		" expects on/off, got '" + value + "'");
+}
+
+std::vector<std::string> Adapter::ParseList(const std::string &value, bool lowercase) {
+	std::vector<std::string> items;
+	std::string item;
+	for (std::string::size_type i = 0; i <= value.size(); ++i) {
+		if (i == value.size() || value[i] == ',') {
+			if (!item.empty()) {
+				items.push_back(item);
+				item.clear();
+			}
+		} else if (!isspace(static_cast<unsigned char>(value[i]))) {
+			item += lowercase ? tolower(static_cast<unsigned char>(value[i])) : value[i];
+		}
+	}
+	return items;
+}
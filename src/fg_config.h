@@ -0,0 +1,27 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_CONFIG_H
+#define FG_CONFIG_H
+
+#include <string>
+#include <vector>
+
+#include <libecap/common/forward.h>
+#include <libecap/common/name.h>
+
+namespace Adapter {
+
+using libecap::size_type;
+
+// Helpers for turning ecap_service option values into numbers.
+// Both throw libecap::TextException (starting with errorPrefix) on garbage.
+size_type ParseSize(const std::string &errorPrefix, const libecap::Name &name, const std::string &value);
+bool ParseBool(const std::string &errorPrefix, const libecap::Name &name, const std::string &value);
+// Splits a comma separated option value into items, ignoring whitespace
+// and empty items. Items are lowercased unless that is turned off.
+std::vector<std::string> ParseList(const std::string &value, bool lowercase = true);
+
+} // namespace Adapter
+
+#endif
@@ -0,0 +1,233 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+
+#include "fg_connection_pool.h"
+
+const char Adapter::ConnectionPool::FLAG_XACTION_RESET;
+
+Adapter::ConnectionPool::ConnectionPool():
+	minSize(0), maxSize(0), idleTimeout(0), nonBlocking(false),
+	wantedVersion(PROTOCOL_V1), wantedFeatures(0),
+	connectTimeoutMs(5000), receiveTimeoutMs(0), sendTimeoutMs(0), stopping(false) {
+}
+
+Adapter::ConnectionPool::~ConnectionPool() {
+	stop();
+}
+
+void Adapter::ConnectionPool::configure(const std::string &aSocketPath, size_t aMinSize, size_t aMaxSize, time_t anIdleTimeout,
+	bool aNonBlocking, int aVersion, uint32_t aFeatures, int aConnectTimeoutMs, int aReceiveTimeoutMs, int aSendTimeoutMs) {
+	const bool running = reaper.joinable();
+	stop(); // connections to the old socket path are of no use any more
+	socketPath = aSocketPath;
+	maxSize = aMaxSize;
+	minSize = aMinSize < aMaxSize ? aMinSize : aMaxSize;
+	idleTimeout = anIdleTimeout;
+	nonBlocking = aNonBlocking;
+	wantedVersion = aVersion;
+	wantedFeatures = aFeatures;
+	connectTimeoutMs = aConnectTimeoutMs;
+	receiveTimeoutMs = aReceiveTimeoutMs;
+	sendTimeoutMs = aSendTimeoutMs;
+	if (running) {
+		start();
+	}
+}
+
+void Adapter::ConnectionPool::start() {
+	if (!pooled() || reaper.joinable()) {
+		return;
+	}
+	stopping = false;
+	reaper = std::thread(&ConnectionPool::reap, this);
+}
+
+void Adapter::ConnectionPool::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	if (reaper.joinable()) {
+		reaper.join();
+	}
+	closeIdle();
+}
+
+int Adapter::ConnectionPool::checkout(int &version, uint32_t &features) {
+	if (pooled()) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!idle.empty()) {
+			const Idle conn = idle.back();
+			idle.pop_back();
+			lock.unlock();
+			if (healthy(conn.socketHandle)) {
+				version = conn.version;
+				features = conn.features;
+				return conn.socketHandle;
+			}
+			// ecapguardian closed it (restart, its own idle timeout) - try the next one
+			close(conn.socketHandle);
+			lock.lock();
+		}
+	}
+	return connectSocket(version, features);
+}
+
+void Adapter::ConnectionPool::release(int socketHandle, int version, uint32_t features, bool reusable) {
+	if (socketHandle < 0) {
+		return;
+	}
+	if (reusable && pooled()) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!stopping && idle.size() < maxSize) {
+			const Idle conn = { socketHandle, version, features, time(NULL) };
+			idle.push_back(conn);
+			return;
+		}
+	}
+	close(socketHandle);
+}
+
+bool Adapter::ConnectionPool::probe() {
+	int version;
+	uint32_t features;
+	const int socketHandle = connectSocket(version, features);
+	if (socketHandle < 0) {
+		return false;
+	}
+	release(socketHandle, version, features, true);
+	return true;
+}
+
+int Adapter::ConnectionPool::connectSocket(int &version, uint32_t &features) const {
+	struct sockaddr_un addr;
+	const int socketHandle = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socketHandle == -1) {
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path)-1);
+
+	// a Unix socket connect() waits for room in the listen backlog, for as
+	// long as SO_SNDTIMEO allows
+	version = PROTOCOL_V1;
+	features = 0;
+	const int helloTimeoutMs = connectTimeoutMs > 0 ? connectTimeoutMs : -1;
+	if (!SetTimeout(socketHandle, SO_SNDTIMEO, connectTimeoutMs) ||
+		connect(socketHandle, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+		(wantedVersion > PROTOCOL_V1 && !Negotiate(socketHandle, wantedVersion, wantedFeatures, helloTimeoutMs, version, features)) ||
+		(nonBlocking && fcntl(socketHandle, F_SETFL, O_NONBLOCK) < 0) ||
+		(!nonBlocking && (!SetTimeout(socketHandle, SO_SNDTIMEO, sendTimeoutMs) ||
+			!SetTimeout(socketHandle, SO_RCVTIMEO, receiveTimeoutMs)))) {
+		const int savedErrno = errno == EAGAIN || errno == EWOULDBLOCK ? ETIMEDOUT : errno;
+		close(socketHandle);
+		errno = savedErrno;
+		return -1;
+	}
+	return socketHandle;
+}
+
+// SO_RCVTIMEO or SO_SNDTIMEO; 0 ms clears it
+bool Adapter::ConnectionPool::SetTimeout(int socketHandle, int option, int ms) {
+	struct timeval tv;
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	return setsockopt(socketHandle, SOL_SOCKET, option, &tv, sizeof(tv)) == 0;
+}
+
+// An idle connection must have nothing to say. If it is readable then either
+// ecapguardian hung up, or there are leftovers of the last reply. The only
+// leftovers we tolerate are the NUL bytes trailing the "\n\n\0\0" end marker.
+bool Adapter::ConnectionPool::healthy(int socketHandle) {
+	struct pollfd pfd;
+	pfd.fd = socketHandle;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) == 0) {
+		return true;
+	}
+	char buf[64];
+	for (;;) {
+		const ssize_t s = recv(socketHandle, buf, sizeof(buf), MSG_DONTWAIT);
+		if (s < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		if (s == 0) {
+			return false; // EOF
+		}
+		for (ssize_t i = 0; i < s; ++i) {
+			if (buf[i] != '\0') {
+				return false;
+			}
+		}
+	}
+}
+
+// Runs on its own thread: drops idle connections that timed out or went
+// bad, and keeps at least minSize connections ready for use.
+void Adapter::ConnectionPool::reap() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopping) {
+		std::vector<int> doomed;
+		const time_t now = time(NULL);
+		for (std::deque<Idle>::iterator i = idle.begin(); i != idle.end();) {
+			const bool expired = idleTimeout > 0 && now - i->since >= idleTimeout &&
+				idle.size() > minSize;
+			if (expired || !healthy(i->socketHandle)) {
+				doomed.push_back(i->socketHandle);
+				i = idle.erase(i);
+			} else {
+				++i;
+			}
+		}
+		size_t missing = idle.size() < minSize ? minSize - idle.size() : 0;
+		lock.unlock();
+
+		for (size_t i = 0; i < doomed.size(); ++i) {
+			close(doomed[i]);
+		}
+		std::vector<Idle> fresh;
+		while (missing-- > 0) {
+			Idle conn;
+			conn.socketHandle = connectSocket(conn.version, conn.features);
+			conn.since = time(NULL);
+			if (conn.socketHandle < 0) {
+				break; // ecapguardian is not there; transactions will report it
+			}
+			fresh.push_back(conn);
+		}
+
+		lock.lock();
+		for (size_t i = 0; i < fresh.size(); ++i) {
+			if (stopping || idle.size() >= maxSize) {
+				close(fresh[i].socketHandle);
+			} else {
+				idle.push_back(fresh[i]);
+			}
+		}
+		wakeup.wait_for(lock, std::chrono::seconds(1));
+	}
+}
+
+void Adapter::ConnectionPool::closeIdle() {
+	std::lock_guard<std::mutex> lock(mutex);
+	while (!idle.empty()) {
+		close(idle.back().socketHandle);
+		idle.pop_back();
+	}
+}
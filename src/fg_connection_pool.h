@@ -0,0 +1,106 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_CONNECTION_POOL_H
+#define FG_CONNECTION_POOL_H
+
+#include <time.h>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "fg_protocol.h"
+
+namespace Adapter {
+
+// Persistent Unix socket connections to one ecapguardian listener.
+//
+// A transaction checks a connection out, talks to ecapguardian and releases
+// it again. Connections that finished their exchange cleanly go back to the
+// idle list instead of being closed, so the next transaction skips the
+// socket()+connect() (and the accept() on the server side).
+//
+// With maxSize == 0 the pool is disabled: checkout() always connects and
+// release() always closes, which is the original one-connection-per-
+// transaction protocol that older ecapguardian builds expect.
+//
+// Every new connection negotiates the wire protocol version and features
+// (see fg_protocol.h) when a version above PROTOCOL_V1 is configured; the
+// outcome stays with the connection while it is pooled.
+//
+// connect() and the hello are bounded by the connect timeout. Blocking
+// sockets also get SO_RCVTIMEO and SO_SNDTIMEO, so that a read or write
+// that makes no progress for that long fails with EAGAIN; they stay set
+// while the connection is pooled.
+class ConnectionPool {
+	public:
+		ConnectionPool();
+		~ConnectionPool();
+
+		// minSize connections are kept connected even when idle,
+		// at most maxSize idle ones are kept, extra ones are closed,
+		// idle connections older than idleTimeout seconds are reaped,
+		// nonBlocking sockets are handed out in O_NONBLOCK mode,
+		// version is the highest wire protocol version to offer,
+		// features the FEATURE_* bits to offer along with it,
+		// and the timeouts are in milliseconds, 0 meaning none
+		void configure(const std::string &socketPath, size_t minSize, size_t maxSize, time_t idleTimeout,
+			bool nonBlocking = false, int version = PROTOCOL_V1, uint32_t features = 0,
+			int connectTimeoutMs = 5000, int receiveTimeoutMs = 0, int sendTimeoutMs = 0);
+		void start(); // starts the reaper, which also pre-connects minSize
+		void stop(); // stops the reaper and closes all idle connections
+
+		bool pooled() const { return maxSize > 0; }
+
+		// returns a connected socket and the protocol version and features
+		// it speaks, or -1 with errno set (ETIMEDOUT: the connect timeout)
+		int checkout(int &version, uint32_t &features);
+		// returns the socket to the pool; reusable means the transaction
+		// exchange completed and nothing is left unread on the socket
+		void release(int socketHandle, int version, uint32_t features, bool reusable);
+		// connects (and says hello) like checkout() would, for the circuit
+		// breaker; the connection is pooled if there is room
+		bool probe();
+
+		// On a pooled PROTOCOL_V1 connection every transaction starts with
+		// this byte, telling ecapguardian that a new message begins and that
+		// the connection will stay open after the exchange.
+		static const char FLAG_XACTION_RESET = 'n';
+
+	private:
+		struct Idle {
+			int socketHandle;
+			int version;
+			uint32_t features;
+			time_t since;
+		};
+
+		int connectSocket(int &version, uint32_t &features) const;
+		static bool healthy(int socketHandle);
+		static bool SetTimeout(int socketHandle, int option, int ms);
+		void reap();
+		void closeIdle();
+
+		std::string socketPath;
+		size_t minSize;
+		size_t maxSize;
+		time_t idleTimeout;
+		bool nonBlocking;
+		int wantedVersion;
+		uint32_t wantedFeatures;
+		int connectTimeoutMs;
+		int receiveTimeoutMs;
+		int sendTimeoutMs;
+
+		std::mutex mutex; // protects idle and stopping
+		std::condition_variable wakeup;
+		std::deque<Idle> idle; // oldest first; checkout takes the newest
+		bool stopping;
+		std::thread reaper;
+};
+
+} // namespace Adapter
+
+#endif
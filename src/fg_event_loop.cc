@@ -0,0 +1,800 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <exception>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <libecap/common/errors.h>
+
+#include "fg_event_loop.h"
+
+Adapter::AsyncExchange::AsyncExchange(int aSocketHandle, Reply::Kind kind, int version,
+	const ChannelPointer &aChannel, uint32_t aStream):
+	socketHandle(aSocketHandle), channel(aChannel), stream(aStream), reply(kind, version),
+	outputOffset(0), outputSize(0), drainMark(0), drainWanted(false),
+	error(0), stalledIn(Metrics::phVerdict), outputDone(true), lastProgress(0),
+	events(0), metrics(0), client(0) {
+	if (channel) {
+		reply.stream = stream;
+		reply.acks = false;
+	}
+}
+
+void Adapter::AsyncExchange::queue(std::string data) {
+	if (!data.empty()) {
+		outputSize += data.size();
+		output.push_back(std::move(data));
+	}
+}
+
+Adapter::Channel::Channel(int aSocketHandle, uint32_t aFeatures, Metrics *aMetrics):
+	socketHandle(aSocketHandle), features(aFeatures), metrics(aMetrics), broken(false), load(0),
+	lastStream(0), outputOffset(0), payloadLeft(0), current(0), events(0) {
+}
+
+Adapter::Channel::~Channel() {
+	close(socketHandle);
+}
+
+uint32_t Adapter::Channel::newStream() {
+	if (++lastStream == 0) {
+		lastStream = 1; // after four billion streams
+	}
+	return lastStream;
+}
+
+// how often the loop looks for stalled exchanges while timeouts are on
+static const int SWEEP_INTERVAL_MS = 100;
+
+Adapter::EventLoop::EventLoop():
+	epollHandle(-1), wakeHandle(-1), readBufferSize(64*1024),
+	verdictTimeout(0), bodyTimeout(0), logger(0), multiplexed(0), stopping(false), failure(0), sleeping(false),
+	lastSweep(0) {
+}
+
+void Adapter::EventLoop::configure(size_t aReadBufferSize, size_t aVerdictTimeout, size_t aBodyTimeout,
+	Logger *aLogger, const std::string &anErrorPrefix) {
+	std::lock_guard<std::mutex> lock(mutex);
+	readBufferSize = aReadBufferSize;
+	verdictTimeout = aVerdictTimeout;
+	bodyTimeout = aBodyTimeout;
+	logger = aLogger;
+	errorPrefix = anErrorPrefix;
+}
+
+Adapter::EventLoop::~EventLoop() {
+	stop();
+}
+
+void Adapter::EventLoop::start() {
+	if (thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!failure) {
+				return;
+			}
+		}
+		// run() gave up and finished everything it had; start over
+		thread.join();
+		close(wakeHandle);
+		close(epollHandle);
+		wakeHandle = epollHandle = -1;
+	}
+	epollHandle = epoll_create1(EPOLL_CLOEXEC);
+	if (epollHandle < 0) {
+		throw libecap::TextException(errorPrefix + "Failed to create the event loop epoll instance. errno: " +
+			strerror(errno));
+	}
+	wakeHandle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = wakeHandle;
+	if (wakeHandle < 0 || epoll_ctl(epollHandle, EPOLL_CTL_ADD, wakeHandle, &ev) < 0) {
+		const int savedErrno = errno;
+		if (wakeHandle >= 0) {
+			close(wakeHandle);
+		}
+		close(epollHandle);
+		wakeHandle = epollHandle = -1;
+		throw libecap::TextException(errorPrefix + "Failed to set up the event loop wakeup eventfd. errno: " +
+			strerror(savedErrno));
+	}
+	failure = 0;
+	stopping = false;
+	sleeping = true; // run() starts without a timeout
+	thread = std::thread(&EventLoop::run, this);
+}
+
+void Adapter::EventLoop::stop() {
+	if (!thread.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	const uint64_t one = 1;
+	if (write(wakeHandle, &one, sizeof(one)) < 0) {
+		; // the counter cannot overflow with a single wakeup
+	}
+	thread.join();
+	watched.clear();
+	// their streams are lost with the exchanges; the host opens new channels
+	for (std::map<int, ChannelPointer>::iterator i = channels.begin(); i != channels.end(); ++i) {
+		i->second->broken = true;
+		i->second->streams.clear();
+		i->second->output.clear();
+	}
+	channels.clear();
+	multiplexed = 0;
+	drained.clear();
+	finished.clear();
+	failure = 0;
+	close(wakeHandle);
+	close(epollHandle);
+	wakeHandle = epollHandle = -1;
+}
+
+void Adapter::EventLoop::add(const ExchangePointer &x) {
+	start(); // on first use, or after the service was stopped and restarted
+	std::lock_guard<std::mutex> lock(mutex);
+	x->lastProgress = MonotonicMicros();
+	if (failure) {
+		// run() gave up after start() looked
+		x->error = failure;
+		finished.push_back(x);
+		return;
+	}
+	if (Channel *c = x->channel.get()) {
+		if (c->broken) {
+			x->error = EPIPE;
+			finished.push_back(x);
+			return;
+		}
+		c->streams[x->stream] = x;
+		++multiplexed;
+		for (std::deque<std::string>::iterator i = x->output.begin(); i != x->output.end(); ++i) {
+			Channel::Pending piece = { x->stream, std::string() };
+			piece.data.swap(*i);
+			c->output.push_back(std::move(piece));
+		}
+		x->output.clear();
+		watch(*c, EPOLL_CTL_MOD);
+	} else {
+		if (!watch(*x, EPOLL_CTL_ADD)) {
+			x->error = errno;
+			finished.push_back(x);
+			return;
+		}
+		watched[x->socketHandle] = x;
+	}
+	if (sleeping && (verdictTimeout || bodyTimeout)) {
+		// ecapguardian might never answer; the loop must wake up to notice
+		sleeping = false;
+		const uint64_t one = 1;
+		if (write(wakeHandle, &one, sizeof(one)) < 0) {
+			; // a wakeup is pending already
+		}
+	}
+}
+
+bool Adapter::EventLoop::send(const ExchangePointer &x, std::string data, size_t queueLimit,
+	std::string frameHeader) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Channel *c = x->channel.get();
+	if (c) {
+		std::map<uint32_t, ExchangePointer>::iterator i = c->streams.find(x->stream);
+		if (i == c->streams.end() || i->second != x) {
+			return true; // finished already, ecapguardian does not want more
+		}
+	} else {
+		std::map<int, ExchangePointer>::iterator i = watched.find(x->socketHandle);
+		if (i == watched.end() || i->second != x) {
+			return true;
+		}
+	}
+	if (!x->outputSize) {
+		x->lastProgress = MonotonicMicros(); // the body timeout starts now
+	}
+	// under one lock, so that no answer of the loop gets between the two
+	enqueue(*x, std::move(frameHeader));
+	enqueue(*x, std::move(data));
+	if (c) {
+		watch(*c, EPOLL_CTL_MOD);
+	} else {
+		watch(*x, EPOLL_CTL_MOD);
+	}
+	if (x->outputSize < queueLimit) {
+		return true;
+	}
+	x->drainMark = queueLimit / 2;
+	x->drainWanted = true;
+	return false;
+}
+
+void Adapter::EventLoop::endOutput(const ExchangePointer &x) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!x->outputDone) {
+		x->outputDone = true;
+		x->lastProgress = MonotonicMicros();
+	}
+}
+
+void Adapter::EventLoop::cancel(const ExchangePointer &x) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (Channel *c = x->channel.get()) {
+		// output it queued already stays, a frame may have started
+		std::map<uint32_t, ExchangePointer>::iterator i = c->streams.find(x->stream);
+		if (i != c->streams.end() && i->second == x) {
+			c->streams.erase(i);
+			--multiplexed;
+		}
+		forget(drained, x);
+		forget(finished, x);
+		return;
+	}
+	std::map<int, ExchangePointer>::iterator i = watched.find(x->socketHandle);
+	if (i != watched.end() && i->second == x) {
+		epoll_ctl(epollHandle, EPOLL_CTL_DEL, x->socketHandle, 0);
+		watched.erase(i);
+	}
+	forget(drained, x);
+	forget(finished, x);
+}
+
+void Adapter::EventLoop::takeReady(std::vector<ExchangePointer> &drainedOnes, std::vector<ExchangePointer> &done) {
+	std::lock_guard<std::mutex> lock(mutex);
+	drainedOnes.swap(drained);
+	drained.clear();
+	done.swap(finished);
+	finished.clear();
+}
+
+bool Adapter::EventLoop::busy() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return !watched.empty() || multiplexed || !drained.empty() || !finished.empty();
+}
+
+void Adapter::EventLoop::attach(const ChannelPointer &channel) {
+	start();
+	std::lock_guard<std::mutex> lock(mutex);
+	if (failure || !watch(*channel, EPOLL_CTL_ADD)) {
+		channel->broken = true; // add() fails its streams
+		return;
+	}
+	channels[channel->socketHandle] = channel;
+}
+
+void Adapter::EventLoop::closeStream(const ChannelPointer &channel, uint32_t stream, bool finished) {
+	--channel->load;
+	if (finished || channel->broken) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	std::map<int, ChannelPointer>::iterator i = channels.find(channel->socketHandle);
+	if (i == channels.end() || i->second != channel) {
+		return; // broken or stopped meanwhile
+	}
+	Channel::Pending cancelFrame = { stream, FrameHeader(FRAME_CANCEL, 0, 0, stream) };
+	channel->output.push_back(std::move(cancelFrame));
+	watch(*channel, EPOLL_CTL_MOD);
+}
+
+void Adapter::EventLoop::forget(std::vector<ExchangePointer> &list, const ExchangePointer &x) {
+	for (std::vector<ExchangePointer>::iterator i = list.begin(); i != list.end(); ++i) {
+		if (*i == x) {
+			list.erase(i);
+			return;
+		}
+	}
+}
+
+void Adapter::EventLoop::run() {
+	const int maxEvents = 64;
+	struct epoll_event events[maxEvents];
+	std::vector<char> buf(readBufferSize);
+	// with timeouts on and exchanges in the loop, it wakes up now and then
+	// to look for stalled ones; add() wakes it up when it sleeps for good
+	int timeout = -1;
+
+	for (;;) {
+		const int n = epoll_wait(epollHandle, events, maxEvents, timeout);
+		if (n < 0 && errno != EINTR) {
+			const int error = errno;
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!stopping) {
+				abandon(error);
+			}
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopping) {
+			return;
+		}
+		for (int i = 0; i < n; ++i) {
+			if (events[i].data.fd == wakeHandle) {
+				uint64_t count;
+				if (read(wakeHandle, &count, sizeof(count)) < 0) {
+					; // drained already
+				}
+				continue;
+			}
+			std::map<int, ExchangePointer>::iterator w = watched.find(events[i].data.fd);
+			if (w == watched.end()) {
+				std::map<int, ChannelPointer>::iterator c = channels.find(events[i].data.fd);
+				if (c != channels.end()) {
+					const ChannelPointer channel = c->second; // breaking it erases c
+					progress(*channel, events[i].events, &buf[0], buf.size());
+				}
+				continue; // or cancelled meanwhile
+			}
+			const ExchangePointer x = w->second;
+			bool done;
+			try {
+				done = progress(*x, events[i].events, &buf[0], buf.size());
+			} catch (const std::bad_alloc &) {
+				// nothing may escape the thread; the transaction fails instead
+				x->error = ENOMEM;
+				done = true;
+			} catch (const std::exception &) {
+				x->error = EPROTO;
+				done = true;
+			}
+			if (done) {
+				epoll_ctl(epollHandle, EPOLL_CTL_DEL, x->socketHandle, 0);
+				watched.erase(w);
+				finished.push_back(x);
+				continue;
+			}
+			if (x->drainWanted && x->outputSize <= x->drainMark) {
+				x->drainWanted = false;
+				drained.push_back(x);
+			}
+			watch(*x, EPOLL_CTL_MOD);
+		}
+
+		dropIdleChannels();
+
+		const bool timeouts = verdictTimeout || bodyTimeout;
+		const bool waiting = !watched.empty() || multiplexed;
+		if (timeouts && waiting) {
+			const uint64_t now = MonotonicMicros();
+			if (now - lastSweep >= SWEEP_INTERVAL_MS * 1000) {
+				lastSweep = now;
+				expire(now);
+			}
+		}
+		timeout = timeouts && waiting ? SWEEP_INTERVAL_MS : -1;
+		sleeping = timeout < 0;
+	}
+}
+
+// Finishes the exchanges that made no progress for too long, see AsyncExchange
+void Adapter::EventLoop::expire(uint64_t now) {
+	for (std::map<int, ExchangePointer>::iterator w = watched.begin(); w != watched.end();) {
+		AsyncExchange &x = *w->second;
+		const bool sending = x.outputSize > 0;
+		const uint64_t limit = sending ? bodyTimeout : x.outputDone ? verdictTimeout : 0;
+		if (!limit || now - x.lastProgress < limit * 1000) {
+			++w;
+			continue;
+		}
+		x.error = ETIMEDOUT;
+		x.stalledIn = sending ? Metrics::phBody : Metrics::phVerdict;
+		epoll_ctl(epollHandle, EPOLL_CTL_DEL, x.socketHandle, 0);
+		finished.push_back(w->second);
+		w = watched.erase(w);
+	}
+	// the other streams of a channel may well be moving
+	for (std::map<int, ChannelPointer>::iterator c = channels.begin(); c != channels.end(); ++c) {
+		std::map<uint32_t, ExchangePointer> &streams = c->second->streams;
+		for (std::map<uint32_t, ExchangePointer>::iterator w = streams.begin(); w != streams.end();) {
+			AsyncExchange &x = *w->second;
+			const bool sending = x.outputSize > 0;
+			const uint64_t limit = sending ? bodyTimeout : x.outputDone ? verdictTimeout : 0;
+			if (!limit || now - x.lastProgress < limit * 1000) {
+				++w;
+				continue;
+			}
+			x.error = ETIMEDOUT;
+			x.stalledIn = sending ? Metrics::phBody : Metrics::phVerdict;
+			finished.push_back(w->second);
+			w = streams.erase(w);
+			--multiplexed;
+		}
+	}
+}
+
+// Moves the exchange forward; returns true when it is finished, successfully or not.
+bool Adapter::EventLoop::progress(AsyncExchange &x, uint32_t events, char *buf, size_t bufSize) {
+	if (!flush(x)) {
+		return true;
+	}
+
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		// a few reads at most, so that the host thread does not wait on the mutex for long
+		for (int reads = 0; reads < 16; ++reads) {
+			const ssize_t s = ReadInto(x.socketHandle, x.reply, buf, bufSize);
+			if (s < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					break;
+				}
+				if (errno == EINTR) {
+					continue;
+				}
+				x.error = errno;
+				return true;
+			}
+			if (s == 0) {
+				x.error = -1; // ecapguardian hung up before the reply was complete
+				return true;
+			}
+			x.lastProgress = MonotonicMicros();
+			if (x.metrics) {
+				x.metrics->bytesReceived.fetch_add(s, std::memory_order_relaxed);
+			}
+			while (x.reply.needsAck()) {
+				x.queue(x.reply.ack());
+				x.reply.acked();
+			}
+			if (x.reply.failed()) {
+				return true;
+			}
+			if (!flush(x)) {
+				return true;
+			}
+			if (x.reply.complete()) {
+				break;
+			}
+		}
+	}
+
+	// done once the last acknowledgement is out, too
+	return x.reply.complete() && x.output.empty();
+}
+
+// writes what it can of the queued output; false on a write error
+bool Adapter::EventLoop::flush(AsyncExchange &x) {
+	const int maxIov = 16;
+	struct iovec iov[maxIov];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+
+	while (!x.output.empty()) {
+		int n = 0;
+		for (std::deque<std::string>::const_iterator i = x.output.begin(); i != x.output.end() && n < maxIov; ++i, ++n) {
+			const size_t skip = n == 0 ? x.outputOffset : 0;
+			iov[n].iov_base = const_cast<char*>(i->data() + skip);
+			iov[n].iov_len = i->size() - skip;
+		}
+		msg.msg_iovlen = n;
+		ssize_t s = sendmsg(x.socketHandle, &msg, MSG_NOSIGNAL);
+		if (s < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			x.error = errno;
+			return false;
+		}
+		x.outputSize -= s;
+		x.lastProgress = MonotonicMicros();
+		if (x.metrics) {
+			x.metrics->bytesSent.fetch_add(s, std::memory_order_relaxed);
+		}
+		while (s > 0) {
+			const size_t left = x.output.front().size() - x.outputOffset;
+			if (static_cast<size_t>(s) < left) {
+				x.outputOffset += s;
+				break;
+			}
+			s -= left;
+			x.output.pop_front();
+			x.outputOffset = 0;
+		}
+	}
+	return true;
+}
+
+// (re)registers the socket, unless the loop already waits for the right
+// events; false, with errno set, if epoll refused it
+bool Adapter::EventLoop::watch(AsyncExchange &x, int op) {
+	const uint32_t wanted = x.output.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT);
+	if (op == EPOLL_CTL_MOD && wanted == x.events) {
+		return true;
+	}
+	struct epoll_event ev;
+	ev.events = x.events = wanted;
+	ev.data.fd = x.socketHandle;
+	return epoll_ctl(epollHandle, op, x.socketHandle, &ev) == 0;
+}
+
+// queues output for the exchange, on its channel if it has one
+void Adapter::EventLoop::enqueue(AsyncExchange &x, std::string data) {
+	if (!x.channel) {
+		x.queue(std::move(data));
+		return;
+	}
+	if (!data.empty()) {
+		x.outputSize += data.size();
+		Channel::Pending piece = { x.stream, std::move(data) };
+		x.channel->output.push_back(std::move(piece));
+	}
+}
+
+// Moves the streams of a multiplexed connection forward
+void Adapter::EventLoop::progress(Channel &c, uint32_t events, char *buf, size_t bufSize) {
+	touched.clear();
+	int error = 0;
+	try {
+		if (!flush(c)) {
+			error = errno;
+		} else if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !receive(c, buf, bufSize)) {
+			error = errno ? errno : EPROTO;
+		} else if (!flush(c)) { // the answers the replies asked for
+			error = errno;
+		}
+	} catch (const std::bad_alloc &) {
+		error = ENOMEM;
+	} catch (const std::exception &) {
+		error = EPROTO;
+	}
+	if (error) {
+		breakChannel(c, error);
+		return;
+	}
+	settle(c);
+	watch(c, EPOLL_CTL_MOD);
+}
+
+// like flush(AsyncExchange &), counting what goes out against the streams
+bool Adapter::EventLoop::flush(Channel &c) {
+	const int maxIov = 16;
+	struct iovec iov[maxIov];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+
+	while (!c.output.empty()) {
+		int n = 0;
+		for (std::deque<Channel::Pending>::const_iterator i = c.output.begin(); i != c.output.end() && n < maxIov; ++i, ++n) {
+			const size_t skip = n == 0 ? c.outputOffset : 0;
+			iov[n].iov_base = const_cast<char*>(i->data.data() + skip);
+			iov[n].iov_len = i->data.size() - skip;
+		}
+		msg.msg_iovlen = n;
+		ssize_t s = sendmsg(c.socketHandle, &msg, MSG_NOSIGNAL);
+		if (s < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (c.metrics) {
+			c.metrics->bytesSent.fetch_add(s, std::memory_order_relaxed);
+		}
+		const uint64_t now = MonotonicMicros();
+		while (s > 0) {
+			Channel::Pending &piece = c.output.front();
+			const size_t left = piece.data.size() - c.outputOffset;
+			const size_t done = std::min<size_t>(s, left);
+			std::map<uint32_t, ExchangePointer>::iterator w = c.streams.find(piece.stream);
+			if (w != c.streams.end()) {
+				w->second->outputSize -= done;
+				w->second->lastProgress = now;
+				touched.push_back(w->second);
+			}
+			s -= done;
+			if (done < left) {
+				c.outputOffset += done;
+				break;
+			}
+			c.output.pop_front();
+			c.outputOffset = 0;
+		}
+	}
+	return true;
+}
+
+// A few reads, a frame payload straight into the reply of its stream;
+// false when the channel is gone or out of step (errno 0: a bad frame)
+bool Adapter::EventLoop::receive(Channel &c, char *buf, size_t bufSize) {
+	for (int reads = 0; reads < 16; ++reads) {
+		struct iovec iov[2];
+		int iovcnt = 0;
+		size_t room = 0;
+		AsyncExchange *x = 0;
+		if (c.payloadLeft) {
+			std::map<uint32_t, ExchangePointer>::iterator w = c.streams.find(c.current);
+			if (w != c.streams.end()) {
+				x = w->second.get();
+				char *space;
+				room = std::min<size_t>(x->reply.payloadRoom(space), c.payloadLeft);
+				if (room) {
+					iov[iovcnt].iov_base = space;
+					iov[iovcnt++].iov_len = room;
+				}
+			}
+		}
+		iov[iovcnt].iov_base = buf;
+		iov[iovcnt++].iov_len = bufSize;
+		const ssize_t s = readv(c.socketHandle, iov, iovcnt);
+		if (s < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (s == 0) {
+			errno = EPIPE; // ecapguardian hung up
+			return false;
+		}
+		if (c.metrics) {
+			c.metrics->bytesReceived.fetch_add(s, std::memory_order_relaxed);
+		}
+		const size_t direct = std::min<size_t>(s, room);
+		if (direct) {
+			x->reply.filled(direct);
+			c.payloadLeft -= direct;
+			answer(c.streams[c.current]);
+		}
+		errno = 0;
+		if (!demux(c, buf, s - direct)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Splits what was read into frames and feeds each to the reply of its stream
+bool Adapter::EventLoop::demux(Channel &c, const char *data, size_t size) {
+	while (size) {
+		if (!c.payloadLeft) {
+			const size_t take = std::min(size, FRAME_HEADER_SIZE - c.frame.size());
+			c.frame.append(data, take);
+			data += take;
+			size -= take;
+			if (c.frame.size() < FRAME_HEADER_SIZE) {
+				return true;
+			}
+			char type;
+			unsigned char flags;
+			if (!ParseFrameHeader(c.frame.data(), type, flags, c.current, c.payloadLeft) || !c.current) {
+				return false;
+			}
+			deliver(c, c.frame.data(), c.frame.size()); // the reply checks the header, too
+			c.frame.clear();
+			continue;
+		}
+		const size_t take = std::min<size_t>(size, c.payloadLeft);
+		deliver(c, data, take);
+		data += take;
+		size -= take;
+		c.payloadLeft -= take;
+	}
+	return true;
+}
+
+// feeds the reply of the current stream, if it is still there
+void Adapter::EventLoop::deliver(Channel &c, const char *data, size_t size) {
+	std::map<uint32_t, ExchangePointer>::iterator w = c.streams.find(c.current);
+	if (w == c.streams.end()) {
+		return; // cancelled, or finished early
+	}
+	w->second->reply.feed(data, size);
+	answer(w->second);
+}
+
+// queues the answers the reply asks for after it got more of its frames
+void Adapter::EventLoop::answer(const ExchangePointer &x) {
+	x->lastProgress = MonotonicMicros();
+	while (x->reply.needsAck()) {
+		enqueue(*x, x->reply.ack());
+		x->reply.acked();
+	}
+	touched.push_back(x);
+}
+
+// finishes the exchanges the last event completed, and tells the ones that
+// wait for their output to drain
+void Adapter::EventLoop::settle(Channel &c) {
+	for (std::vector<ExchangePointer>::iterator i = touched.begin(); i != touched.end(); ++i) {
+		const ExchangePointer &x = *i;
+		std::map<uint32_t, ExchangePointer>::iterator w = c.streams.find(x->stream);
+		if (w == c.streams.end() || w->second != x) {
+			continue; // settled already
+		}
+		if (x->reply.failed() || (x->reply.complete() && !x->outputSize)) {
+			finish(c, x);
+		} else if (x->drainWanted && x->outputSize <= x->drainMark) {
+			x->drainWanted = false;
+			drained.push_back(x);
+		}
+	}
+	touched.clear();
+}
+
+void Adapter::EventLoop::finish(Channel &c, const ExchangePointer &x) {
+	c.streams.erase(x->stream);
+	--multiplexed;
+	finished.push_back(x);
+}
+
+// fails all the streams; the host sees broken and opens a new channel
+void Adapter::EventLoop::breakChannel(Channel &c, int error) {
+	for (std::map<uint32_t, ExchangePointer>::iterator w = c.streams.begin(); w != c.streams.end(); ++w) {
+		w->second->error = error;
+		finished.push_back(w->second);
+		--multiplexed;
+	}
+	c.streams.clear();
+	c.output.clear();
+	c.broken = true;
+	touched.clear();
+	epoll_ctl(epollHandle, EPOLL_CTL_DEL, c.socketHandle, 0);
+	channels.erase(c.socketHandle); // may destroy c
+}
+
+bool Adapter::EventLoop::watch(Channel &c, int op) {
+	const uint32_t wanted = c.output.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT);
+	if (op == EPOLL_CTL_MOD && wanted == c.events) {
+		return true;
+	}
+	struct epoll_event ev;
+	ev.events = c.events = wanted;
+	ev.data.fd = c.socketHandle;
+	return epoll_ctl(epollHandle, op, c.socketHandle, &ev) == 0;
+}
+
+// Closes the channels nobody but the loop knows of any more (their backend
+// was reconfigured away) once nothing is left to write
+void Adapter::EventLoop::dropIdleChannels() {
+	for (std::map<int, ChannelPointer>::iterator c = channels.begin(); c != channels.end();) {
+		if (c->second.use_count() == 1 && c->second->streams.empty() && c->second->output.empty()) {
+			epoll_ctl(epollHandle, EPOLL_CTL_DEL, c->first, 0);
+			c = channels.erase(c);
+		} else {
+			++c;
+		}
+	}
+}
+
+// epoll_wait() failed for good: finishes everything with the error, for
+// the host to take, and leaves start() to begin a new loop
+void Adapter::EventLoop::abandon(int error) {
+	for (std::map<int, ExchangePointer>::iterator w = watched.begin(); w != watched.end(); ++w) {
+		w->second->error = error;
+		finished.push_back(w->second);
+	}
+	watched.clear();
+	while (!channels.empty()) {
+		const ChannelPointer channel = channels.begin()->second; // breaking it erases it
+		breakChannel(*channel, error);
+	}
+	failure = error;
+	if (logger) {
+		logger->log(Logger::llError, 0, errorPrefix + "The event loop stopped, epoll_wait failed. errno: " +
+			strerror(error));
+	}
+}
@@ -0,0 +1,222 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_EVENT_LOOP_H
+#define FG_EVENT_LOOP_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "fg_logger.h"
+#include "fg_metrics.h"
+#include "fg_reply.h"
+
+namespace Adapter {
+
+// Implemented by transactions that hand their socket work to an EventLoop.
+// Both notifications come on the host thread, from Service::resume().
+class AsyncClient {
+	public:
+		virtual ~AsyncClient() {}
+		// the exchange is finished
+		virtual void noteExchangeReady() = 0;
+		// the output queue, which EventLoop::send() reported full, drained
+		virtual void noteExchangeDrained() {}
+};
+
+class Channel;
+typedef std::shared_ptr<Channel> ChannelPointer;
+
+// The part of a transaction's conversation with ecapguardian that the
+// event loop thread carries out: write whatever output is queued (headers,
+// body chunks), read the reply and acknowledge its parts as they arrive.
+//
+// The loop thread owns everything but client while the exchange is in the
+// loop; the host thread may look at reply and error once it got the
+// exchange back from EventLoop::takeReady().
+//
+// With timeouts configured, an exchange that makes no progress for that
+// long is finished with error ETIMEDOUT: while output is waiting,
+// ecapguardian is not taking it (the body timeout); once the client said
+// there is no more output, ecapguardian owes the verdict (the verdict
+// timeout).
+//
+// On a multiplexed connection (see Channel) the exchange is one stream of
+// it: the frames it queues go out between those of other streams, and its
+// reply only gets the frames of its stream, without acks.
+class AsyncExchange {
+	public:
+		AsyncExchange(int aSocketHandle, Reply::Kind kind, int version,
+			const ChannelPointer &aChannel = ChannelPointer(), uint32_t aStream = 0);
+
+		// appends to the output (before add(), or on the loop thread);
+		// pass body chunks with std::move to hand them over without a copy
+		void queue(std::string data);
+
+		const int socketHandle; // non-blocking
+		const ChannelPointer channel; // null unless multiplexed
+		const uint32_t stream; // on channel
+		Reply reply;
+		std::deque<std::string> output; // not yet written to ecapguardian; moves to channel on add()
+		size_t outputOffset; // already written part of output.front()
+		size_t outputSize; // bytes still to write
+		size_t drainMark; // tell the client when outputSize drops to this
+		bool drainWanted;
+		int error; // errno of a failed read or write, or -1 on early EOF
+		Metrics::Phase stalledIn; // with error ETIMEDOUT: phVerdict or phBody
+		bool outputDone; // nothing more is going to be queued (the default)
+		uint64_t lastProgress; // MonotonicMicros() of the last read or write
+		uint32_t events; // what the loop is waiting for
+		Metrics *metrics; // counts the bytes the loop moves, if set
+
+		AsyncClient *client; // host thread only; cleared when the transaction is gone
+};
+
+typedef std::shared_ptr<AsyncExchange> ExchangePointer;
+
+// A connection that carries the exchanges of many transactions at once,
+// told apart by the stream of their frames (FEATURE_MULTIPLEX, see
+// fg_protocol.h). The host thread opens a stream for each transaction on
+// the least loaded channel; the loop thread writes the frames of all its
+// streams in the order they were queued, never splitting one, and hands
+// each frame it reads to the exchange of its stream. Frames for a stream
+// that is gone are skipped.
+//
+// Once a read or write fails, or ecapguardian sends something that is not
+// a frame of an open stream, the channel is broken: all its exchanges fail
+// and the host opens a new one.
+class Channel {
+	public:
+		Channel(int aSocketHandle, uint32_t aFeatures, Metrics *aMetrics);
+		~Channel(); // closes the socket
+
+		uint32_t newStream(); // host thread; never 0
+
+		const int socketHandle; // non-blocking, with PROTOCOL_V2
+		const uint32_t features; // as negotiated, FEATURE_MULTIPLEX among them
+		Metrics *const metrics; // counts the bytes the loop moves, if set
+		std::atomic<bool> broken; // set by the loop thread
+		size_t load; // host thread: streams opened and not closed yet
+
+	private:
+		friend class EventLoop;
+
+		// queued output, tagged with the stream it counts against
+		struct Pending {
+			uint32_t stream;
+			std::string data;
+		};
+
+		uint32_t lastStream; // host thread
+		// the rest belongs to the loop (under its mutex)
+		std::deque<Pending> output;
+		size_t outputOffset; // already written part of output.front()
+		std::map<uint32_t, ExchangePointer> streams; // exchanges in the loop
+		std::string frame; // header of the frame being received, so far
+		uint32_t payloadLeft; // of the frame being received
+		uint32_t current; // its stream
+		uint32_t events; // what the loop is waiting for
+};
+
+// An epoll thread waiting on ecapguardian sockets for the transactions of
+// an asynchronous Service, so that a slow verdict or a slow body transfer
+// does not block the host. The loop never calls the host: notifications are
+// queued until the host calls Service::resume(), which collects them with
+// takeReady().
+//
+// Should epoll fail the loop for good, the exchanges and channels in it
+// are finished with the error, so that their transactions fail or fall
+// back rather than wait forever, and the next add() starts a new loop.
+class EventLoop {
+	public:
+		EventLoop();
+		~EventLoop();
+
+		// bytes the loop reads at a time besides frame payloads, which it
+		// reads in place, takes effect when the thread (re)starts;
+		// timeouts are in milliseconds, 0 meaning none; errors go to logger
+		void configure(size_t aReadBufferSize, size_t aVerdictTimeout, size_t aBodyTimeout,
+			Logger *aLogger, const std::string &anErrorPrefix);
+		// add() starts the loop thread when needed; throws if it cannot
+		void start();
+		void stop(); // exchanges still in the loop are dropped
+
+		// host thread: let the loop thread carry out the exchange
+		void add(const ExchangePointer &x);
+		// host thread: queues more output for an exchange in the loop; returns
+		// false once queueLimit bytes are waiting, and the client then gets
+		// noteExchangeDrained() when less than half of that is left. A frame
+		// header passed along goes out right before data, as one frame.
+		bool send(const ExchangePointer &x, std::string data, size_t queueLimit,
+			std::string frameHeader = std::string());
+		// host thread: for an exchange added with outputDone false, the
+		// last output is queued and the verdict timeout starts
+		void endOutput(const ExchangePointer &x);
+		// host thread: the transaction does not care any more; once this
+		// returns, the loop does not touch the exchange or its socket
+		void cancel(const ExchangePointer &x);
+		// host thread: exchanges drained or finished since the last call
+		void takeReady(std::vector<ExchangePointer> &drainedOnes, std::vector<ExchangePointer> &done);
+		// whether there are exchanges in progress or waiting to be taken
+		bool busy();
+
+		// host thread: have the loop watch a new multiplexed connection
+		void attach(const ChannelPointer &channel);
+		// host thread: the transaction is done with its stream (after
+		// cancel()); unless it finished, ecapguardian is told to drop it
+		void closeStream(const ChannelPointer &channel, uint32_t stream, bool finished);
+
+	private:
+		void run();
+		bool progress(AsyncExchange &x, uint32_t events, char *buf, size_t bufSize);
+		bool flush(AsyncExchange &x);
+		static void forget(std::vector<ExchangePointer> &list, const ExchangePointer &x);
+		bool watch(AsyncExchange &x, int op);
+		void expire(uint64_t now);
+		void enqueue(AsyncExchange &x, std::string data);
+
+		void progress(Channel &c, uint32_t events, char *buf, size_t bufSize);
+		bool flush(Channel &c);
+		bool receive(Channel &c, char *buf, size_t bufSize);
+		bool demux(Channel &c, const char *data, size_t size);
+		void deliver(Channel &c, const char *data, size_t size);
+		void answer(const ExchangePointer &x);
+		void settle(Channel &c);
+		void finish(Channel &c, const ExchangePointer &x);
+		void breakChannel(Channel &c, int error);
+		bool watch(Channel &c, int op);
+		void dropIdleChannels();
+		void abandon(int error);
+
+		int epollHandle;
+		int wakeHandle; // eventfd, wakes the loop up for stop() and add()
+		size_t readBufferSize;
+		size_t verdictTimeout; // milliseconds
+		size_t bodyTimeout; // milliseconds
+		Logger *logger;
+		std::string errorPrefix;
+
+		std::mutex mutex; // protects everything below and exchanges in the loop
+		std::map<int, ExchangePointer> watched; // by socket, not multiplexed
+		std::map<int, ChannelPointer> channels; // by socket
+		size_t multiplexed; // exchanges in the streams of channels
+		std::vector<ExchangePointer> touched; // loop thread: moved by the last channel event
+		std::vector<ExchangePointer> drained;
+		std::vector<ExchangePointer> finished;
+		bool stopping;
+		int failure; // errno of the epoll_wait() that ended run(), if one did
+		bool sleeping; // in epoll_wait() without a timeout
+		uint64_t lastSweep; // MonotonicMicros() of the last expire()
+		std::thread thread;
+};
+
+} // namespace Adapter
+
+#endif
@@ -0,0 +1,263 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "fg_logger.h"
+
+// records written per write()
+static const size_t BATCH_RECORDS = 256;
+// how long the logger thread naps when there is nothing to write
+static const std::chrono::milliseconds IDLE_NAP(5);
+
+static const char *LevelName(Adapter::Logger::Level level) {
+	switch (level) {
+		case Adapter::Logger::llError:
+			return "error";
+		case Adapter::Logger::llInfo:
+			return "info";
+		case Adapter::Logger::llDebug:
+			return "debug";
+		default:
+			return "none";
+	}
+}
+
+Adapter::Logger::Logger():
+	level(llNone), json(false), sampleRate(1), sampleCounter(0), lastId(0),
+	mask(0), enqueuePos(0), dequeuePos(0), dropped(0),
+	fileHandle(-1), stopping(false) {
+}
+
+Adapter::Logger::~Logger() {
+	stop();
+}
+
+void Adapter::Logger::configure(const std::string &aPath, Level aLevel, bool aJson, size_t aSampleRate, size_t queueSize) {
+	const bool running = thread.joinable();
+	stop();
+	path = aPath;
+	const std::string::size_type pid = path.find("%p");
+	if (pid != std::string::npos) {
+		path.replace(pid, 2, std::to_string(getpid()));
+	}
+	level = aLevel;
+	json = aJson;
+	sampleRate = aSampleRate ? aSampleRate : 1;
+
+	size_t size = 2;
+	while (size < queueSize) {
+		size <<= 1;
+	}
+	cells.reset(new Cell[size]);
+	for (size_t i = 0; i < size; ++i) {
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	mask = size - 1;
+	enqueuePos.store(0, std::memory_order_relaxed);
+	dequeuePos = 0;
+	if (running) {
+		start();
+	}
+}
+
+void Adapter::Logger::start() {
+	if (thread.joinable() || level == llNone) {
+		return;
+	}
+	fileHandle = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+	if (fileHandle < 0) {
+		return; // records pile up and get dropped; there is nowhere to report this
+	}
+	stopping = false;
+	thread = std::thread(&Logger::run, this);
+}
+
+void Adapter::Logger::stop() {
+	if (!thread.joinable()) {
+		return;
+	}
+	stopping = true;
+	thread.join();
+	close(fileHandle);
+	fileHandle = -1;
+}
+
+bool Adapter::Logger::sample() {
+	return sampleRate == 1 || sampleCounter.fetch_add(1, std::memory_order_relaxed) % sampleRate == 0;
+}
+
+void Adapter::Logger::log(Level recordLevel, uint64_t xaction, std::string message) {
+	if (!enabled(recordLevel) || !cells) {
+		return;
+	}
+	Record record;
+	record.level = recordLevel;
+	record.xaction = xaction;
+	gettimeofday(&record.time, NULL);
+	record.message.swap(message);
+	if (!push(record)) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+bool Adapter::Logger::ParseLevel(const std::string &name, Level &parsed) {
+	for (int l = llNone; l <= llDebug; ++l) {
+		if (name == LevelName(static_cast<Level>(l))) {
+			parsed = static_cast<Level>(l);
+			return true;
+		}
+	}
+	return false;
+}
+
+// any thread; false when the ring is full
+bool Adapter::Logger::push(Record &record) {
+	size_t pos = enqueuePos.load(std::memory_order_relaxed);
+	for (;;) {
+		Cell &cell = cells[pos & mask];
+		const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+		if (diff == 0) {
+			if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				cell.record = std::move(record);
+				cell.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false; // the logger thread has not freed this cell yet
+		} else {
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+// logger thread only; false when the ring is empty
+bool Adapter::Logger::pop(Record &record) {
+	Cell &cell = cells[dequeuePos & mask];
+	if (cell.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+		return false;
+	}
+	record = std::move(cell.record);
+	cell.sequence.store(dequeuePos + mask + 1, std::memory_order_release);
+	++dequeuePos;
+	return true;
+}
+
+void Adapter::Logger::run() {
+	std::string batch;
+	Record record;
+	for (;;) {
+		const bool last = stopping; // checked before draining, so nothing queued earlier is lost
+		batch.clear();
+		size_t records = 0;
+		if (const uint64_t lost = dropped.exchange(0, std::memory_order_relaxed)) {
+			Record note;
+			note.level = llError;
+			note.xaction = 0;
+			gettimeofday(&note.time, NULL);
+			note.message = "logger queue full, dropped " + std::to_string(lost) + " records";
+			format(note, batch);
+		}
+		while (records < BATCH_RECORDS && pop(record)) {
+			format(record, batch);
+			++records;
+		}
+		if (!batch.empty() && write(fileHandle, batch.data(), batch.size()) < 0) {
+			; // nothing to be done about a full disk from here
+		}
+		if (records == BATCH_RECORDS) {
+			continue;
+		}
+		if (last) {
+			return;
+		}
+		std::this_thread::sleep_for(IDLE_NAP);
+	}
+}
+
+static void AppendJsonString(std::string &out, const std::string &text) {
+	out += '"';
+	for (std::string::const_iterator i = text.begin(); i != text.end(); ++i) {
+		const unsigned char c = *i;
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c == '\n') {
+			out += "\\n";
+		} else if (c == '\r') {
+			out += "\\r";
+		} else if (c == '\t') {
+			out += "\\t";
+		} else if (c < 0x20) {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out += escaped;
+		} else {
+			out += c;
+		}
+	}
+	out += '"';
+}
+
+// text: "pid,seconds.micros,xaction,level,message"; json: one object per line
+void Adapter::Logger::format(const Record &record, std::string &out) const {
+	char time[32];
+	snprintf(time, sizeof(time), "%ld.%06ld", static_cast<long>(record.time.tv_sec), static_cast<long>(record.time.tv_usec));
+	if (json) {
+		out += "{\"time\":";
+		out += time;
+		out += ",\"pid\":" + std::to_string(getpid());
+		out += ",\"xaction\":" + std::to_string(record.xaction);
+		out += ",\"level\":\"";
+		out += LevelName(record.level);
+		out += "\",\"message\":";
+		AppendJsonString(out, record.message);
+		out += "}\n";
+		return;
+	}
+	out += std::to_string(getpid()) + ',' + time + ',' + std::to_string(record.xaction) + ',' + LevelName(record.level) + ',';
+	out += record.message;
+	out += '\n';
+}
+
+Adapter::TraceStream::TraceStream(Logger &aLogger, uint64_t anId):
+	std::ostream(0), buffer(aLogger, anId) {
+	rdbuf(&buffer);
+}
+
+int Adapter::TraceStream::Buffer::overflow(int c) {
+	if (c != traits_type::eof()) {
+		line += static_cast<char>(c);
+	}
+	return traits_type::not_eof(c);
+}
+
+std::streamsize Adapter::TraceStream::Buffer::xsputn(const char *s, std::streamsize n) {
+	line.append(s, n);
+	return n;
+}
+
+// std::endl ends up here: the line, without its newline, becomes a record
+int Adapter::TraceStream::Buffer::sync() {
+	while (!line.empty() && line[line.size() - 1] == '\n') {
+		line.erase(line.size() - 1);
+	}
+	if (!line.empty()) {
+		logger.log(Logger::llDebug, xaction, std::move(line));
+		line.clear();
+	}
+	return 0;
+}
+
+std::ostream& Adapter::logStart(std::ostream& output) {
+	if (dynamic_cast<TraceStream*>(&output)) {
+		return output;
+	}
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return output << getpid() << "," << tv.tv_sec << "." << tv.tv_usec << ",";
+}
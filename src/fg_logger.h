@@ -0,0 +1,118 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_LOGGER_H
+#define FG_LOGGER_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+namespace Adapter {
+
+// Trace log shared by the transactions of a Service.
+//
+// Producers (the host thread, the event loop thread) never block and never
+// touch the file: a record goes into a bounded lock-free ring and the
+// logger thread writes batches of them with a single write() to a file
+// opened with O_APPEND, so lines from several Squid workers never tear.
+// When the ring is full the record is dropped and counted, and the next
+// batch says how many were lost.
+class Logger {
+	public:
+		typedef enum { llNone, llError, llInfo, llDebug } Level;
+
+		Logger();
+		~Logger();
+
+		// path may contain %p for the process ID; queueSize is rounded up
+		// to a power of two; sampleRate 1 traces every transaction, N one in N
+		void configure(const std::string &path, Level level, bool json, size_t sampleRate, size_t queueSize);
+		void start(); // does nothing when logging is off
+		void stop(); // writes out what is queued first
+
+		bool enabled(Level wanted) const { return wanted <= level; }
+		// whether the next transaction gets a debug trace
+		bool sample();
+		uint64_t nextId() { return lastId.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+		// queues a record, timestamped now; xaction 0 is the Service itself
+		void log(Level recordLevel, uint64_t xaction, std::string message);
+
+		// parses "none", "error", "info" or "debug"
+		static bool ParseLevel(const std::string &name, Level &level);
+
+	private:
+		struct Record {
+			Level level;
+			uint64_t xaction;
+			struct timeval time;
+			std::string message;
+		};
+		struct Cell {
+			std::atomic<size_t> sequence; // Vyukov's bounded queue turn marker
+			Record record;
+		};
+
+		bool push(Record &record);
+		bool pop(Record &record);
+		void run();
+		void format(const Record &record, std::string &out) const;
+
+		std::string path;
+		Level level;
+		bool json;
+		size_t sampleRate;
+		std::atomic<uint64_t> sampleCounter;
+		std::atomic<uint64_t> lastId;
+
+		std::unique_ptr<Cell[]> cells;
+		size_t mask; // ring size - 1
+		std::atomic<size_t> enqueuePos;
+		size_t dequeuePos; // logger thread only
+		std::atomic<uint64_t> dropped;
+
+		int fileHandle;
+		std::atomic<bool> stopping;
+		std::thread thread;
+};
+
+// A std::ostream that turns every line ended with std::endl (or flush())
+// into one debug record of a Logger, so transaction code can keep writing
+//   logFile << logStart << "..." << std::endl;
+class TraceStream: public std::ostream {
+	public:
+		TraceStream(Logger &aLogger, uint64_t anId);
+
+		uint64_t id() const { return buffer.xaction; }
+
+	private:
+		class Buffer: public std::streambuf {
+			public:
+				Buffer(Logger &aLogger, uint64_t anId): logger(aLogger), xaction(anId) {}
+
+				Logger &logger;
+				const uint64_t xaction;
+				std::string line;
+
+			protected:
+				virtual int overflow(int c);
+				virtual std::streamsize xsputn(const char *s, std::streamsize n);
+				virtual int sync();
+		};
+
+		Buffer buffer;
+};
+
+// Starts a log line. On a TraceStream the logger stamps the record itself,
+// so this writes nothing; on other streams it writes "pid,seconds.micros,".
+std::ostream& logStart(std::ostream& output);
+
+} // namespace Adapter
+
+#endif
@@ -0,0 +1,266 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+
+#include "fg_metrics.h"
+
+uint64_t Adapter::MonotonicMicros() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+const unsigned Adapter::Histogram::SUB_BITS;
+const size_t Adapter::Histogram::BUCKETS;
+
+Adapter::Histogram::Histogram(): sum(0) {
+	for (size_t i = 0; i < BUCKETS; ++i) {
+		counts[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+size_t Adapter::Histogram::BucketOf(uint64_t micros) {
+	const uint64_t subBuckets = 1 << SUB_BITS;
+	if (micros < subBuckets) {
+		return micros;
+	}
+	const unsigned exponent = 63 - __builtin_clzll(micros); // >= SUB_BITS
+	const unsigned shift = exponent - SUB_BITS;
+	return subBuckets + (shift << SUB_BITS) + ((micros >> shift) & (subBuckets - 1));
+}
+
+uint64_t Adapter::Histogram::LowerBound(size_t bucket) {
+	const uint64_t subBuckets = 1 << SUB_BITS;
+	if (bucket < subBuckets) {
+		return bucket;
+	}
+	const size_t shift = (bucket - subBuckets) >> SUB_BITS;
+	return (subBuckets + (bucket & (subBuckets - 1))) << shift;
+}
+
+void Adapter::Histogram::record(uint64_t micros) {
+	counts[BucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(micros, std::memory_order_relaxed);
+}
+
+void Adapter::Histogram::print(std::ostream &os, const std::string &name, const std::string &labels) const {
+	size_t used = 0;
+	for (size_t i = 0; i < BUCKETS; ++i) {
+		if (counts[i].load(std::memory_order_relaxed)) {
+			used = i + 1;
+		}
+	}
+	os << "# TYPE " << name << " histogram\n";
+	uint64_t total = 0;
+	for (size_t i = 0; i < BUCKETS; ++i) {
+		total += counts[i].load(std::memory_order_relaxed);
+		if (i < used && i + 1 < BUCKETS) {
+			// bucket i holds whole microseconds up to the next bucket's lower bound
+			os << name << "_bucket{" << labels << ",le=\"" << (LowerBound(i + 1) - 1) / 1e6 << "\"} " << total << "\n";
+		}
+	}
+	os << name << "_bucket{" << labels << ",le=\"+Inf\"} " << total << "\n";
+	os << name << "_sum{" << labels << "} " << sum.load(std::memory_order_relaxed) / 1e6 << "\n";
+	os << name << "_count{" << labels << "} " << total << "\n";
+}
+
+const char Adapter::Metrics::VERDICTS[] = "vumbts";
+
+const char *const Adapter::Metrics::PHASES[] = { "connect", "verdict", "body" };
+
+Adapter::Metrics::Metrics(): bytesSent(0), bytesReceived(0), connectFailures(0),
+	correlated(0), causeFetches(0), scanHints(0), breakerTrips(0), breakerRejected(0), breakerOpen(0) {
+	for (size_t i = 0; i < sizeof(verdicts) / sizeof(verdicts[0]); ++i) {
+		verdicts[i].store(0, std::memory_order_relaxed);
+	}
+	for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); ++i) {
+		timeouts[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void Adapter::Metrics::verdict(char c) {
+	const char *p = c ? strchr(VERDICTS, c) : 0;
+	if (p) {
+		verdicts[p - VERDICTS].fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void Adapter::Metrics::timeout(Phase phase) {
+	timeouts[phase].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Adapter::Metrics::print(std::ostream &os, const std::string &labels) const {
+	os << "# TYPE fg_ecap_verdicts_total counter\n";
+	for (size_t i = 0; VERDICTS[i]; ++i) {
+		os << "fg_ecap_verdicts_total{" << labels << ",verdict=\"" << VERDICTS[i] << "\"} " <<
+			verdicts[i].load(std::memory_order_relaxed) << "\n";
+	}
+	os << "# TYPE fg_ecap_sent_bytes_total counter\n";
+	os << "fg_ecap_sent_bytes_total{" << labels << "} " << bytesSent.load(std::memory_order_relaxed) << "\n";
+	os << "# TYPE fg_ecap_received_bytes_total counter\n";
+	os << "fg_ecap_received_bytes_total{" << labels << "} " << bytesReceived.load(std::memory_order_relaxed) << "\n";
+	os << "# TYPE fg_ecap_connect_failures_total counter\n";
+	os << "fg_ecap_connect_failures_total{" << labels << "} " << connectFailures.load(std::memory_order_relaxed) << "\n";
+	os << "# TYPE fg_ecap_timeouts_total counter\n";
+	for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); ++i) {
+		os << "fg_ecap_timeouts_total{" << labels << ",phase=\"" << PHASES[i] << "\"} " <<
+			timeouts[i].load(std::memory_order_relaxed) << "\n";
+	}
+	os << "# TYPE fg_ecap_correlated_total counter\n";
+	os << "fg_ecap_correlated_total{" << labels << "} " << correlated.load(std::memory_order_relaxed) << "\n";
+	os << "# TYPE fg_ecap_cause_fetches_total counter\n";
+	os << "fg_ecap_cause_fetches_total{" << labels << "} " << causeFetches.load(std::memory_order_relaxed) << "\n";
+	os << "# TYPE fg_ecap_scan_hints_total counter\n";
+	os << "fg_ecap_scan_hints_total{" << labels << "} " << scanHints.load(std::memory_order_relaxed) << "\n";
+	os << "# TYPE fg_ecap_breaker_trips_total counter\n";
+	os << "fg_ecap_breaker_trips_total{" << labels << "} " << breakerTrips.load(std::memory_order_relaxed) << "\n";
+	os << "# TYPE fg_ecap_breaker_rejected_total counter\n";
+	os << "fg_ecap_breaker_rejected_total{" << labels << "} " << breakerRejected.load(std::memory_order_relaxed) << "\n";
+	os << "# TYPE fg_ecap_breaker_open gauge\n";
+	os << "fg_ecap_breaker_open{" << labels << "} " << breakerOpen.load(std::memory_order_relaxed) << "\n";
+	connect.print(os, "fg_ecap_connect_seconds", labels);
+	headerRoundTrip.print(os, "fg_ecap_header_round_trip_seconds", labels);
+	bodyScan.print(os, "fg_ecap_body_scan_seconds", labels);
+}
+
+Adapter::StatsExporter::StatsExporter():
+	metrics(0), interval(10), listenHandle(-1), wakeHandle(-1) {
+}
+
+Adapter::StatsExporter::~StatsExporter() {
+	stop();
+}
+
+void Adapter::StatsExporter::configure(const Metrics *aMetrics, const std::string &aLabels,
+	const std::string &aSocketPath, const std::string &aFilePath, time_t anInterval) {
+	const bool running = thread.joinable();
+	stop();
+	metrics = aMetrics;
+	socketPath = Expand(aSocketPath);
+	filePath = Expand(aFilePath);
+	labels = aLabels + ",pid=\"" + std::to_string(getpid()) + "\"";
+	interval = anInterval > 0 ? anInterval : 1;
+	if (running) {
+		start();
+	}
+}
+
+void Adapter::StatsExporter::start() {
+	if (thread.joinable() || (socketPath.empty() && filePath.empty())) {
+		return;
+	}
+	if (!socketPath.empty()) {
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+		unlink(socketPath.c_str()); // left behind by an earlier run
+		listenHandle = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listenHandle >= 0 && (bind(listenHandle, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+			listen(listenHandle, 8) < 0)) {
+			close(listenHandle);
+			listenHandle = -1; // the file, if any, is still written
+		}
+	}
+	wakeHandle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	thread = std::thread(&StatsExporter::run, this);
+}
+
+void Adapter::StatsExporter::stop() {
+	if (!thread.joinable()) {
+		return;
+	}
+	const uint64_t one = 1;
+	if (write(wakeHandle, &one, sizeof(one)) < 0) {
+		; // the counter cannot overflow with a single wakeup
+	}
+	thread.join();
+	close(wakeHandle);
+	wakeHandle = -1;
+	if (listenHandle >= 0) {
+		close(listenHandle);
+		listenHandle = -1;
+		unlink(socketPath.c_str());
+	}
+}
+
+// Runs on its own thread: answers stats socket clients and rewrites the
+// stats file, until stop()
+void Adapter::StatsExporter::run() {
+	time_t nextWrite = 0;
+	for (;;) {
+		const time_t now = time(NULL);
+		if (!filePath.empty() && now >= nextWrite) {
+			writeFile();
+			nextWrite = now + interval;
+		}
+
+		struct pollfd pfd[2];
+		pfd[0].fd = wakeHandle;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = listenHandle;
+		pfd[1].events = POLLIN;
+		pfd[0].revents = pfd[1].revents = 0;
+		const int timeout = filePath.empty() ? -1 : static_cast<int>(nextWrite - now) * 1000;
+		const int ready = poll(pfd, listenHandle >= 0 ? 2 : 1, timeout);
+		if (ready < 0 && errno != EINTR) {
+			return;
+		}
+		if (pfd[0].revents) {
+			return; // stop()
+		}
+		if (pfd[1].revents & POLLIN) {
+			const int client = accept4(listenHandle, 0, 0, SOCK_CLOEXEC);
+			if (client >= 0) {
+				const std::string reply = text();
+				size_t written = 0;
+				while (written < reply.size()) {
+					const ssize_t s = send(client, reply.data() + written, reply.size() - written, MSG_NOSIGNAL);
+					if (s <= 0 && errno != EINTR) {
+						break; // the reader went away
+					}
+					written += s > 0 ? s : 0;
+				}
+				close(client);
+			}
+		}
+	}
+}
+
+// written next to the file and renamed over it, so readers never see half of it
+void Adapter::StatsExporter::writeFile() const {
+	const std::string temporary = filePath + ".tmp";
+	{
+		std::ofstream file(temporary.c_str(), std::ofstream::out | std::ofstream::trunc);
+		file << text();
+		if (!file) {
+			return;
+		}
+	}
+	rename(temporary.c_str(), filePath.c_str());
+}
+
+std::string Adapter::StatsExporter::text() const {
+	std::ostringstream os;
+	metrics->print(os, labels);
+	return os.str();
+}
+
+std::string Adapter::StatsExporter::Expand(const std::string &path) {
+	std::string expanded = path;
+	const std::string::size_type pid = expanded.find("%p");
+	if (pid != std::string::npos) {
+		expanded.replace(pid, 2, std::to_string(getpid()));
+	}
+	return expanded;
+}
@@ -0,0 +1,110 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_METRICS_H
+#define FG_METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <thread>
+
+namespace Adapter {
+
+// microseconds on the monotonic clock, for measuring latencies
+uint64_t MonotonicMicros();
+
+// Latency histogram with HDR-style log-linear buckets: values below
+// 2^SUB_BITS microseconds get a bucket each, every power of two above that
+// is split into 2^SUB_BITS buckets, so any value is off by at most 1/8th.
+// Recording is a relaxed atomic increment; any thread may record or print.
+class Histogram {
+	public:
+		Histogram();
+
+		void record(uint64_t micros);
+		// Prometheus text: cumulative buckets up to the highest used one, sum and count
+		void print(std::ostream &os, const std::string &name, const std::string &labels) const;
+
+	private:
+		static size_t BucketOf(uint64_t micros);
+		static uint64_t LowerBound(size_t bucket);
+
+		static const unsigned SUB_BITS = 3;
+		static const size_t BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+		std::atomic<uint64_t> counts[BUCKETS];
+		std::atomic<uint64_t> sum; // microseconds
+};
+
+// What one Service saw of its transactions with ecapguardian. The counters
+// are relaxed atomics, updated without locks from the host thread and the
+// event loop thread alike.
+class Metrics {
+	public:
+		Metrics();
+
+		// the stages of an exchange that have a timeout of their own
+		typedef enum { phConnect, phVerdict, phBody } Phase;
+
+		void verdict(char c);
+		void timeout(Phase phase);
+		void print(std::ostream &os, const std::string &labels) const;
+
+		std::atomic<uint64_t> bytesSent; // to ecapguardian
+		std::atomic<uint64_t> bytesReceived; // from ecapguardian
+		std::atomic<uint64_t> connectFailures;
+		std::atomic<uint64_t> correlated; // RESPMOD: correlation ID sent instead of the cause header
+		std::atomic<uint64_t> causeFetches; // RESPMOD: ecapguardian wanted the cause header after all
+		std::atomic<uint64_t> scanHints; // RESPMOD: 's' limited the body ecapguardian gets
+		std::atomic<uint64_t> breakerTrips; // a backend's circuit breaker opened
+		std::atomic<uint64_t> breakerRejected; // transactions that skipped ecapguardian, all breakers being open
+		std::atomic<uint64_t> breakerOpen; // backends whose breaker is open
+		Histogram connect; // connection checkout, connect() and hello included
+		Histogram headerRoundTrip; // header written until the header verdict
+		Histogram bodyScan; // body requested until the body verdict
+
+	private:
+		static const char VERDICTS[]; // the ones that are counted
+		std::atomic<uint64_t> verdicts[8]; // by position in VERDICTS
+		static const char *const PHASES[]; // label values, by Phase
+		std::atomic<uint64_t> timeouts[3]; // by Phase
+};
+
+// Publishes Metrics in the Prometheus text format, on a Unix stream socket
+// that answers every connection with the current values and closes it,
+// and/or in a file rewritten every interval seconds. "%p" in either path
+// is replaced by the process ID, so that Squid workers do not collide.
+class StatsExporter {
+	public:
+		StatsExporter();
+		~StatsExporter();
+
+		// labels go into every sample, e.g. adapter="reqmod"
+		void configure(const Metrics *metrics, const std::string &labels,
+			const std::string &socketPath, const std::string &filePath, time_t interval);
+		void start(); // does nothing unless a path is configured
+		void stop();
+
+	private:
+		void run();
+		void writeFile() const;
+		std::string text() const;
+		static std::string Expand(const std::string &path);
+
+		const Metrics *metrics;
+		std::string labels;
+		std::string socketPath; // expanded
+		std::string filePath; // expanded
+		time_t interval;
+
+		int listenHandle;
+		int wakeHandle; // eventfd, wakes the thread up for stop()
+		std::thread thread;
+};
+
+} // namespace Adapter
+
+#endif
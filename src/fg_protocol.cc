@@ -0,0 +1,138 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+#include "fg_protocol.h"
+
+static const char HELLO_MAGIC[] = "FGP";
+
+std::string Adapter::FrameHeader(char type, uint32_t length, unsigned char flags, uint32_t stream) {
+	char data[FRAME_HEADER_SIZE];
+	memset(data, 0, sizeof(data));
+	data[0] = type;
+	data[1] = flags;
+	const uint32_t netStream = htonl(stream);
+	memcpy(data + 4, &netStream, sizeof(netStream));
+	const uint32_t netLength = htonl(length);
+	memcpy(data + 8, &netLength, sizeof(netLength));
+	return std::string(data, sizeof(data));
+}
+
+bool Adapter::ParseFrameHeader(const char *data, char &type, unsigned char &flags, uint32_t &stream, uint32_t &length) {
+	if (data[2] != '\0' || data[3] != '\0') {
+		return false; // newer frames we did not ask for
+	}
+	type = data[0];
+	flags = data[1];
+	uint32_t netStream;
+	memcpy(&netStream, data + 4, sizeof(netStream));
+	stream = ntohl(netStream);
+	uint32_t netLength;
+	memcpy(&netLength, data + 8, sizeof(netLength));
+	length = ntohl(netLength);
+	return true;
+}
+
+std::string Adapter::ScanHints(uint32_t scanBytes, uint32_t flags) {
+	char data[SCAN_HINTS_SIZE];
+	const uint32_t netScanBytes = htonl(scanBytes);
+	memcpy(data, &netScanBytes, sizeof(netScanBytes));
+	const uint32_t netFlags = htonl(flags);
+	memcpy(data + 4, &netFlags, sizeof(netFlags));
+	return std::string(data, sizeof(data));
+}
+
+bool Adapter::ParseScanHints(const std::string &payload, uint32_t &scanBytes, uint32_t &flags) {
+	if (payload.size() < SCAN_HINTS_SIZE) {
+		return false;
+	}
+	uint32_t netScanBytes;
+	memcpy(&netScanBytes, payload.data(), sizeof(netScanBytes));
+	scanBytes = ntohl(netScanBytes);
+	uint32_t netFlags;
+	memcpy(&netFlags, payload.data() + 4, sizeof(netFlags));
+	flags = ntohl(netFlags);
+	return true;
+}
+
+bool Adapter::Negotiate(int socketHandle, int wantedVersion, uint32_t wantedFeatures, int timeoutMs, int &version, uint32_t &features) {
+	char hello[HELLO_SIZE];
+	memset(hello, 0, sizeof(hello));
+	memcpy(hello, HELLO_MAGIC, 3);
+	hello[3] = static_cast<char>(wantedVersion);
+	const uint32_t netFeatures = htonl(wantedFeatures);
+	memcpy(hello + 4, &netFeatures, sizeof(netFeatures));
+	if (write(socketHandle, hello, sizeof(hello)) != static_cast<ssize_t>(sizeof(hello))) {
+		if (errno == 0) {
+			errno = EPROTO;
+		}
+		return false;
+	}
+
+	char answer[HELLO_SIZE];
+	size_t got = 0;
+	while (got < sizeof(answer)) {
+		struct pollfd pfd;
+		pfd.fd = socketHandle;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		const int ready = poll(&pfd, 1, timeoutMs);
+		if (ready == 0) {
+			errno = ETIMEDOUT; // most likely a v1-only server waiting for "\n\n"
+			return false;
+		}
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		const ssize_t s = read(socketHandle, answer + got, sizeof(answer) - got);
+		if (s <= 0) {
+			if (s == 0) {
+				errno = EPROTO;
+			}
+			if (s < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		got += s;
+	}
+	if (memcmp(answer, HELLO_MAGIC, 3) != 0 || answer[3] < PROTOCOL_V1 || answer[3] > wantedVersion) {
+		errno = EPROTO;
+		return false;
+	}
+	version = answer[3];
+	uint32_t answerFeatures;
+	memcpy(&answerFeatures, answer + 4, sizeof(answerFeatures));
+	features = version == PROTOCOL_V1 ? 0 : ntohl(answerFeatures) & wantedFeatures;
+	return true;
+}
+
+size_t Adapter::IovSize(const struct iovec *iov, int iovcnt) {
+	size_t size = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		size += iov[i].iov_len;
+	}
+	return size;
+}
+
+std::string Adapter::IovTail(const struct iovec *iov, int iovcnt, size_t skip) {
+	std::string tail;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		tail.append(static_cast<const char*>(iov[i].iov_base) + skip, iov[i].iov_len - skip);
+		skip = 0;
+	}
+	return tail;
+}
@@ -0,0 +1,130 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_PROTOCOL_H
+#define FG_PROTOCOL_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <string>
+
+namespace Adapter {
+
+// Wire protocol versions spoken with ecapguardian.
+//
+// v1 is the original byte protocol: headers and bodies are sent as they
+// are, the server's header and body end at an empty line ("\n\n", maybe
+// followed by NUL padding), and each part is acknowledged with a bare 'r'.
+//
+// v2 is negotiated right after connect(): the adapter sends a hello,
+//   "FGP" <highest version it speaks> <uint32 features it offers>
+// and the server answers in kind with the version it picked (1 or 2) and
+// the offered features it supports (FEATURE_* bits, 0 in v1).
+// From then on everything is a frame, in both directions:
+//   <uint8 type> <uint8 flags> <2 reserved bytes, 0> <uint32 stream> <uint32 length> <payload>
+// with the integers in network byte order, and stream 0 unless the
+// connection is multiplexed (see below). Verdicts are payload-less
+// frames typed with the v1 verdict character ('v', 'm', 'b', 's'), acks are
+// payload-less 'r' frames, and headers and bodies are single frames whose
+// length lets the reader size its buffer up front instead of scanning for
+// an end marker. The frame boundaries also make the v1 transaction reset
+// byte unnecessary on pooled connections.
+//
+// Block page templates (v2, REQMOD): when the header frame carries
+// FRAME_FLAG_BLOCK_TEMPLATES, ecapguardian may answer a blocked request with
+// a 't' verdict frame instead of 'b'. Its payload is the template ID, then
+// NUL separated placeholder names and values. The adapter acks it with 'r'
+// when it has the template, or asks for it with an 'f' frame, and the
+// template then follows like a block page: header frame, ack, body frame,
+// ack.
+//
+// Request correlation (v2, FEATURE_CORRELATION): a REQMOD header frame may
+// be preceded by a 'C' frame carrying an ID the adapter made up for the
+// request, and ecapguardian keeps what it learned about the request under
+// that ID. The ID travels to the RESPMOD phase of the same request as a
+// transaction option, and RESPMOD sends the 'C' frame instead of the cause
+// header frame. When ecapguardian no longer knows the ID, it answers with a
+// payload-less 'c' frame, the adapter sends the cause header frame after
+// all, and the header verdict follows as usual.
+//
+// No acks (v2, FEATURE_NO_ACKS): ecapguardian sends the whole reply
+// (verdict, header, body) without waiting for an 'r' after each part, and
+// the adapter sends none. Where an ack is answered with something else
+// (the 'f' fetch after 't', the cause header after 'c'), the answer is
+// still sent and waited for. It saves up to three round trips per
+// transaction; servers that do not know the feature keep the acks.
+//
+// Scan hints (v2, FEATURE_SCAN_HINTS, RESPMOD): the 's' header verdict
+// frame may carry a payload telling the adapter how much of the body
+// ecapguardian is going to use,
+//   <uint32 scan bytes> <uint32 hint flags>
+// (later fields are ignored). Scan bytes, unless 0, caps the body bytes
+// ecapguardian gets, like a max_scan_bytes of its own. With
+// SCAN_HINT_PREFIX only that many bytes matter (say, for MIME sniffing):
+// past them the adapter sends 'E' early, whatever its oversize_action,
+// and passes the rest of the body on unscanned once the verdict is in.
+//
+// Multiplexing (v2, FEATURE_MULTIPLEX, with async_verdicts): the
+// connection is shared by many transactions at once. Each transaction is a
+// stream, numbered from 1 by the adapter, and every frame carries its
+// stream in the stream field. Frames of different streams may follow each
+// other in any order, but a frame is never split. There are no 'r' acks,
+// as with FEATURE_NO_ACKS, whether or not that was negotiated too. A transaction that ends before
+// its stream is finished sends a payload-less 'X' frame, after which
+// ecapguardian forgets the stream and ignores anything else for it.
+const int PROTOCOL_V1 = 1;
+const int PROTOCOL_V2 = 2;
+
+const size_t FRAME_HEADER_SIZE = 12;
+const size_t HELLO_SIZE = 8;
+
+// hello feature bits
+const uint32_t FEATURE_CORRELATION = 0x00000001; // 'C' and 'c' frames
+const uint32_t FEATURE_MULTIPLEX = 0x00000002; // streams, and no acks
+const uint32_t FEATURE_NO_ACKS = 0x00000004; // replies without 'r' round trips
+const uint32_t FEATURE_SCAN_HINTS = 0x00000008; // 's' may carry scan hints
+
+// adapter to ecapguardian
+const char FRAME_HEADER = 'H'; // REQMOD request header, RESPMOD request (cause) header
+const char FRAME_RESPONSE_HEADER = 'R'; // RESPMOD response header
+const char FRAME_BODY = 'B'; // a piece of the virgin body
+const char FRAME_END_OF_BODY = 'E'; // no more virgin body
+const char FRAME_ACK = 'r';
+const char FRAME_TEMPLATE_FETCH = 'f'; // instead of an ack: send the block page template
+const char FRAME_CORRELATION = 'C'; // REQMOD: names the request; RESPMOD: stands in for the cause header
+const char FRAME_CANCEL = 'X'; // multiplexed: the stream is abandoned
+// ecapguardian to adapter: verdict frames (including 'c', see above),
+// FRAME_HEADER and FRAME_BODY
+
+// frame flags
+const unsigned char FRAME_FLAG_UNCACHEABLE = 0x01; // on a 'v' verdict: do not cache it
+const unsigned char FRAME_FLAG_BLOCK_TEMPLATES = 0x02; // on a REQMOD header: 't' verdicts are understood
+
+// scan hints, see above
+const size_t SCAN_HINTS_SIZE = 8;
+const uint32_t SCAN_HINT_PREFIX = 0x00000001; // the first scan bytes are all that matter
+
+// encodes the frame header that precedes length bytes of payload; stream
+// is 0 unless the connection is multiplexed
+std::string FrameHeader(char type, uint32_t length, unsigned char flags = 0, uint32_t stream = 0);
+// decodes FRAME_HEADER_SIZE bytes; false if the reserved field is set
+bool ParseFrameHeader(const char *data, char &type, unsigned char &flags, uint32_t &stream, uint32_t &length);
+// the payload of an 's' frame with scan hints, and back; false if it is
+// shorter than SCAN_HINTS_SIZE
+std::string ScanHints(uint32_t scanBytes, uint32_t flags);
+bool ParseScanHints(const std::string &payload, uint32_t &scanBytes, uint32_t &flags);
+
+// Blocking version negotiation on a freshly connected socket. Sets version
+// to the one ecapguardian picked and features to the offered ones it took,
+// or returns false with errno set (EPROTO for a garbled answer, ETIMEDOUT
+// when there is none within timeoutMs).
+bool Negotiate(int socketHandle, int wantedVersion, uint32_t wantedFeatures, int timeoutMs, int &version, uint32_t &features);
+
+// total size of the buffers
+size_t IovSize(const struct iovec *iov, int iovcnt);
+// the bytes of the buffers past the first skip ones (what a short writev left)
+std::string IovTail(const struct iovec *iov, int iovcnt, size_t skip);
+
+} // namespace Adapter
+
+#endif
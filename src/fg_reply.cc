@@ -0,0 +1,347 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <string.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <string>
+
+#include "fg_block_pages.h"
+#include "fg_reply.h"
+
+const char Adapter::Reply::FLAG_USE_VIRGIN;
+const char Adapter::Reply::FLAG_USE_VIRGIN_UNCACHEABLE;
+const char Adapter::Reply::FLAG_MODIFY;
+const char Adapter::Reply::FLAG_BLOCK;
+const char Adapter::Reply::FLAG_BLOCK_TEMPLATE;
+const char Adapter::Reply::FLAG_NEEDS_SCAN;
+const char Adapter::Reply::FLAG_NEEDS_CAUSE;
+const char Adapter::Reply::FLAG_MSG_RECVD;
+const size_t Adapter::Reply::DEFAULT_MAX_SIZE;
+
+Adapter::Reply::Reply(Kind aKind, int aVersion):
+	kind(aKind), version(aVersion), stream(0), acks(true), verdict(0), uncacheable(false), maxSize(DEFAULT_MAX_SIZE),
+	blockPages(0), cause(0), causeFetched(false), scanHints(false), scanBytes(0), scanHintFlags(0),
+	state(stVerdict), afterAck(stDone), fetch(false), sendCause(false), padding(false),
+	frameLeft(0), inPayload(false) {
+}
+
+std::string Adapter::Reply::ack() const {
+	if (fetch) {
+		return FrameHeader(FRAME_TEMPLATE_FETCH, 0, 0, stream);
+	}
+	if (sendCause) {
+		return *cause;
+	}
+	if (version == PROTOCOL_V2) {
+		return FrameHeader(FRAME_ACK, 0, 0, stream);
+	}
+	return std::string(1, FLAG_MSG_RECVD);
+}
+
+void Adapter::Reply::feed(const char *data, size_t size) {
+	while (size > 0 && (state == stVerdict || state == stTemplate || state == stHints || state == stHeader || state == stBody)) {
+		const size_t used = parse(data, size);
+		data += used;
+		size -= used;
+	}
+	if (padding) {
+		while (size > 0 && *data == '\0') {
+			++data;
+			--size;
+		}
+		if (size > 0) {
+			padding = false;
+		}
+	}
+	// ecapguardian may not send anything before our ack, nor after the
+	// reply is done; keep it so that the socket is not reused
+	stash.append(data, size);
+}
+
+size_t Adapter::Reply::payloadRoom(char *&space) {
+	if (!inPayload || state == stAck) {
+		return 0;
+	}
+	std::string &target = block();
+	space = &target[target.size() - frameLeft];
+	return frameLeft;
+}
+
+void Adapter::Reply::filled(size_t size) {
+	if (!size) {
+		return;
+	}
+	frameLeft -= size;
+	if (!frameLeft) {
+		inPayload = false;
+		endOfBlock();
+	}
+}
+
+void Adapter::Reply::acked() {
+	if (state != stAck) {
+		return;
+	}
+	state = afterAck;
+	fetch = false;
+	if (sendCause) {
+		cause = 0; // sent; ecapguardian does not get to ask twice
+		sendCause = false;
+	}
+	std::string pending;
+	pending.swap(stash);
+	feed(pending.data(), pending.size());
+}
+
+size_t Adapter::Reply::parse(const char *data, size_t size) {
+	if (version == PROTOCOL_V2) {
+		return parseFrame(data, size);
+	}
+
+	if (padding) {
+		size_t skipped = 0;
+		while (skipped < size && data[skipped] == '\0') {
+			++skipped;
+		}
+		if (skipped > 0) {
+			return skipped;
+		}
+		padding = false;
+	}
+
+	switch (state) {
+		case stVerdict:
+			return parseVerdict(data[0]);
+		case stHeader:
+			return parseBlock(header, data, size);
+		case stBody:
+			return parseBlock(body, data, size);
+		default:
+			return 0;
+	}
+}
+
+size_t Adapter::Reply::parseVerdict(char c) {
+	verdict = c;
+	switch (kind) {
+		case rkReqmod:
+			if (c == FLAG_USE_VIRGIN_UNCACHEABLE) {
+				verdict = FLAG_USE_VIRGIN;
+				uncacheable = true;
+				state = stDone;
+			} else if (c == FLAG_USE_VIRGIN) {
+				state = stDone;
+			} else if (c == FLAG_MODIFY || c == FLAG_BLOCK) {
+				state = stHeader;
+			} else if (c == FLAG_BLOCK_TEMPLATE && version == PROTOCOL_V2 && blockPages) {
+				state = stTemplate;
+			} else {
+				fail(std::string("ecapguardian returned '") + c + "' which is not in the supported option set ('v','u','m','b')");
+			}
+			break;
+		case rkRespmodHeaders:
+			if (c == FLAG_USE_VIRGIN || c == FLAG_NEEDS_SCAN) {
+				endOfPart(stDone);
+			} else if (c == FLAG_NEEDS_CAUSE && version == PROTOCOL_V2 && cause) {
+				sendCause = true;
+				causeFetched = true;
+				endOfPart(stVerdict); // the real verdict comes once ecapguardian has the header
+			} else {
+				fail(std::string("did not receive proper response flag.  Received '") + c + "' instead of expected 'v' or 's'");
+			}
+			break;
+		case rkRespmodBody:
+			if (c == FLAG_USE_VIRGIN) {
+				endOfPart(stDone);
+			} else if (c == FLAG_MODIFY) {
+				endOfPart(stHeader);
+			} else {
+				fail(std::string("did not receive proper response flag.  Received '") + c + "' instead of expected 'v' or 'm'");
+			}
+			break;
+	}
+	return 1;
+}
+
+// Appends to block up to and including the first empty line ("\n\n"),
+// which may straddle two reads.
+size_t Adapter::Reply::parseBlock(std::string &block, const char *data, size_t size) {
+	size_t end = 0;
+	if (!block.empty() && block[block.size() - 1] == '\n' && data[0] == '\n') {
+		end = 1;
+	} else {
+		const char *last = data + size;
+		const char *p = data;
+		while ((p = static_cast<const char*>(memchr(p, '\n', last - p))) && p + 1 < last) {
+			if (p[1] == '\n') {
+				end = p + 2 - data;
+				break;
+			}
+			++p;
+		}
+	}
+
+	if (block.size() + (end ? end : size) > maxSize) {
+		fail("ecapguardian sent more than max_reply_size bytes of header or body");
+		return size;
+	}
+	if (!end) {
+		block.append(data, size);
+		return size;
+	}
+
+	block.append(data, end);
+	padding = true;
+	endOfBlock();
+	return end;
+}
+
+// v2: collects a frame header, then reads exactly its length of payload
+size_t Adapter::Reply::parseFrame(const char *data, size_t size) {
+	if (inPayload) {
+		char *space;
+		const size_t used = std::min<size_t>(size, payloadRoom(space));
+		memcpy(space, data, used);
+		filled(used);
+		return used;
+	}
+
+	const size_t used = std::min(size, FRAME_HEADER_SIZE - frame.size());
+	frame.append(data, used);
+	if (frame.size() == FRAME_HEADER_SIZE) {
+		char type;
+		unsigned char flags;
+		uint32_t frameStream;
+		uint32_t length;
+		if (!ParseFrameHeader(frame.data(), type, flags, frameStream, length)) {
+			fail("ecapguardian sent a frame with unsupported reserved fields");
+		} else if (frameStream != stream) {
+			fail("ecapguardian sent a frame for stream " + std::to_string(frameStream) + " instead of " + std::to_string(stream));
+		} else {
+			startFrame(type, flags, length);
+		}
+		frame.clear();
+	}
+	return used;
+}
+
+void Adapter::Reply::startFrame(char type, unsigned char flags, uint32_t length) {
+	if (state == stVerdict) {
+		if (type == FLAG_BLOCK_TEMPLATE && kind == rkReqmod) {
+			parseVerdict(type);
+			if (state == stTemplate) {
+				if (length > maxSize) {
+					fail("ecapguardian announced a block page template reference over max_reply_size");
+				} else if (length) {
+					blockTemplate.resize(length);
+					frameLeft = length;
+					inPayload = true;
+				} else {
+					fail("ecapguardian sent an empty block page template reference");
+				}
+			}
+		} else if (type == FLAG_NEEDS_SCAN && kind == rkRespmodHeaders && scanHints && length) {
+			verdict = type;
+			if (length > maxSize) {
+				fail("ecapguardian announced scan hints over max_reply_size");
+			} else {
+				state = stHints;
+				hints.resize(length);
+				frameLeft = length;
+				inPayload = true;
+			}
+		} else if (length) {
+			fail(std::string("ecapguardian verdict frame '") + type + "' has a payload");
+		} else {
+			uncacheable = (flags & FRAME_FLAG_UNCACHEABLE) != 0;
+			parseVerdict(type);
+		}
+		return;
+	}
+
+	const char expected = state == stHeader ? FRAME_HEADER : FRAME_BODY;
+	if (type != expected) {
+		fail(std::string("ecapguardian sent frame '") + type + "' instead of '" + expected + "'");
+		return;
+	}
+	if (!length) {
+		endOfBlock();
+		return;
+	}
+	// room for all of the announced payload, which is then read or copied
+	// into place; the announced length is not to be trusted with memory
+	if (length > maxSize - block().size()) {
+		fail("ecapguardian announced a " + std::to_string(length) + " byte frame, over max_reply_size");
+		return;
+	}
+	block().resize(block().size() + length);
+	frameLeft = length;
+	inPayload = true;
+}
+
+// where frame payload goes in the current state
+std::string &Adapter::Reply::block() {
+	if (state == stTemplate) {
+		return blockTemplate;
+	}
+	if (state == stHints) {
+		return hints;
+	}
+	return state == stHeader ? header : body;
+}
+
+void Adapter::Reply::endOfBlock() {
+	if (state == stTemplate) {
+		// hold on to the template, the cache may drop it before it is used
+		blockPage = blockPages->find(BlockPage::Id(blockTemplate));
+		fetch = !blockPage;
+		endOfPart(blockPage ? stDone : stHeader, true); // ecapguardian waits for 'r' or 'f'
+	} else if (state == stHints) {
+		if (ParseScanHints(hints, scanBytes, scanHintFlags)) {
+			endOfPart(stDone); // acked like a plain 's'
+		} else {
+			fail("ecapguardian sent " + std::to_string(hints.size()) + " bytes of scan hints, too few");
+		}
+	} else if (state == stHeader && !(kind == rkReqmod && verdict == FLAG_MODIFY)) {
+		endOfPart(stBody); // block page or rewritten response follows
+	} else {
+		endOfPart(stDone);
+	}
+}
+
+// answer: what goes back is more than a plain ack, and is sent even
+// with acks off
+void Adapter::Reply::endOfPart(State next, bool answer) {
+	if (!acks && !answer && !fetch && !sendCause) {
+		state = next;
+		return;
+	}
+	state = stAck;
+	afterAck = next;
+}
+
+void Adapter::Reply::fail(const std::string &why) {
+	state = stError;
+	error = why;
+}
+
+ssize_t Adapter::ReadInto(int socket, Reply &reply, char *buf, size_t bufSize) {
+	struct iovec iov[2];
+	int iovcnt = 0;
+	char *space;
+	const size_t room = reply.payloadRoom(space);
+	if (room) {
+		iov[iovcnt].iov_base = space;
+		iov[iovcnt++].iov_len = room;
+	}
+	iov[iovcnt].iov_base = buf;
+	iov[iovcnt++].iov_len = bufSize;
+	const ssize_t s = readv(socket, iov, iovcnt);
+	if (s > 0) {
+		const size_t direct = std::min<size_t>(s, room);
+		reply.filled(direct);
+		reply.feed(buf, s - direct);
+	}
+	return s;
+}
@@ -0,0 +1,137 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_REPLY_H
+#define FG_REPLY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <memory>
+#include <string>
+
+#include "fg_protocol.h"
+
+namespace Adapter {
+
+class BlockPage;
+class BlockPageCache;
+
+// Incremental parser for what ecapguardian sends back on the socket.
+//
+// Feed it bytes as they arrive, in pieces of any size. Whenever needsAck()
+// is true the adapter must write ack() and call acked() before
+// ecapguardian will continue; with acks off (FEATURE_NO_ACKS, or a
+// multiplexed stream) that is only the case for the answers to 't' and 'c'. The same parser serves the
+// blocking adapters (read, feed, repeat) and the event loop thread.
+//
+// Reply grammar, by the stage the reply belongs to:
+//   rkReqmod:          'v' | 'u' | 'm' header ack | 'b' header ack body ack |
+//                      't' (ack | fetch header ack body ack)
+//   rkRespmodHeaders:  ['c' cause] ('v' | 's' [hints]) ack
+//   rkRespmodBody:     'v' ack | 'm' ack header ack body ack
+// With PROTOCOL_V1, header and body run up to and including an empty line,
+// optionally followed by NUL padding (the "\n\n\0\0" end marker). With
+// PROTOCOL_V2 every verdict, header and body is a frame and the header and
+// body are read by length. The block page template verdict 't', the
+// cause fetch 'c' (answered with the cause header, see fg_protocol.h) and
+// the scan hints on 's' are v2 only.
+class Reply {
+	public:
+		typedef enum { rkReqmod, rkRespmodHeaders, rkRespmodBody } Kind;
+
+		explicit Reply(Kind aKind, int aVersion = PROTOCOL_V1);
+
+		// consumes all the given bytes; anything the server sent ahead of
+		// an acknowledgement is kept until acked()
+		void feed(const char *data, size_t size);
+
+		// v2: where the rest of the frame payload being received goes, so
+		// that it can be read there directly (see ReadInto()); 0 when no
+		// payload is due. The room never exceeds maxSize: a frame that
+		// announces more fails the reply before anything is set aside. After the read, filled() takes the bytes that
+		// landed there and feed() whatever came on top.
+		size_t payloadRoom(char *&space);
+		void filled(size_t size);
+
+		bool needsAck() const { return state == stAck; }
+		std::string ack() const; // what to write back before acked()
+		void acked();
+
+		bool complete() const { return state == stDone; }
+		bool failed() const { return state == stError; }
+		// complete and nothing unexpected followed, so the socket is reusable
+		bool clean() const { return complete() && stash.empty(); }
+
+		const Kind kind;
+		const int version; // wire protocol version
+		uint32_t stream; // multiplexed: the stream the frames must carry
+		bool acks; // false: no 'r' for the parts, see FEATURE_NO_ACKS
+		char verdict; // 0 until received
+		bool uncacheable; // a 'v' verdict that must not be cached
+		std::string header; // modified or block page header, if any
+		std::string body; // replacement body, if any
+		std::string blockTemplate; // 't': the template reference, see fg_protocol.h
+
+		// the reply fails when a header, body or template reference gets
+		// bigger than this, before any memory is set aside for it
+		size_t maxSize;
+		static const size_t DEFAULT_MAX_SIZE = 64*1024*1024;
+
+		// set by the adapter when it offered templates; 't' needs it
+		const BlockPageCache *blockPages;
+		// 't': the cached template; null when it was fetched into header and body
+		std::shared_ptr<const BlockPage> blockPage;
+		// set by RESPMOD when it sent a correlation ID instead of the cause
+		// header: that header's frame, which 'c' asks for
+		const std::string *cause;
+		bool causeFetched; // 'c' came and the cause header went out
+		// set by RESPMOD when FEATURE_SCAN_HINTS was negotiated; only then
+		// may 's' carry a payload
+		bool scanHints;
+		uint32_t scanBytes; // 's' hint: body bytes ecapguardian uses, 0: all
+		uint32_t scanHintFlags; // SCAN_HINT_* bits
+		std::string error; // why the reply failed
+
+		static const char FLAG_USE_VIRGIN = 'v';
+		static const char FLAG_USE_VIRGIN_UNCACHEABLE = 'u'; // v1 REQMOD only, read as 'v'
+		static const char FLAG_MODIFY = 'm';
+		static const char FLAG_BLOCK = 'b';
+		static const char FLAG_BLOCK_TEMPLATE = 't';
+		static const char FLAG_NEEDS_SCAN = 's';
+		static const char FLAG_NEEDS_CAUSE = 'c';
+		static const char FLAG_MSG_RECVD = 'r'; // written by the adapter: header/body received
+
+	private:
+		typedef enum { stVerdict, stTemplate, stHints, stHeader, stBody, stAck, stDone, stError } State;
+
+		size_t parse(const char *data, size_t size);
+		size_t parseVerdict(char c);
+		size_t parseBlock(std::string &block, const char *data, size_t size);
+		size_t parseFrame(const char *data, size_t size);
+		std::string &block();
+		void startFrame(char type, unsigned char flags, uint32_t length);
+		void endOfBlock();
+		void endOfPart(State next, bool answer = false);
+		void fail(const std::string &why);
+
+		State state;
+		State afterAck; // where parsing continues after acked()
+		bool fetch; // the pending ack asks for the block page template
+		bool sendCause; // the pending ack is the cause header
+		bool padding; // v1: skipping NULs after the end of a header or body
+		std::string frame; // v2: frame header bytes received so far
+		uint32_t frameLeft; // v2: payload bytes still to come, at the end of block()
+		bool inPayload; // v2: frame header done, reading frameLeft bytes
+		std::string stash; // bytes received while waiting to send an ack
+		std::string hints; // v2: the payload of 's'
+};
+
+// One read of a reply: straight into reply.payloadRoom(), with whatever
+// follows the payload (or all of it, when there is no room) going to buf,
+// and fed to the reply. Returns what readv() returned. Memory is only
+// taken up to Reply::maxSize, whatever the server announces.
+ssize_t ReadInto(int socket, Reply &reply, char *buf, size_t bufSize);
+
+} // namespace Adapter
+
+#endif
@@ -9,13 +9,14 @@
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <fstream>
 #include <iostream>
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <vector>
 
 #include <libecap/common/registry.h>
 #include <libecap/common/errors.h>
@@ -28,18 +29,31 @@
 #include <libecap/adapter/xaction.h>
 #include <libecap/host/xaction.h>
 
+#include "fg_block_pages.h"
+#include "fg_body_store.h"
+#include "fg_config.h"
+#include "fg_connection_pool.h"
+#include "fg_event_loop.h"
+#include "fg_logger.h"
+#include "fg_metrics.h"
+#include "fg_protocol.h"
+#include "fg_reply.h"
+#include "fg_scope.h"
+#include "fg_service_core.h"
+#include "fg_verdict_cache.h"
+
 namespace Adapter {
 
 using libecap::size_type;
 
-std::ostream& logStart(std::ostream& output) {
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        return output << getpid() << "," << tv.tv_sec << "." << tv.tv_usec << ",";
-}
+// Local to this file, so that the combined plugin can carry the REQMOD and
+// the RESPMOD Service and Xaction classes side by side
+namespace {
 
-class Service: public libecap::adapter::Service {
+class Service: public libecap::adapter::Service, public ServiceCore {
 	public:
+		Service(): ServiceCore("REQMOD") {}
+
 		// About
 		virtual std::string uri() const; // needs to be unique
 		virtual std::string tag() const; // changes with version and config
@@ -61,27 +75,25 @@ class Service: public libecap::adapter::Service {
 		// Work
 		virtual MadeXactionPointer makeXaction(libecap::host::Xaction *hostx);
 
-		std::string ecapguardian_listen_socket;
-
-		bool debug = false;
-	protected:
-		void set_listen_socket(const std::string &value);
-};
-
-
-// Calls Service::setOne() for each host-provided configuration option.
-// See Service::configure().
-class Cfgtor: public libecap::NamedValueVisitor {
-	public:
-		Cfgtor(Service &aSvc): svc(aSvc) {}
-		virtual void visit(const libecap::Name &name, const libecap::Area &value) {
-			svc.setOne(name, value);
-		}
-		Service &svc;
+		// Asynchronous transactions (async_verdicts)
+		virtual bool makesAsyncXactions() const;
+		virtual void suspend(timeval &timeout); // host is going to sleep
+		virtual void resume(); // host woke up; hand it finished verdicts
+
+		// remember "use virgin" verdicts (off unless verdict_cache_size is set)
+		size_type verdict_cache_size = 0;
+		size_type verdict_cache_ttl = 60; // seconds
+		std::vector<std::string> verdict_cache_headers; // lowercase names, part of the key
+		mutable VerdictCache verdictCache;
+		std::string verdictCacheKey(const libecap::Message &request) const;
+
+		// block page templates ecapguardian may refer to with 't' (v2 only)
+		size_type block_page_cache_size = 0;
+		mutable BlockPageCache blockPages;
 };
 
 
-class Xaction: public libecap::adapter::Xaction {
+class Xaction: public libecap::adapter::Xaction, public AsyncClient {
 	public:
 		Xaction(libecap::shared_ptr<Service> s, libecap::host::Xaction *x);
 		virtual ~Xaction();
@@ -104,23 +116,43 @@ class Xaction: public libecap::adapter::Xaction {
 		virtual void noteVbContentDone(bool atEnd);
 		virtual void noteVbContentAvailable();
 
+		// the event loop got the verdict (async_verdicts)
+		virtual void noteExchangeReady();
+
 	protected:
-		void stopVb(); // tells host we don't need more VB
+		void readReply(Reply &reply); // blocking
+		void applyReply(Reply &reply);
+		bool timedOut(const Timeout &timeout); // applies timeout_action
+		bool fallBack(ServiceCore::FallbackAction action, const std::string &reason);
+		void useBlockPage(const std::string &header, std::string &body);
+		void stopVb(); // tells host we don't need more VB (or have seen all of it)
 		libecap::host::Xaction *lastHostCall(); // eCAP should have a better
 			//method for taking care of this
 
 	private:
-		std::ofstream logFile;
+		TraceStream logFile; // debug trace lines, tagged with the transaction ID
 		libecap::shared_ptr<const Service> service;
 		libecap::host::Xaction *hostx;
+		libecap::shared_ptr<libecap::Message> adapted; // clone of the request
 
-		std::string buffer; // for original request body content
-		std::string e2buffer; // for blockpage
+		BodyStore e2buffer; // for blockpage; the virgin body stays with the host
+		Balancer::Pointer backend; // the ecapguardian socketHandle connects to
 		int socketHandle;  // the ecapguardian eCAP listener
+		bool exchangeDone = false; // the socket can go back to the pool
+		int protocolVersion = PROTOCOL_V1; // as negotiated for socketHandle
+		uint32_t protocolFeatures = 0; // ditto
+		ChannelPointer channel; // multiplex: socketHandle is shared, only the event loop writes
+		uint32_t stream = 0; // ours on channel
+		std::string correlationId; // names the request to ecapguardian and RESPMOD
+		ExchangePointer exchange; // socket work handed to the event loop
+		std::string cacheKey; // empty unless the verdict cache is on
+		uint64_t headerSentAt = 0; // MonotonicMicros() when the header went out
 
 		typedef enum { opUndecided, opWaiting, opOn, opComplete, opNever } OperationState;
 		OperationState receivingVb;
 		OperationState sendingAb;
+		bool vbAtEnd = true; // what noteVbContentDone() said
+		bool vbProduced = false; // noteVbContentDone() came, the host has all of it
 
 		bool debug = false;
 		//// Used for determining which body buffer to use
@@ -128,24 +160,18 @@ class Xaction: public libecap::adapter::Xaction {
 		bool blocked = false;
 
 		////  Flags and such for communication with server
-		const int BUF_SIZE = 512;
-		const char FLAG_USE_VIRGIN = 'v';
-		const char FLAG_MODIFY = 'm';
-		const char FLAG_BLOCK = 'b';
-		const char FLAG_MSG_RECVD = 'r'; // used to signal header/body received to the server
-                const std::string FLAG_END = "\n\n\0\0"; //used for headers/body end
-		const std::string FLAG_END_REMOVE = "\0\0"; //Remove this from the end of the headers/body
+		////  (the headers/body end marker is handled by Reply)
+		const char FLAG_USE_VIRGIN = Reply::FLAG_USE_VIRGIN;
+		const char FLAG_MODIFY = Reply::FLAG_MODIFY;
+		const char FLAG_BLOCK = Reply::FLAG_BLOCK;
 };
 
+} // namespace
+
 static const std::string PACKAGE_NAME = "FilterGizmo";
 
 static const std::string PACKAGE_VERSION = "0.1.0";
 
-static const std::string CfgErrorPrefix =
-	"FilterGizmo REQMOD Adapter: configuration error: ";
-
-static const std::string RunErrorPrefix = "FilterGizmo REQMOD Adapter: Runtime Error: ";
-
 } // namespace Adapter
 
 std::string Adapter::Service::uri() const {
@@ -161,61 +187,87 @@ void Adapter::Service::describe(std::ostream &os) const {
 }
 
 void Adapter::Service::configure(const libecap::Options &cfg) {
-	Cfgtor cfgtor(*this);
+	Cfgtor<Service> cfgtor(*this);
 	cfg.visitEachOption(cfgtor);
 
 	// check for post-configuration errors and inconsistencies
 
 	if (ecapguardian_listen_socket.empty()) {
-		throw libecap::TextException(CfgErrorPrefix +
+		throw libecap::TextException(cfgErrorPrefix +
 			"ecapguardian_listen_socket value is not set");
 	}
+	verdictCache.configure(verdict_cache_size, verdict_cache_ttl);
+	blockPages.configure(block_page_cache_size);
+	applyOptions();
 }
 
 void Adapter::Service::reconfigure(const libecap::Options &cfg) {
-	ecapguardian_listen_socket.clear();
-	configure(cfg);
+	resetOptions();
+	verdict_cache_size = 0;
+	verdict_cache_ttl = 60;
+	verdict_cache_headers.clear();
+	block_page_cache_size = 0;
+	configure(cfg); // also drops the cached verdicts
 }
 
 void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &valArea) {
 	const std::string value = valArea.toString();
-	if (name == "ecapguardian_listen_socket"){
-		set_listen_socket(value);
-	} else if(name == "debug") {
-		debug = true;
+	if (ServiceCore::setOne(name, value)) {
+		; // a connection, protocol, stats or logging option
+	} else if(name == "verdict_cache_size") {
+		verdict_cache_size = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "verdict_cache_ttl") {
+		verdict_cache_ttl = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "verdict_cache_headers") {
+		verdict_cache_headers = ParseList(value);
+	} else if(name == "block_page_cache_size") {
+		block_page_cache_size = ParseSize(cfgErrorPrefix, name, value);
 	} else if (name.assignedHostId()) {
 		; // skip options that don't matter
 	} else{
-		throw libecap::TextException(CfgErrorPrefix +
+		throw libecap::TextException(cfgErrorPrefix +
 			"unsupported configuration parameter: " + name.image());
 	}
 }
 
-void Adapter::Service::set_listen_socket(const std::string &value) {
-	if (value.empty()) {
-		throw libecap::TextException(CfgErrorPrefix +
-			"empty ecapguardian_listen_socket value is not allowed");
-	}
-	ecapguardian_listen_socket += value;
-}
-
 void Adapter::Service::start() {
 	libecap::adapter::Service::start();
-	// no necessary custom code here
+	startThreads();
 }
 
 void Adapter::Service::stop() {
+	stopThreads();
 	libecap::adapter::Service::stop();
-	// no necessary custom code here
 }
 
 void Adapter::Service::retire() {
+	stopThreads();
 	libecap::adapter::Service::stop();
-	// no necessary custom code here
 }
 
 bool Adapter::Service::wantsUrl(const char *url) const {
-	return true;
+	return urlScope.wants(url);
+}
+
+// The method, the URI and the verdict_cache_headers values, NUL-separated.
+// Requests with equal keys are assumed to get the same verdict.
+std::string Adapter::Service::verdictCacheKey(const libecap::Message &request) const {
+	std::string key;
+	if (const libecap::RequestLine *line = dynamic_cast<const libecap::RequestLine*>(&request.firstLine())) {
+		key = line->method().image();
+		key += '\0';
+		const libecap::Area uri = line->uri();
+		key.append(uri.start, uri.size);
+	}
+	for (std::vector<std::string>::const_iterator i = verdict_cache_headers.begin(); i != verdict_cache_headers.end(); ++i) {
+		key += '\0';
+		const libecap::Name name(*i);
+		if (request.header().hasAny(name)) {
+			const libecap::Area value = request.header().value(name);
+			key.append(value.start, value.size);
+		}
+	}
+	return key;
 }
 
 Adapter::Service::MadeXactionPointer
@@ -224,47 +276,29 @@ Adapter::Service::makeXaction(libecap::host::Xaction *hostx) {
 		new Adapter::Xaction(std::tr1::static_pointer_cast<Service>(self), hostx));
 }
 
+bool Adapter::Service::makesAsyncXactions() const {
+	return async_verdicts;
+}
+
+void Adapter::Service::suspend(timeval &timeout) {
+	shortenNap(timeout);
+}
+
+void Adapter::Service::resume() {
+	notifyClients();
+}
+
 Adapter::Xaction::Xaction(libecap::shared_ptr<Service> aService,
 	libecap::host::Xaction *x):
+	logFile(aService->logger, aService->logger.nextId()),
 	service(aService),
 	hostx(x),
 	receivingVb(opUndecided), sendingAb(opUndecided) {
-	int bytes;
-	int s;
-	struct sockaddr_un addr;
-	debug = service->debug;
+	debug = service->logger.enabled(Logger::llDebug) && service->logger.sample();
 	if(debug) {
-		std::string filename;
-	        int randomId;
-	        srand(time(NULL));
-	        filename += "/tmp/reqmodXaction" + std::to_string((rand() % 256)) + ".log";
-	        logFile.open(filename.c_str(), std::ofstream::out | std::ofstream::app);
 	        logFile << logStart <<  "REQMOD Xaction::Xaction" << std::endl;
-		logFile << logStart <<  "REQMOD Xaction::Xaction : eCAP Adapter socket path: '" << service->ecapguardian_listen_socket << "'" << std::endl;
-	        logFile.flush();
-	}
-	//Initializing the Unix Domain Socket connection
-	//service->ecapguardian_listen_socket is the socket path string
-	if ( (socketHandle = socket(AF_UNIX, SOCK_STREAM, 0) ) == -1) {
-		throw libecap::TextException(RunErrorPrefix + "Failed to get Socket Handle for socket filename '" + 
-			service->ecapguardian_listen_socket + "'. errno: " + strerror(errno));
 	}
-
-	//Set up the sockaddr struct with necessary paths
-	memset(&addr, 0, sizeof(addr));
-	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, service->ecapguardian_listen_socket.c_str(), sizeof(addr.sun_path)-1);
-
-        //logFile << logStart <<  "eCAP adapter: Connecting to socket" << std::endl;
-	//Make the connection
-	s = connect(socketHandle, (struct sockaddr*)&addr, sizeof(addr));
-        //logFile << logStart <<  "eCAP adapter: after Connect, s=" << s << std::endl;
-
-	if (s < 0) {
-	//	logFile << logStart <<  "eCAP errno: " << strerror(errno) << std::endl;
-		throw libecap::TextException(RunErrorPrefix + "Failed to Connect. errno: " + strerror(errno));
-	}
-	//If you got here, you're ready to start writing to the socket
+	socketHandle = -1; // connected in start(), unless the verdict is cached
 }
 
 Adapter::Xaction::~Xaction() {
@@ -273,30 +307,37 @@ Adapter::Xaction::~Xaction() {
 		x->adaptationAborted();
 	}
 
-	//Close the socket
-	close(socketHandle);
+	//Make sure the event loop lets go of the socket first
+	if (exchange) {
+		service->loop.cancel(exchange);
+		exchange->client = 0;
+	}
+	//Close the socket, or keep it for the next transaction
+	service->release(backend, socketHandle, protocolVersion, protocolFeatures, exchangeDone, channel, stream);
 	if(debug) {
 		logFile << logStart <<  "REQMOD Xaction::~Xaction" << std::endl;
 		logFile << logStart <<  "=================================================" << std::endl;
-		logFile.close();
 	}
 }
 
-const libecap::Area Adapter::Xaction::option(const libecap::Name &) const {
-	return libecap::Area(); // no option/meta information
+// The correlation ID, which Squid hands on to the RESPMOD transaction when
+// correlation_option is one of its adaptation_masterx_shared_names
+const libecap::Area Adapter::Xaction::option(const libecap::Name &name) const {
+	if (correlationId.empty() || name.image() != service->correlation_option) {
+		return libecap::Area();
+	}
+	return libecap::Area::FromTempString(correlationId);
 }
 
-void Adapter::Xaction::visitEachOption(libecap::NamedValueVisitor &) const {
-	// negatory on the meta-information
+void Adapter::Xaction::visitEachOption(libecap::NamedValueVisitor &visitor) const {
+	if (!correlationId.empty()) {
+		visitor.visit(libecap::Name(service->correlation_option), libecap::Area::FromTempString(correlationId));
+	}
 }
 
 void Adapter::Xaction::start() {
 	Must(hostx);
-	int s;
-	size_t t;
-	char buf[BUF_SIZE];
-	char c;
-	std::string modifiedHeader;
+	ssize_t s;
 	//This adapter will only ever receive REQMOD requests (yay for configuration options)
 	//Dump the request headers over to ecapguardian
 	//(Request headers will ALWAYS exist - the request body might not)
@@ -316,221 +357,151 @@ void Adapter::Xaction::start() {
 				i: Read in modified headers and use them instead of the original
 				ii: Just re-use the pointer for the request body - ecapguardian doesn't check request bodies
 	*/
-	//The below 'hostx->virgin()' is a Message
-	if (hostx->virgin().body()) {
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : has VB" << std::endl;
+	//A request that recently got a 'v' needs no trip to ecapguardian
+	if (service->verdictCache.enabled()) {
+		cacheKey = service->verdictCacheKey(hostx->virgin());
+		if (service->verdictCache.lookup(cacheKey)) {
+			if(debug) {
+				logFile << logStart <<  "REQMOD Xaction::start : cached 'v' verdict" << std::endl;
+			}
+			receivingVb = opNever;
+			sendingAb = opNever;
+			lastHostCall()->useVirgin();
+			return;
 		}
-		receivingVb = opOn;
-		sendingAb = opWaiting;
-		hostx->vbMake(); // tell the host to give us the virgin request body
-	} else {
-		// no virgin body?  Don't need it
+	}
+
+	//While every ecapguardian is down, don't wait on them for every request
+	backend = service->pickBackend(*hostx);
+	if (!backend) {
+		service->metrics.breakerRejected.fetch_add(1, std::memory_order_relaxed);
 		receivingVb = opNever;
-		sendingAb = opWaiting;
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : no VB" << std::endl;
+		if (fallBack(service->breaker_action, "The content filter is not available.")) {
+			return;
 		}
+		throw libecap::TextException(service->runErrorPrefix + "ecapguardian is unavailable, the circuit breakers are open");
+	}
+
+	//Get the Unix Domain Socket connection - a pooled one if there is one idle
+	//from the backend picked above, or the next one that can be reached
+	try {
+		socketHandle = service->checkout(backend, protocolVersion, protocolFeatures, channel, stream);
+	} catch (const Timeout &timeout) {
+		if (timedOut(timeout)) {
+			return;
+		}
+		throw;
+	}
+	if(debug) {
+		logFile << logStart <<  "REQMOD Xaction::start : eCAP Adapter socket path: '" << backend->socketPath << "'" << std::endl;
+	}
+	//If you got here, you're ready to start writing to the socket
+
+	//The below 'hostx->virgin()' is a Message
+	//The request body is only asked for once an 'm' verdict needs it: after
+	//a 'v' the host must still have all of it for useVirgin()
+	sendingAb = opWaiting;
+	if(debug) {
+		logFile << logStart <<  "REQMOD Xaction::start : " << (hostx->virgin().body() ? "has VB" : "no VB") << std::endl;
 	}
 
 	//Make a clone of the request message (in case we need to modify it)
-	libecap::shared_ptr<libecap::Message> adapted = hostx->virgin().clone();
+	adapted = hostx->virgin().clone();
 	Must(adapted != 0);
 	//Dump the request header over to ecapguardian
-	//ssize_t write(int fd, const void *buf, size_t count);
-	s = write(socketHandle, adapted->header().image().start, adapted->header().image().size);
+	//v1: on a pooled connection it is preceded by the transaction reset flag
+	//v2: it is preceded by its frame header, which may offer block page templates,
+	//and with FEATURE_CORRELATION by the ID that RESPMOD will refer to it by
+	const libecap::Area header = adapted->header().image();
+	const bool templates = protocolVersion == PROTOCOL_V2 && service->blockPages.enabled();
+	const std::string frame = FrameHeader(FRAME_HEADER, header.size, templates ? FRAME_FLAG_BLOCK_TEMPLATES : 0, stream);
+	if (protocolFeatures & FEATURE_CORRELATION) {
+		correlationId = service->newCorrelationId();
+	}
+	const std::string correlationFrame = FrameHeader(FRAME_CORRELATION, correlationId.size(), 0, stream);
+	struct iovec iov[4];
+	int iovcnt = 0;
+	if (!correlationId.empty()) {
+		iov[iovcnt].iov_base = const_cast<char*>(correlationFrame.data());
+		iov[iovcnt++].iov_len = correlationFrame.size();
+		iov[iovcnt].iov_base = const_cast<char*>(correlationId.data());
+		iov[iovcnt++].iov_len = correlationId.size();
+	}
+	if (protocolVersion == PROTOCOL_V2) {
+		iov[iovcnt].iov_base = const_cast<char*>(frame.data());
+		iov[iovcnt++].iov_len = frame.size();
+	} else if (backend->pool.pooled()) {
+		iov[iovcnt].iov_base = const_cast<char*>(&ConnectionPool::FLAG_XACTION_RESET);
+		iov[iovcnt++].iov_len = 1;
+	}
+	iov[iovcnt].iov_base = const_cast<char*>(header.start);
+	iov[iovcnt++].iov_len = header.size;
+	const size_t expected = IovSize(iov, iovcnt);
+	headerSentAt = MonotonicMicros();
+	//On a shared connection the event loop writes it, between the frames of other streams
+	s = channel ? 0 : writev(socketHandle, iov, iovcnt);
+	if (s > 0) {
+		service->metrics.bytesSent.fetch_add(s, std::memory_order_relaxed);
+	}
 	if(debug) {
         	logFile << logStart <<  "REQMOD Xaction::start : Original Request Header:" << std::endl
-        	    << adapted->header().image().toString().c_str() << std::endl;
+        	    << header.toString().c_str() << std::endl;
+	}
+	if(s == -1 && service->async_verdicts && (errno == EAGAIN || errno == EWOULDBLOCK)){
+		s = 0; // the socket is non-blocking; the event loop writes the rest
 	}
         if(s == -1){
 		if(debug) {
 			logFile << logStart <<  "REQMOD Xaction::start : errno on header write. errno:" << strerror(errno) << std::endl;
 		}
-		//There was some sort of error
-		//We can recover from one of these types of errors
-		if(errno){
-			//Not recoverable
-			throw libecap::TextException(RunErrorPrefix + "Failed to write header to ecapguardian. errno: " + strerror(errno));
+		if (service->async_verdicts) {
+			//Not recoverable (a blocking write is checked below, it may have timed out)
+			service->checkWritten(*backend, s, expected, "REQMOD header");
 		}
 	}
-	if(s != adapted->header().image().size){
-		throw libecap::TextException(RunErrorPrefix + "Failed to write REQMOD headers to ecapguardian. Wrote " + std::to_string(s) 
-			+ " instead of " + std::to_string(adapted->header().image().size));
-	}
         //The two nulls at the end are no longer necessary
         //The ecapguardian system knows to stop reading the header at double newlines
 
-	if(debug) {
-		logFile << logStart <<  "REQMOD Xaction::start : Dumped endHeader signal" << std::endl;
-	}
-	//Make a BLOCKING read call, so that this adapter does not proceed
-	//until the request is fulfilled
-	s = read(socketHandle, buf, 1);
-	if(debug) {
-		logFile << logStart <<  "REQMOD Xaction::start : After receiving response char, s=" << s << std::endl;
-	}
-    	if(s != 1){
-		throw libecap::TextException("After response char, s was " + std::to_string(s));
-		exit(-1);
-    	}
-	if(debug) {
-		logFile << logStart <<  "REQMOD Xaction::start : About to do char comparisons" << std::endl;
-	}
-	c = buf[0];
-	if(debug) {
-		logFile << logStart <<  "REQMOD Xaction::start : Got char: " << c << std::endl;
-	}
-	if(c == FLAG_USE_VIRGIN){
-		//Tell the host to use the virgin request and move on with your life
-		blocked = false;
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : read 'v' from ecapguardian" << std::endl;
-		}
-		lastHostCall()->useVirgin();
-		return;
-	} else if(c == FLAG_MODIFY){
-		//Tell the host to use the modified request (modified header, anyway)
-		blocked = false;
-		libecap::Area headers;
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : read 'm' from ecapguardian" << std::endl;
-		}
-		//ecapguardian has modified the request
-		//Read in the modified request header, and tell the host to use the adapted message
-		//Don't lose track of the response body!
-		do {
-			if(debug) {
-				logFile << logStart <<  "REQMOD Xaction::start : Header Input Do loop" << std::endl;
-			}
-			s = read(socketHandle, buf, BUF_SIZE);
-			if(debug) {
-				logFile << logStart <<  "REQMOD Xaction::start : Read " << s << " header bytes." << std::endl;
-	                        logFile << logStart <<  "REQMOD Xaction::start : Read char: " << buf[0] << std::endl;
-			}
-			modifiedHeader.append(buf, s);
-			if(modifiedHeader.rfind(FLAG_END) != std::string::npos){
-				if(debug) {
-					logFile << logStart <<  "REQMOD Xaction::start : End Header signal received - removing it from the header" << std::endl;
-				}
-				//Rip out the last three chars: \n\0\0
-				t = modifiedHeader.rfind(FLAG_END_REMOVE);
-				if(t != std::string::npos){
-					modifiedHeader.replace(t, FLAG_END_REMOVE.length(), "");
-				}
-				s = 0;
-			}
-		} while(s > 0);
-                s = write(socketHandle, &FLAG_MSG_RECVD, 1);
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : Header read in: " << std::endl << modifiedHeader.c_str() << std::endl;
+	if (service->async_verdicts) {
+		//Do not block the host: the event loop thread finishes the write, waits
+		//for the verdict, and Service::resume() brings us back to applyReply()
+		exchange.reset(new AsyncExchange(socketHandle, Reply::rkReqmod, protocolVersion, channel, stream));
+		exchange->client = this;
+		exchange->metrics = &service->metrics;
+		exchange->reply.maxSize = service->max_reply_size;
+		exchange->reply.acks = ServiceCore::Acks(protocolFeatures);
+		if (templates) {
+			exchange->reply.blockPages = &service->blockPages;
 		}
-		headers = libecap::Area::FromTempString(modifiedHeader);
+		exchange->queue(IovTail(iov, iovcnt, s));
 		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : Header Area created" << std::endl;
+			logFile << logStart <<  "REQMOD Xaction::start : waiting for the verdict asynchronously" << std::endl;
 		}
-		adapted->header().parse(headers);
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : Header parsed in" << std::endl;
-		}
-		hostx->useAdapted(adapted);
+		service->loop.add(exchange);
 		return;
-	} else if(c == FLAG_BLOCK){
-		libecap::shared_ptr<libecap::Message> ptr;
-		libecap::Area headers;
-		libecap::Area responseBody;
-		blocked = true;
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : read 'b' from ecapguardian" << std::endl;
-		}
-		//Only one other possibility here - a blocked request
-		//modifiedHeader
-		//Now, read back the block page headers
-		do {
-			if(debug) {
-				logFile << logStart <<  "REQMOD Xaction::start : Header Input Do loop" << std::endl;
-			}
-			s = read(socketHandle, buf, BUF_SIZE);
-			if(debug) {
-				logFile << logStart <<  "REQMOD Xaction::start : Read " << s << " header bytes." <<std::endl;
-			}
-			modifiedHeader.append(buf, s);
-			if(modifiedHeader.rfind(FLAG_END) != std::string::npos){
-				if(debug) {
-					logFile << logStart <<  "REQMOD Xaction::start : End Header signal received - removing it from the header" << std::endl;
-				}
-				//Rip out the last three chars: \n\0\0
-				t = modifiedHeader.rfind(FLAG_END_REMOVE);
-				if(t != std::string::npos){
-					modifiedHeader.replace(t, FLAG_END_REMOVE.length(), "");
-				}
-				s = 0;
-			}
-		} while(s > 0);
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : Header read in: " << std::endl << modifiedHeader.c_str() << std::endl;
-		}
-		//Next, send the 'headers received' signal to the server
-		s = write(socketHandle, &FLAG_MSG_RECVD, 1);
-		//Now, read in the block page
-		do {
-			if(debug) {
-				logFile << logStart <<  "REQMOD Xaction::start : Blockpage Do Loop" << std::endl;
-			}
-			s = read(socketHandle, buf, BUF_SIZE);
-			if(debug) {
-				logFile << logStart <<  "REQMOD Xaction::start : Read " << s << " blockpage bytes" << std::endl;
-			}
-			e2buffer.append(buf, s);
-			if(e2buffer.rfind(FLAG_END) != std::string::npos){
-				if(debug) {
-					logFile << logStart <<  "REQMOD Xaction::start : End Body signal received - removing it from the body" << std::endl;
-				}
-				//Rip out the last three chars of the flag
-				t = e2buffer.rfind(FLAG_END_REMOVE);
-				if(t != std::string::npos){
-					e2buffer.replace(t, FLAG_END_REMOVE.length(), "");
-				}
-				s = 0;
-			}
-		} while(s > 0);
+	}
 
-		//Now, send the 'block page received' signal
-		//The server will close the connection, and we close our end in the destructor
-		s = write(socketHandle, &FLAG_MSG_RECVD, 1);
-		//Now the funky part - make adapted headers and tell host to use adapted
-		//This "libecap::MyHost().newResponse();" is found in registry.h
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : Sent MSG_RECVD flag" << std::endl;
-		}
-		ptr = libecap::MyHost().newResponse();
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : Made new response message" << std::endl;
-		}
-		headers = libecap::Area::FromTempString(modifiedHeader);
+	//Make a BLOCKING read, so that this adapter does not proceed
+	//until the request is fulfilled
+	Reply reply(Reply::rkReqmod, protocolVersion);
+	reply.maxSize = service->max_reply_size;
+	reply.acks = ServiceCore::Acks(protocolFeatures);
+	if (templates) {
+		reply.blockPages = &service->blockPages;
+	}
+	try {
+		service->checkWritten(*backend, s, expected, "REQMOD header");
 		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : Made Headers 'Area'" << std::endl;
+			logFile << logStart <<  "REQMOD Xaction::start : Dumped endHeader signal" << std::endl;
 		}
-		ptr->header().parse(headers);
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : Parsed headers into request satisfaction message" << std::endl;
+		readReply(reply);
+	} catch (const Timeout &timeout) {
+		if (timedOut(timeout)) {
+			return;
 		}
-		ptr->addBody();  // This is just a flag saying that the message has a body.
-				// The body is pulled via abMake() and abContent()
-		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::start : Added body flag to request satisfaction message" << std::endl;
-		}
-		//Need to use the correct message pointer - duh
-		hostx->useAdapted(ptr);
-		//I think the boolean parameter here tells the host whether they've
-		//pulled in all of the AB content yet.  In this case, the AB is done -
-		//But they're not at the end of the buffer yet.
-		hostx->noteAbContentDone(false);
-		return;
-	} else{
-		//What's this?
-		throw libecap::TextException(RunErrorPrefix + "ecapguardian returned '" + buf[0] + "' which is not in the supported option set ('v','m','b')");
+		throw;
 	}
+	applyReply(reply);
 	/*
 		This is where everything happens in the REQMOD adapter.
 		0: This adapter sends a 'q' to ecapguardian (signaling re'q'mod)
@@ -592,6 +563,167 @@ void Adapter::Xaction::start() {
 	*/
 }
 
+// Blocking read of the whole ecapguardian reply, acknowledging the
+// header and body parts as ecapguardian expects
+void Adapter::Xaction::readReply(Reply &reply) {
+	const bool acksSent = service->readReply(*backend, socketHandle, reply, debug ? &logFile : 0);
+	// The server will close the connection (or wait for the next transaction
+	// reset on a pooled one), and we close or release our end in the destructor
+	exchangeDone = acksSent && reply.clean();
+}
+
+// Acts on the verdict: use the virgin request, the modified request header,
+// or satisfy the request with the block page
+void Adapter::Xaction::applyReply(Reply &reply) {
+	const char c = reply.verdict;
+	if(debug) {
+		logFile << logStart <<  "REQMOD Xaction::applyReply : Got char: " << c << std::endl;
+	}
+	service->noteRoundTrip(*backend, MonotonicMicros() - headerSentAt);
+	service->metrics.verdict(reply.uncacheable ? Reply::FLAG_USE_VIRGIN_UNCACHEABLE : c);
+	receivingVb = opNever; // but for an 'm' on a request with a body
+	if(c == FLAG_USE_VIRGIN){
+		//Tell the host to use the virgin request and move on with your life
+		blocked = false;
+		if(debug) {
+			logFile << logStart <<  "REQMOD Xaction::applyReply : read 'v' from ecapguardian" << std::endl;
+		}
+		if (!cacheKey.empty() && !reply.uncacheable) {
+			service->verdictCache.insert(cacheKey);
+		}
+		lastHostCall()->useVirgin();
+		return;
+	} else if(c == FLAG_MODIFY){
+		//Tell the host to use the modified request (modified header, anyway)
+		//Don't lose track of the request body!
+		blocked = false;
+		if(debug) {
+			logFile << logStart <<  "REQMOD Xaction::applyReply : read 'm' from ecapguardian" << std::endl;
+			logFile << logStart <<  "REQMOD Xaction::applyReply : Header read in: " << std::endl << reply.header.c_str() << std::endl;
+		}
+		adapted->header().parse(libecap::Area::FromTempString(reply.header));
+		if(debug) {
+			logFile << logStart <<  "REQMOD Xaction::applyReply : Header parsed in" << std::endl;
+		}
+		if (adapted->body()) {
+			//The body goes along with the modified header, straight from the
+			//host's buffer: abContent() hands out what vbContent() has
+			receivingVb = opOn;
+			hostx->vbMake();
+		}
+		hostx->useAdapted(adapted);
+		return;
+	}
+
+	libecap::shared_ptr<libecap::Message> ptr;
+	if(c == Reply::FLAG_BLOCK_TEMPLATE){
+		//A block page made from a template, cached or just sent along
+		blocked = true;
+		BlockPagePointer page = reply.blockPage;
+		if (!page) {
+			page.reset(new BlockPage(reply.header, reply.body));
+			service->blockPages.insert(BlockPage::Id(reply.blockTemplate), page);
+		}
+		if(debug) {
+			logFile << logStart <<  "REQMOD Xaction::applyReply : read 't' from ecapguardian, template '" <<
+				BlockPage::Id(reply.blockTemplate) << "'" << (reply.blockPage ? " (cached)" : "") << std::endl;
+		}
+		ptr = page->render(reply.blockTemplate, e2buffer);
+		hostx->useAdapted(ptr);
+		hostx->noteAbContentDone(false);
+		return;
+	}
+
+	//Only one other possibility here - a blocked request (the reply parser accepts nothing else)
+	Must(c == FLAG_BLOCK);
+	if(debug) {
+		logFile << logStart <<  "REQMOD Xaction::applyReply : read 'b' from ecapguardian" << std::endl;
+		logFile << logStart <<  "REQMOD Xaction::applyReply : Header read in: " << std::endl << reply.header.c_str() << std::endl;
+	}
+	useBlockPage(reply.header, reply.body);
+}
+
+// Satisfies the request with a block page, ecapguardian's or our own
+void Adapter::Xaction::useBlockPage(const std::string &header, std::string &body) {
+	blocked = true;
+	e2buffer.adopt(body);
+	libecap::shared_ptr<libecap::Message> ptr;
+	//Now the funky part - make adapted headers and tell host to use adapted
+	//This "libecap::MyHost().newResponse();" is found in registry.h
+	ptr = libecap::MyHost().newResponse();
+	if(debug) {
+		logFile << logStart <<  "REQMOD Xaction::useBlockPage : Made new response message" << std::endl;
+	}
+	ptr->header().parse(libecap::Area::FromTempString(header));
+	if(debug) {
+		logFile << logStart <<  "REQMOD Xaction::useBlockPage : Parsed headers into request satisfaction message" << std::endl;
+	}
+	ptr->addBody();  // This is just a flag saying that the message has a body.
+			// The body is pulled via abMake() and abContent()
+	//Need to use the correct message pointer - duh
+	hostx->useAdapted(ptr);
+	//I think the boolean parameter here tells the host whether they've
+	//pulled in all of the AB content yet.  In this case, the AB is done -
+	//But they're not at the end of the buffer yet.
+	hostx->noteAbContentDone(false);
+}
+
+// ecapguardian made no progress for one of the *_timeout options. Returns
+// false if timeout_action=error, and the transaction is to fail.
+bool Adapter::Xaction::timedOut(const Timeout &timeout) {
+	service->noteTimeout(timeout, logFile.id());
+	exchangeDone = false; // cut short
+	if (exchange) {
+		service->loop.cancel(exchange);
+	}
+	return fallBack(service->timeout_action, "The content filter did not answer in time.");
+}
+
+// Answers without a verdict from ecapguardian. Returns false for faError.
+bool Adapter::Xaction::fallBack(ServiceCore::FallbackAction action, const std::string &reason) {
+	if (action == ServiceCore::faBypass) {
+		lastHostCall()->useVirgin();
+		return true;
+	}
+	if (action == ServiceCore::faBlock) {
+		receivingVb = opNever; // there was no verdict to ask for it
+		std::string header;
+		std::string body;
+		ForbiddenPage(reason, header, body);
+		useBlockPage(header, body);
+		return true;
+	}
+	return false;
+}
+
+// Called from Service::resume() when the event loop has the whole verdict
+void Adapter::Xaction::noteExchangeReady() {
+	if(debug) {
+		logFile << logStart <<  "REQMOD Xaction::noteExchangeReady" << std::endl;
+	}
+	if (!hostx) {
+		return; // stopped meanwhile
+	}
+	try {
+		try {
+			service->checkExchange(*backend, *exchange);
+		} catch (const Timeout &timeout) {
+			if (timedOut(timeout)) {
+				return;
+			}
+			throw;
+		}
+		exchangeDone = exchange->reply.clean();
+		applyReply(exchange->reply);
+	} catch (const std::exception &e) {
+		// there is no host call on the stack to catch this, so abort the transaction here
+		service->logger.log(Logger::llError, logFile.id(), std::string("REQMOD Xaction::noteExchangeReady : ") + e.what());
+		if (hostx) {
+			lastHostCall()->adaptationAborted();
+		}
+	}
+}
+
 void Adapter::Xaction::stop() {
 	hostx = 0;
 	// the caller will delete
@@ -605,7 +737,7 @@ void Adapter::Xaction::abDiscard()
 	if(debug) {
 		logFile << logStart <<  "REQMOD Xaction::abDiscard" << std::endl;
 	}
-	Must(sendingAb == opUndecided); // have not started yet
+	Must(sendingAb == opUndecided || sendingAb == opWaiting); // have not started yet
 	sendingAb = opNever;
 	// we do not need more vb if the host is not interested in ab
 	stopVb();
@@ -629,13 +761,16 @@ void Adapter::Xaction::abMake()
 	Must(hostx->virgin().body()); // that is our only source of ab content
 	// we are or were receiving vb
 	Must(receivingVb == opOn || receivingVb == opComplete);
-	if (receivingVb == opComplete){
-		sendingAb = opOn;
+	sendingAb = opOn;
+	if (hostx->vbContent(0, libecap::nsize).size) {
 		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::abMake : buffer not empty" << std::endl;
+			logFile << logStart <<  "REQMOD Xaction::abMake : virgin body content waiting" << std::endl;
 		}
 		hostx->noteAbContentAvailable();
 	}
+	if (vbProduced) {
+		hostx->noteAbContentDone(vbAtEnd);
+	}
 }
 
 void Adapter::Xaction::abMakeMore()
@@ -643,8 +778,8 @@ void Adapter::Xaction::abMakeMore()
 	if(debug) {
 		logFile << logStart <<  "REQMOD Xaction::abMakeMore" << std::endl;
 	}
-	Must(receivingVb == opOn); // a precondition for receiving more vb
-	if(!blocked){
+	//The block page is all there, and so is a virgin body the host finished
+	if (!blocked && receivingVb == opOn && !vbProduced) {
 		hostx->vbMakeMore();
 	}
 }
@@ -662,23 +797,23 @@ void Adapter::Xaction::abStopMaking()
 
 libecap::Area Adapter::Xaction::abContent(size_type offset, size_type size) {
 	Must(sendingAb == opOn || sendingAb == opComplete);
-	std::string contentBuffer;
+	libecap::Area content;
 	if(debug) {
 		logFile << logStart <<  "REQMOD Xaction::abContent : offset=" << offset << ", size=" << size << std::endl;
 	}
 	if(blocked){
-		contentBuffer = e2buffer.substr(offset, size);
+		content = e2buffer.content(offset, size);
 		if(debug) {
 			logFile << logStart <<  "REQMOD Xaction::abContent : request blocked"  << std::endl;
 		}
 	} else{
-		contentBuffer = buffer.substr(offset, size);
+		content = hostx->vbContent(offset, size);
 		if(debug) {
 			logFile << logStart <<  "REQMOD Xaction::abContent virgin request body : " << std::endl
-				<< contentBuffer << std::endl;
+				<< content << std::endl;
 		}
 	}
-	return libecap::Area::FromTempString(contentBuffer);
+	return content; // the store's chunk or the host's own buffer, no copy
 }
 
 void Adapter::Xaction::abContentShift(size_type size) {
@@ -691,12 +826,15 @@ void Adapter::Xaction::abContentShift(size_type size) {
 		if(debug) {
 			logFile << logStart <<  "REQMOD Xaction::abContentShift, erasing 'size' from blockpage buffer" << std::endl;
 		}
-		e2buffer.erase(0, size);
+		e2buffer.shift(size);
 	} else{
 		if(debug) {
-			logFile << logStart <<  "REQMOD Xaction::abContentShift, erasing 'size' from virgin body buffer" << std::endl;
+			logFile << logStart <<  "REQMOD Xaction::abContentShift, the host may drop 'size' of the virgin body" << std::endl;
+		}
+		hostx->vbContentShift(size);
+		if (vbProduced && !hostx->vbContent(0, libecap::nsize).size) {
+			stopVb(); // all of it passed on
 		}
-		buffer.erase(0, size);
 	}
 }
 
@@ -706,7 +844,9 @@ void Adapter::Xaction::noteVbContentDone(bool atEnd)
 		logFile << logStart <<  "REQMOD Xaction::noteVbContentDone : atEnd=" << atEnd << std::endl;
 	}
 	Must(receivingVb == opOn);
-	stopVb();
+	vbAtEnd = atEnd;
+	vbProduced = true;
+	//No vbStopMaking() yet: the host keeps what abContent() has not passed on
 	if (sendingAb == opOn) {
 		hostx->noteAbContentDone(atEnd);
 	}
@@ -718,11 +858,7 @@ void Adapter::Xaction::noteVbContentAvailable()
 	if(debug) {
 		logFile << logStart <<  "REQMOD Xaction::noteVbContentAvailable" << std::endl;
 	}
-	const libecap::Area vb = hostx->vbContent(0, libecap::nsize); // grabs as much VB content as is available
-	std::string chunk = vb.toString(); // API says this is expensive - but it's necessary
-	hostx->vbContentShift(vb.size); // 'shift' means 'delete' since we have a copy
-	buffer += chunk; // don't just throw away what we got
-
+	//Nothing is copied: the content stays with the host until abContentShift()
 	if (sendingAb == opOn){
 		if(debug) {
 			logFile << logStart <<  "REQMOD Xaction::noteVbContentAvailable : noting abContentAvailable" <<std::endl;
@@ -741,7 +877,7 @@ void Adapter::Xaction::stopVb() {
 		hostx->vbStopMaking();
 		receivingVb = opComplete;
 	} else {
-		// already have the whole VB, or never needed it anyway
+		// passed the whole VB on already, or never needed it anyway
 		Must(receivingVb != opUndecided);
 	}
 }
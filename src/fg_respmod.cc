@@ -10,7 +10,6 @@
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <sys/un.h>
@@ -18,9 +17,13 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <utility>
+#include <vector>
 
 #include <libecap/common/registry.h>
 #include <libecap/common/errors.h>
@@ -33,18 +36,29 @@
 #include <libecap/adapter/xaction.h>
 #include <libecap/host/xaction.h>
 
+#include "fg_body_store.h"
+#include "fg_config.h"
+#include "fg_connection_pool.h"
+#include "fg_event_loop.h"
+#include "fg_logger.h"
+#include "fg_metrics.h"
+#include "fg_protocol.h"
+#include "fg_reply.h"
+#include "fg_scope.h"
+#include "fg_service_core.h"
+
 namespace Adapter {
 
 using libecap::size_type;
 
-std::ostream& logStart(std::ostream& output) {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return output << getpid() << "," << tv.tv_sec << "." << tv.tv_usec << ",";
-}
+// Local to this file, so that the combined plugin can carry the REQMOD and
+// the RESPMOD Service and Xaction classes side by side
+namespace {
 
-class Service: public libecap::adapter::Service {
+class Service: public libecap::adapter::Service, public ServiceCore {
 	public:
+		Service(): ServiceCore("RESPMOD") {}
+
 		// About
 		virtual std::string uri() const; // unique across all vendors
 		virtual std::string tag() const; // changes with version and config
@@ -66,26 +80,36 @@ class Service: public libecap::adapter::Service {
 		// Work
 		virtual MadeXactionPointer makeXaction(libecap::host::Xaction *hostx);
 
-		std::string ecapguardian_listen_socket;
-		bool debug = false;
-	protected:
-		void set_listen_socket(const std::string &value);
-};
-
-
-// Calls Service::setOne() for each host-provided configuration option.
-// See Service::configure().
-class Cfgtor: public libecap::NamedValueVisitor {
-	public:
-		Cfgtor(Service &aSvc): svc(aSvc) {}
-		virtual void visit(const libecap::Name &name, const libecap::Area &value) {
-			svc.setOne(name, value);
-		}
-		Service &svc;
+		// Asynchronous transactions (async_verdicts)
+		virtual bool makesAsyncXactions() const;
+		virtual void suspend(timeval &timeout); // host is going to sleep
+		virtual void resume(); // host woke up; hand it finished exchanges
+
+		// with async_verdicts the event loop streams the bodies too
+		size_type async_write_queue = 256*1024; // bytes queued per transaction
+
+		// pass the virgin body on to the client while ecapguardian scans
+		// it, holding back the last stream_hold_back bytes until the verdict
+		bool stream_bodies = false;
+		size_type stream_hold_back = 64*1024;
+		AffixTrie stream_content_types; // prefixes; empty means all
+		bool streams(const libecap::Message &response) const;
+
+		// responses passed on without asking ecapguardian at all
+		AffixTrie skip_content_types; // prefixes
+		size_type skip_content_length_over = 0; // 0: no limit
+		bool skips(const libecap::Message &response) const;
+
+		// body size limits (0: none); past them oversize_action applies
+		size_type max_scan_bytes = 0; // body bytes sent to ecapguardian
+		size_type max_buffer_bytes = 0; // body bytes kept by the adapter
+		typedef enum { oaScanPrefix, oaPass, oaBlock } OversizeAction;
+		OversizeAction oversize_action = oaScanPrefix;
+		size_type scanLimit(bool streaming) const;
 };
 
 
-class Xaction: public libecap::adapter::Xaction {
+class Xaction: public libecap::adapter::Xaction, public AsyncClient {
 	public:
 		Xaction(libecap::shared_ptr<Service> s, libecap::host::Xaction *x);
 		virtual ~Xaction();
@@ -111,23 +135,58 @@ class Xaction: public libecap::adapter::Xaction {
 		// virgin body state notification
 		virtual void noteVbContentDone(bool atEnd);
 		virtual void noteVbContentAvailable();
+
+		// event loop notifications (async_verdicts)
+		virtual void noteExchangeReady();
+		virtual void noteExchangeDrained();
 	protected:
+		void readReply(Reply &reply); // blocking
+		void applyHeadersReply(Reply &reply);
+		void applyBodyReply(Reply &reply);
+		void pumpVb(); // hands vb to the event loop
+		void releaseVb(); // streaming: lets the host have the vb not held back
+		void passVb(); // after the verdict: moves vb and ab along
+		bool overLimit(); // scanned all we may and there is more vb
+		void oversize(); // applies oversize_action
+		void giveUpScan(bool block, const std::string &reason); // no body verdict coming
+		bool timedOut(const Timeout &timeout); // applies timeout_action
+		bool fallBack(ServiceCore::FallbackAction action, const std::string &reason);
+		void useBlockPage(const std::string &reason);
+		size_type released() const; // how much of buffer the host may have
 		void adaptContent(std::string &chunk) const; // converts vb to ab
 		void stopVb(); // stops receiving vb (if we are receiving it)
 		libecap::host::Xaction *lastHostCall(); // clears hostx
-
-		void checkWritten(ssize_t sent, size_type expectedSent, std::string name);
 	private:
 		size_type readTo = 0;
 		libecap::shared_ptr<libecap::Message> sharedPointerToVirginHeaders;
-		std::string buffer; // for content adaptation
+		BodyStore buffer; // for content adaptation
 		std::string previousChunk;
-		std::ofstream logFile;
+		TraceStream logFile; // debug trace lines, tagged with the transaction ID
 
 		libecap::shared_ptr<const Service> service; // configuration access
 		libecap::host::Xaction *hostx; // Host transaction rep
 
+		Balancer::Pointer backend; // the ecapguardian socketHandle connects to
 		int socketHandle;  // the ecapguardian eCAP listener
+		bool exchangeDone = false; // the socket can go back to the pool
+		int protocolVersion = PROTOCOL_V1; // as negotiated for socketHandle
+		uint32_t protocolFeatures = 0; // ditto
+		ChannelPointer channel; // multiplex: socketHandle is shared, only the event loop writes
+		uint32_t stream = 0; // ours on channel
+		std::string causeFallback; // correlated: the cause header frame, should ecapguardian ask for it
+		ExchangePointer exchange; // socket work handed to the event loop
+		bool waitingForDrain = false; // the event loop has enough queued
+		bool vbDone = false; // the host has no more vb to give
+		bool bodyReplyReady = false; // the event loop has the body verdict
+		bool streaming = false; // stream_bodies applies to this response
+		bool committed = false; // streaming: useAdapted() before the verdict
+		bool verdictKnown = false; // the body verdict is in
+		size_type scanLimit = 0; // vb bytes ecapguardian may get, 0: all
+		size_type scanned = 0; // vb bytes ecapguardian got
+		bool scanCut = false; // ecapguardian gets no more vb
+		bool prefixHint = false; // ecapguardian only wants the first scanLimit bytes
+		uint64_t headerSentAt = 0; // MonotonicMicros() when the headers went out
+		uint64_t bodyWantedAt = 0; // MonotonicMicros() when vb was asked for
 
 		typedef enum { opUndecided, opOn, opComplete, opNever } OperationState;
 		OperationState receivingVb;
@@ -135,24 +194,46 @@ class Xaction: public libecap::adapter::Xaction {
 
 		bool debug = false;
 		////  Flags and such for communication with server
-                const int BUF_SIZE = 1024;
-                const char FLAG_USE_VIRGIN = 'v';
-                const char FLAG_MODIFY = 'm';
-                const char FLAG_NEEDS_SCAN = 's';
-		const char FLAG_BLOCK = 'b';
-                const char FLAG_MSG_RECVD = 'r'; // used to signal header/body received to the server
-                const std::string FLAG_END = "\n\n\0\0"; //used for headers/body end
-                const std::string FLAG_END_REMOVE = "\0\0"; //Remove this from the end of the headers/body
+		////  (the headers/body end marker is handled by Reply)
+		const char FLAG_USE_VIRGIN = Reply::FLAG_USE_VIRGIN;
+		const char FLAG_MODIFY = Reply::FLAG_MODIFY;
+		const char FLAG_NEEDS_SCAN = Reply::FLAG_NEEDS_SCAN;
 };
 
+} // namespace
+
 static const std::string PACKAGE_NAME = "FilterGizmo RESPMOD ecapguardian";
 
 static const std::string PACKAGE_VERSION = "0.1.0";
 
-static const std::string CfgErrorPrefix =
-	"FilterGizmo RESPMOD Adapter: configuration error: ";
+// The lowercase Content-Type of the message, empty if there is none
+static std::string ContentType(const libecap::Message &message) {
+	static const libecap::Name headerContentType("Content-Type");
+	if (!message.header().hasAny(headerContentType)) {
+		return std::string();
+	}
+	std::string type = message.header().value(headerContentType).toString();
+	std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+	return type;
+}
+
+static void AddAll(AffixTrie &trie, const std::vector<std::string> &items) {
+	for (std::vector<std::string>::const_iterator i = items.begin(); i != items.end(); ++i) {
+		trie.add(*i);
+	}
+}
 
-static const std::string RunErrorPrefix = "FilterGizmo RESPMOD Adapter: Runtime Error: ";
+// The Content-Length of the message, if it has a usable one
+static bool ContentLength(const libecap::Message &message, size_type &length) {
+	if (!message.header().hasAny(libecap::headerContentLength)) {
+		return false;
+	}
+	const std::string value = message.header().value(libecap::headerContentLength).toString();
+	char *end = 0;
+	errno = 0;
+	length = strtoull(value.c_str(), &end, 10);
+	return !value.empty() && value[0] != '-' && !errno && *end == '\0';
+}
 
 } // namespace Adapter
 
@@ -169,56 +250,83 @@ void Adapter::Service::describe(std::ostream &os) const {
 }
 
 void Adapter::Service::configure(const libecap::Options &cfg) {
-	Cfgtor cfgtor(*this);
+	Cfgtor<Service> cfgtor(*this);
 	cfg.visitEachOption(cfgtor);
 
 	// check for post-configuration errors and inconsistencies
+	applyOptions();
 }
 
 void Adapter::Service::reconfigure(const libecap::Options &cfg) {
-	ecapguardian_listen_socket.clear();
+	resetOptions();
+	async_write_queue = 256*1024;
+	stream_bodies = false;
+	stream_hold_back = 64*1024;
+	stream_content_types.clear();
+	skip_content_types.clear();
+	skip_content_length_over = 0;
+	max_scan_bytes = 0;
+	max_buffer_bytes = 0;
+	oversize_action = oaScanPrefix;
 	configure(cfg);
 }
 
 void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &valArea) {
 	const std::string value = valArea.toString();
-	if (name == "ecapguardian_listen_socket"){
-		set_listen_socket(value);
-	} else if(name == "debug") {
-		debug = true;
+	if (ServiceCore::setOne(name, value)) {
+		; // a connection, protocol, stats or logging option
+	} else if(name == "async_write_queue") {
+		async_write_queue = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "stream_bodies") {
+		stream_bodies = ParseBool(cfgErrorPrefix, name, value);
+	} else if(name == "stream_hold_back") {
+		stream_hold_back = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "stream_content_types") {
+		AddAll(stream_content_types, ParseList(value));
+	} else if(name == "skip_content_types") {
+		AddAll(skip_content_types, ParseList(value));
+	} else if(name == "skip_content_length_over") {
+		skip_content_length_over = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "max_scan_bytes") {
+		max_scan_bytes = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "max_buffer_bytes") {
+		max_buffer_bytes = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "oversize_action") {
+		if (value == "scan_prefix") {
+			oversize_action = oaScanPrefix;
+		} else if (value == "pass") {
+			oversize_action = oaPass;
+		} else if (value == "block") {
+			oversize_action = oaBlock;
+		} else {
+			throw libecap::TextException(cfgErrorPrefix +
+				"oversize_action expects scan_prefix, pass or block, got '" + value + "'");
+		}
 	} else if (name.assignedHostId()) {
 		; // skip options that don't matter
 	} else{
-		throw libecap::TextException(CfgErrorPrefix +
+		throw libecap::TextException(cfgErrorPrefix +
 			"unsupported configuration parameter: " + name.image());
 	}
 }
 
-void Adapter::Service::set_listen_socket(const std::string &value) {
-	if (value.empty()) {
-		throw libecap::TextException(CfgErrorPrefix +
-			"empty ecapguardian_listen_socket value is not allowed");
-	}
-	ecapguardian_listen_socket += value;
-}
-
 void Adapter::Service::start() {
 	libecap::adapter::Service::start();
-	// custom code would go here, but this service does not have one
+	startThreads();
 }
 
 void Adapter::Service::stop() {
-	// custom code would go here, but this service does not have one
+	stopThreads();
 	libecap::adapter::Service::stop();
 }
 
 void Adapter::Service::retire() {
-	// custom code would go here, but this service does not have one
+	stopThreads();
 	libecap::adapter::Service::stop();
 }
 
 bool Adapter::Service::wantsUrl(const char *url) const {
-	return true; // no-op is applied to all messages
+	return urlScope.wants(url); // everything unless scoped
 }
 
 Adapter::Service::MadeXactionPointer
@@ -227,58 +335,58 @@ Adapter::Service::makeXaction(libecap::host::Xaction *hostx) {
 		new Adapter::Xaction(std::tr1::static_pointer_cast<Service>(self), hostx));
 }
 
+// Whether the response body may reach the client before the verdict
+bool Adapter::Service::streams(const libecap::Message &response) const {
+	if (!stream_bodies) {
+		return false;
+	}
+	return stream_content_types.empty() || stream_content_types.matches(ContentType(response));
+}
+
+// Whether the response is out of scope, judging by its headers alone
+bool Adapter::Service::skips(const libecap::Message &response) const {
+	if (!skip_content_types.empty() && skip_content_types.matches(ContentType(response))) {
+		return true;
+	}
+	size_type length = 0;
+	return skip_content_length_over && ContentLength(response, length) && length > skip_content_length_over;
+}
+
+// How much of a body ecapguardian gets to see. Unless streaming, everything
+// sent is also buffered until the verdict, so max_buffer_bytes caps it too.
+Adapter::size_type Adapter::Service::scanLimit(bool streaming) const {
+	size_type limit = max_scan_bytes;
+	if (!streaming && max_buffer_bytes && (!limit || max_buffer_bytes < limit)) {
+		limit = max_buffer_bytes;
+	}
+	return limit;
+}
+
+bool Adapter::Service::makesAsyncXactions() const {
+	return async_verdicts;
+}
+
+void Adapter::Service::suspend(timeval &timeout) {
+	shortenNap(timeout);
+}
+
+void Adapter::Service::resume() {
+	notifyClients();
+}
+
 
 Adapter::Xaction::Xaction(libecap::shared_ptr<Service> aService,
 	libecap::host::Xaction *x):
+	logFile(aService->logger, aService->logger.nextId()),
 	service(aService),
 	hostx(x),
 	receivingVb(opUndecided), sendingAb(opUndecided) {
-	debug = service->debug;
+	debug = service->logger.enabled(Logger::llDebug) && service->logger.sample();
 	if(debug) {
-		std::string filename;
-		int randomId;
-		srand(time(NULL));
-		filename += "/tmp/respmodXaction" + std::to_string((rand() % 256)) + ".log";
-		logFile.open(filename.c_str(), std::ofstream::out | std::ofstream::app);
 		logFile << logStart << "RESPMOD Xaction::Xaction" << std::endl;
-		logFile.flush();
-	}
-        //Initializing the Unix Domain Socket connection
-        int socketConnectStatus;
-        struct sockaddr_un addr;
-        //service->ecapguardian_listen_socket is the socket path string
-	//The line below turns on blocking mode for the socket - not sure if I want that.
-	//socketHandle = socket(AF_UNIX, SOCK_STREAM & ~O_NONBLOCK, 0);
-	socketHandle = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (socketHandle == -1) {
-		if(debug) {
-			logFile << logStart << "RESPMOD Socket() filename " << service->ecapguardian_listen_socket << " errno: " << strerror(errno) << std::endl;
-		}
-		throw libecap::TextException(RunErrorPrefix + "Failed to get Socket Handle for socket filename '" +
-			service->ecapguardian_listen_socket + "'. errno: " + strerror(errno));
-        }
-
-        //Set up the sockaddr struct with necessary paths
-        memset(&addr, 0, sizeof(addr));
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, service->ecapguardian_listen_socket.c_str(), sizeof(addr.sun_path)-1);
-
-	if(debug) {
-		logFile << logStart << "RESPMOD Xaction::Xaction: Connecting to socket: " << service->ecapguardian_listen_socket.c_str() << std::endl;
-	}
-        //Make the connection
-        socketConnectStatus = connect(socketHandle, (struct sockaddr*)&addr, sizeof(addr));
-	if(debug) {
-		logFile << logStart << "RESPMOD Xaction::Xaction: after Connect, s=" << socketConnectStatus << std::endl;
 	}
-        if (socketConnectStatus < 0) {
-		if(debug) {
-        		logFile << logStart << "RESPMOD Connect errno: " << strerror(errno) << std::endl;
-		}
-                throw libecap::TextException(RunErrorPrefix + "Failed to Connect to RESPMOD socket. errno: "
-			+ strerror(errno));
-        }
-        //If you got here, you're ready to start writing to the socket
+	//The socket is checked out in start(), unless the response is skipped
+	socketHandle = -1;
 }
 
 Adapter::Xaction::~Xaction() {
@@ -289,12 +397,16 @@ Adapter::Xaction::~Xaction() {
 		hostx = 0;
 		x->adaptationAborted();
 	}
-	//Close the socket
-        close(socketHandle);
+	//Make sure the event loop lets go of the socket first
+	if (exchange) {
+		service->loop.cancel(exchange);
+		exchange->client = 0;
+	}
+	//Close the socket, or keep it for the next transaction
+	service->release(backend, socketHandle, protocolVersion, protocolFeatures, exchangeDone, channel, stream);
 	if(debug) {
 		logFile << logStart << "RESPMOD Xaction::~Xaction" << std::endl;
 		logFile << logStart << "==================================================" << std::endl;
-		logFile.close();
 	}
 }
 
@@ -307,8 +419,6 @@ void Adapter::Xaction::visitEachOption(libecap::NamedValueVisitor &) const {
 }
 
 void Adapter::Xaction::start() {
-	char buf[BUF_SIZE];
-	char c;
 	Must(hostx);
 	sharedPointerToVirginHeaders = hostx->virgin().clone();
 	libecap::shared_ptr<libecap::Message> cause = hostx->cause().clone();
@@ -318,76 +428,222 @@ void Adapter::Xaction::start() {
 	Must(sharedPointerToVirginHeaders != 0);
 	Must(cause != 0);
 
+	if (service->skips(*sharedPointerToVirginHeaders)) {
+		if(debug) {
+			logFile << logStart << "RESPMOD Xaction::start : skipped by content type or length" << std::endl;
+		}
+		sendingAb = opNever;
+		lastHostCall()->useVirgin();
+		return;
+	}
+
+	//While every ecapguardian is down, don't wait on them for every response
+	backend = service->pickBackend(*hostx);
+	if (!backend) {
+		service->metrics.breakerRejected.fetch_add(1, std::memory_order_relaxed);
+		if (fallBack(service->breaker_action, "The content filter is not available.")) {
+			return;
+		}
+		throw libecap::TextException(service->runErrorPrefix + "ecapguardian is unavailable, the circuit breakers are open");
+	}
+
+	//Get the Unix Domain Socket connection - a pooled one if there is one idle
+	//from the backend picked above, or the next one that can be reached
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::start: Connecting to socket: " << backend->socketPath << std::endl;
+	}
+	try {
+		socketHandle = service->checkout(backend, protocolVersion, protocolFeatures, channel, stream);
+	} catch (const Timeout &timeout) {
+		if (timedOut(timeout)) {
+			return;
+		}
+		throw;
+	}
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::start: after checkout, socket=" << socketHandle << std::endl;
+	}
+
 	//
-	// Write the request headers to ecapguardian
-	// These are necessary for the response scanner plugins in ecapguardian
+	// Write the request headers and then the response headers to ecapguardian
+	// The request headers are necessary for the response scanner plugins in ecapguardian
 	ssize_t s = 0;
 	// NOTE: ecapguardian REQUIRES 1 character past the final newline, so we just write 'size'
-	// instead of 'size - 1' because the last one is a null.  Same below with the response header.
+	// instead of 'size - 1' because the last one is a null.  Same with the response header.
+	const libecap::Area causeHeader = cause->header().image();
+	const libecap::Area responseHeader = sharedPointerToVirginHeaders->header().image();
 	if(debug) {
-		if(cause->header().image().size == 0) {
+		if(causeHeader.size == 0) {
 			logFile << logStart << "RESPMOD Xaction::start : empty cause header" << std::endl;
 		} else {
-			logFile << logStart << "RESPMOD Xaction::start : cause header size: " << cause->header().image().size << std::endl;
-			logFile << logStart << "RESPMOD Xaction::start : cause header:" << std::endl << cause->header().image() << std::endl;
+			logFile << logStart << "RESPMOD Xaction::start : cause header size: " << causeHeader.size << std::endl;
+			logFile << logStart << "RESPMOD Xaction::start : cause header:" << std::endl << causeHeader << std::endl;
 		}
-	}
-	s = write(socketHandle, cause->header().image().start, cause->header().image().size);
-	checkWritten(s, cause->header().image().size, std::string("cause header"));
-
-	//
-	// Write the response headers to ecapguardian
-	//
-	//ssize_t write(int fd, const void *buf, size_t count);
-	if(debug) {
-		if(sharedPointerToVirginHeaders->header().image().size == 0) {
+		if(responseHeader.size == 0) {
 			logFile << logStart << "RESPMOD Xaction::start : empty response header" << std::endl;
 		} else {
-			logFile << logStart << "RESPMOD Xaction::start : response header size: " << sharedPointerToVirginHeaders->header().image().size << std::endl;
+			logFile << logStart << "RESPMOD Xaction::start : response header size: " << responseHeader.size << std::endl;
+			logFile << logStart << "RESPMOD Xaction::start : response header:" << std::endl << responseHeader << std::endl;
 		}
-        }
-	s = write(socketHandle, sharedPointerToVirginHeaders->header().image().start, sharedPointerToVirginHeaders->header().image().size);
-	checkWritten(s, sharedPointerToVirginHeaders->header().image().size, std::string("response header"));
-        s = read(socketHandle, buf, 1);
-	if(debug) {
-	        logFile << logStart << "RESPMOD Xaction::start : After receiving response char, s=" << s << std::endl;
-                logFile << logStart << "RESPMOD Xaction::start : response header:" << std::endl << sharedPointerToVirginHeaders->header().image() << std::endl;
-        }
-	if(s != 1){
-                throw libecap::TextException("After response char, s was " + std::to_string(s));
-                exit(-1);
-        }
-
-	c = buf[0];
-	if(debug) {
-		logFile << logStart << "RESPMOD Xaction::start : response char was '" << c << "'" << std::endl;
 	}
-	if(c == FLAG_USE_VIRGIN || c == FLAG_NEEDS_SCAN) {
-		//Write back the message received flag
-		s = write(socketHandle, &FLAG_MSG_RECVD, 1);
+	//With FEATURE_CORRELATION, the ID the REQMOD phase gave the request
+	//stands in for the cause header, see fg_protocol.h
+	libecap::Area correlationId;
+	if (protocolFeatures & FEATURE_CORRELATION) {
+		correlationId = hostx->option(libecap::Name(service->correlation_option));
+	}
+	const bool correlated = correlationId.size > 0;
+	if (correlated) {
+		causeFallback = FrameHeader(FRAME_HEADER, causeHeader.size, 0, stream);
+		causeFallback.append(causeHeader.start, causeHeader.size);
+		service->metrics.correlated.fetch_add(1, std::memory_order_relaxed);
 		if(debug) {
-			logFile << logStart << "RESPMOD Xaction::start : wrote FLAG_MSG_RECVD" << std::endl;
+			logFile << logStart << "RESPMOD Xaction::start : correlation ID " << correlationId << std::endl;
 		}
-	} else {
-		std::string error("RESPMOD Xaction::start : did not receive proper response flag.  Received '");
-		error.append(c, 1);
-		error.append("' insted of expected 'v' or 's'");
-		throw libecap::TextException(error);
+	}
+	const libecap::Area &firstHeader = correlated ? correlationId : causeHeader;
+	//v1: on a pooled connection the headers are preceded by the transaction reset flag
+	//v2: each header is preceded by its frame header
+	const std::string causeFrame = FrameHeader(correlated ? FRAME_CORRELATION : FRAME_HEADER, firstHeader.size, 0, stream);
+	const std::string responseFrame = FrameHeader(FRAME_RESPONSE_HEADER, responseHeader.size, 0, stream);
+	struct iovec iov[4];
+	int iovcnt = 0;
+	if (protocolVersion == PROTOCOL_V1 && backend->pool.pooled()) {
+		iov[iovcnt].iov_base = const_cast<char*>(&ConnectionPool::FLAG_XACTION_RESET);
+		iov[iovcnt++].iov_len = 1;
+	}
+	if (protocolVersion == PROTOCOL_V2) {
+		iov[iovcnt].iov_base = const_cast<char*>(causeFrame.data());
+		iov[iovcnt++].iov_len = causeFrame.size();
+	}
+	iov[iovcnt].iov_base = const_cast<char*>(firstHeader.start);
+	iov[iovcnt++].iov_len = firstHeader.size;
+	if (protocolVersion == PROTOCOL_V2) {
+		iov[iovcnt].iov_base = const_cast<char*>(responseFrame.data());
+		iov[iovcnt++].iov_len = responseFrame.size();
+	}
+	iov[iovcnt].iov_base = const_cast<char*>(responseHeader.start);
+	iov[iovcnt++].iov_len = responseHeader.size;
+	const size_type expected = IovSize(iov, iovcnt);
+	headerSentAt = MonotonicMicros();
+	//On a shared connection the event loop writes it, between the frames of other streams
+	s = channel ? 0 : writev(socketHandle, iov, iovcnt);
+	if (s > 0) {
+		service->metrics.bytesSent.fetch_add(s, std::memory_order_relaxed);
+	}
+
+	if (service->async_verdicts) {
+		//Do not block the host: the event loop thread finishes the write and
+		//waits for the answer, Service::resume() brings us to applyHeadersReply()
+		if (s < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			service->checkWritten(*backend, s, expected, "cause and response header");
+		}
+		exchange.reset(new AsyncExchange(socketHandle, Reply::rkRespmodHeaders, protocolVersion, channel, stream));
+		exchange->client = this;
+		exchange->metrics = &service->metrics;
+		exchange->reply.maxSize = service->max_reply_size;
+		exchange->reply.acks = ServiceCore::Acks(protocolFeatures);
+		exchange->reply.scanHints = (protocolFeatures & FEATURE_SCAN_HINTS) != 0;
+		if (correlated) {
+			exchange->reply.cause = &causeFallback;
+		}
+		if (s < 0) {
+			s = 0;
+		}
+		exchange->queue(IovTail(iov, iovcnt, s));
+		if(debug) {
+			logFile << logStart << "RESPMOD Xaction::start : waiting for the header verdict asynchronously" << std::endl;
+		}
+		service->loop.add(exchange);
+		return;
+	}
+
+	Reply reply(Reply::rkRespmodHeaders, protocolVersion);
+	reply.maxSize = service->max_reply_size;
+	reply.acks = ServiceCore::Acks(protocolFeatures);
+	reply.scanHints = (protocolFeatures & FEATURE_SCAN_HINTS) != 0;
+	if (correlated) {
+		reply.cause = &causeFallback;
+	}
+	try {
+		service->checkWritten(*backend, s, expected, "cause and response header");
+		readReply(reply);
+	} catch (const Timeout &timeout) {
+		if (timedOut(timeout)) {
+			return;
+		}
+		throw;
+	}
+	applyHeadersReply(reply);
+}
+
+// 'v' means there is no need to scan this response, 's' asks for the body
+void Adapter::Xaction::applyHeadersReply(Reply &reply) {
+	const char c = reply.verdict;
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::applyHeadersReply : response char was '" << c << "'" << std::endl;
+	}
+	service->noteRoundTrip(*backend, MonotonicMicros() - headerSentAt);
+	service->metrics.verdict(c);
+	if (reply.causeFetched) {
+		// ecapguardian did not know the correlation ID
+		service->metrics.causeFetches.fetch_add(1, std::memory_order_relaxed);
 	}
 	if(c == FLAG_USE_VIRGIN) {
 		if(debug) {
-                	logFile << logStart << "RESPMOD Xaction::start : skipping content scan after request header check" << std::endl;
+                	logFile << logStart << "RESPMOD Xaction::applyHeadersReply : skipping content scan after request header check" << std::endl;
 		}
 		sendingAb = opNever; // there is nothing to send
                 lastHostCall()->useVirgin();
 		return;
 	}
 
+	exchangeDone = false; // the body and its verdict are still to come
 	if (hostx->virgin().body()) {
 		if(debug) {
-			logFile << logStart << "RESPMOD Xaction::start : has VB, requesting it now" << std::endl;
+			logFile << logStart << "RESPMOD Xaction::applyHeadersReply : has VB, requesting it now" << std::endl;
+		}
+		streaming = service->streams(*sharedPointerToVirginHeaders);
+		scanLimit = service->scanLimit(streaming);
+		if (reply.scanBytes) {
+			// ecapguardian's own limit, never over ours, and with
+			// SCAN_HINT_PREFIX it judges the prefix whatever oversize_action says
+			scanLimit = scanLimit ? std::min<size_type>(scanLimit, reply.scanBytes) : reply.scanBytes;
+			prefixHint = (reply.scanHintFlags & SCAN_HINT_PREFIX) != 0;
+			service->metrics.scanHints.fetch_add(1, std::memory_order_relaxed);
+			if(debug) {
+				logFile << logStart << "RESPMOD Xaction::applyHeadersReply : ecapguardian scans at most " << scanLimit <<
+					" bytes" << (prefixHint ? ", the prefix is all it needs" : "") << std::endl;
+			}
+		}
+		size_type length = 0;
+		if (scanLimit && ContentLength(*sharedPointerToVirginHeaders, length) && length > scanLimit && !prefixHint &&
+			(service->oversize_action != Service::oaScanPrefix || protocolVersion == PROTOCOL_V1)) {
+			// known to be too big, and ecapguardian is not going to see any of it
+			if(debug) {
+				logFile << logStart << "RESPMOD Xaction::applyHeadersReply : body of " << length << " bytes is over the scan limit" << std::endl;
+			}
+			if (service->oversize_action == Service::oaBlock) {
+				receivingVb = opNever;
+				useBlockPage("The response is too big to be scanned.");
+				return;
+			}
+			sendingAb = opNever;
+			lastHostCall()->useVirgin();
+			return;
 		}
 		receivingVb = opOn;
+		bodyWantedAt = MonotonicMicros();
+		if (service->async_verdicts) {
+			// the event loop writes the body out and waits for the verdict
+			exchange.reset(new AsyncExchange(socketHandle, Reply::rkRespmodBody, protocolVersion, channel, stream));
+			exchange->client = this;
+			exchange->metrics = &service->metrics;
+			exchange->reply.maxSize = service->max_reply_size;
+			exchange->reply.acks = ServiceCore::Acks(protocolFeatures);
+			exchange->outputDone = false; // the verdict timeout starts with the end of the body
+			service->loop.add(exchange);
+		}
 		hostx->vbMake(); // ask host to supply virgin body
 	}
 
@@ -395,32 +651,14 @@ void Adapter::Xaction::start() {
 	// Do NOT call the 'lastHostCall' at the end of the 'start' method
 	// End of the 'start' method is reached long before the last of the VB is delivered
 	if(debug) {
-		logFile << logStart << "RESPMOD Xaction::start : end of method" << std::endl;
+		logFile << logStart << "RESPMOD Xaction::applyHeadersReply : end of method" << std::endl;
 	}
 }
 
-void Adapter::Xaction::checkWritten(ssize_t sent, size_type expectedSent, std::string name) {
-	if(sent == -1){
-		std::string error("RESPMOD Xaction::checkWritten : errno on '" + name + "' write. errno: ");
-		error.append(strerror(errno));
-		if(debug) {
-                	logFile << logStart << error << std::endl;
-		}
-                //There was some sort of error
-                //We can recover from one of these types of errors
-                if(errno){
-                        //Not recoverable
-                        throw libecap::TextException(error);
-                }
-        }
-        if(sent != expectedSent){
-		std::string error(RunErrorPrefix + "Failed RESPMOD '" + name + "' headers write to ecapguardian. Wrote "
-                        +  std::to_string(sent) + " instead of " + std::to_string(expectedSent));
-		if(debug) {
-			logFile << logStart << error << std::endl;
-		}
-                throw libecap::TextException(error);
-        }
+// Blocking read of the whole ecapguardian reply, acknowledging the
+// verdict, header and body parts as ecapguardian expects
+void Adapter::Xaction::readReply(Reply &reply) {
+	exchangeDone = service->readReply(*backend, socketHandle, reply, debug ? &logFile : 0) && reply.clean();
 }
 
 void Adapter::Xaction::stop() {
@@ -448,18 +686,16 @@ void Adapter::Xaction::abMake()
 		logFile << logStart << "RESPMOD Xaction::abMake" << std::endl;
 	}
 	Must(sendingAb == opUndecided); // have not yet started or decided not to send
-	Must(hostx->virgin().body()); // that is our only source of ab content
+	Must(hostx->virgin().body() || verdictKnown); // vb is our only source of ab content, but for our own page
 
-	// we are or were receiving vb
-	Must(receivingVb == opOn || receivingVb == opComplete);
+	// we are or were receiving vb, or skipped it for a block page
+	Must(receivingVb != opUndecided);
 
-	if (!buffer.empty()){
-		sendingAb = opOn;
-		if(debug) {
-			logFile << logStart << "RESPMOD Xaction::abMake : buffer not empty" << std::endl;
-		}
-		hostx->noteAbContentAvailable();
+	sendingAb = opOn;
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::abMake : buffer size " << buffer.size() << std::endl;
 	}
+	passVb();
 }
 
 void Adapter::Xaction::abMakeMore() {
@@ -484,7 +720,12 @@ libecap::Area Adapter::Xaction::abContent(size_type offset, size_type size) {
 	if(debug) {
 		logFile << logStart << "RESPMOD Xaction::abContent : buffer.size()=" << buffer.size() <<  "| offset=" << offset << ", size=" << size << std::endl;
 	}
-	return libecap::Area::FromTempString(buffer.substr(offset, size));
+	// while streaming, the held back tail is not the host's yet
+	const size_type available = released();
+	if (offset >= available) {
+		return libecap::Area();
+	}
+	return buffer.content(offset, std::min(size, available - offset)); // shares the store's chunk, no copy
 }
 
 void Adapter::Xaction::abContentShift(size_type size) {
@@ -492,10 +733,8 @@ void Adapter::Xaction::abContentShift(size_type size) {
 		logFile << logStart << "RESPMOD Xaction::abContentShift : size=" << size << std::endl;
 	}
 	Must(sendingAb == opOn || sendingAb == opComplete);
-	buffer.erase(0, size);
-	if(buffer.size() <= 0) {
-		hostx->noteAbContentDone(true);
-	}
+	buffer.shift(size);
+	passVb(); // there may be room for more now
 }
 
 void Adapter::Xaction::noteVbContentDone(bool atEnd) {
@@ -503,159 +742,452 @@ void Adapter::Xaction::noteVbContentDone(bool atEnd) {
 		logFile << logStart << "RESPMOD Xaction::noteVbContentDone : atEnd=" << atEnd << std::endl;
 	}
 	Must(receivingVb == opOn);
+	if (scanCut) {
+		vbDone = true;
+		passVb(); // takes the rest once there is a verdict
+		return;
+	}
+	if (service->async_verdicts) {
+		vbDone = true;
+		pumpVb(); // sends what is left, then waits for the verdict
+		return;
+	}
 	stopVb();
-	size_t t;
-	ssize_t s = 0;
-	char buf[BUF_SIZE];
-	char c;
-	if(debug) {
-        	logFile << logStart << "RESPMOD Xaction::noteVbContentDone : After writing response body to ecapguardian" << std::endl;
+	if (protocolVersion == PROTOCOL_V2) {
+		const std::string frame = FrameHeader(FRAME_END_OF_BODY, 0);
+		struct iovec iov;
+		iov.iov_base = const_cast<char*>(frame.data());
+		iov.iov_len = frame.size();
+		try {
+			service->writeAll(*backend, socketHandle, &iov, 1, "end of body frame", debug ? &logFile : 0);
+		} catch (const Timeout &timeout) {
+			if (timedOut(timeout)) {
+				return;
+			}
+			throw;
+		}
 	}
-	s = read(socketHandle, buf, 1);
 	if(debug) {
-	        logFile << logStart << "RESPMOD Xaction::noteVbContentDone : After receiving response char, s=" << s << std::endl;
+        	logFile << logStart << "RESPMOD Xaction::noteVbContentDone : After writing response body to ecapguardian" << std::endl;
 	}
-        if(s != 1){
-		if(debug) {
-			logFile << logStart << "RESPMOD Xaction::noteVbContentDone : ERROR: After receiving response char, s=" << s << std::endl;
+	Reply reply(Reply::rkRespmodBody, protocolVersion);
+	reply.maxSize = service->max_reply_size;
+	reply.acks = ServiceCore::Acks(protocolFeatures);
+	try {
+		readReply(reply);
+	} catch (const Timeout &timeout) {
+		if (timedOut(timeout)) {
+			return;
 		}
-                throw libecap::TextException("After response char, s was " + std::to_string(s));
-                exit(-1);
-        }
+		throw;
+	}
+	applyBodyReply(reply);
+}
 
-	c = buf[0];
+// 'v' serves the (buffered) virgin response, 'm' the block page or the
+// rewritten response that came with the verdict
+void Adapter::Xaction::applyBodyReply(Reply &reply) {
+	const char c = reply.verdict;
 	if(debug) {
-		logFile << logStart << "RESPMOD Xaction::noteVbContentDone : response char was '" << c << "'" << std::endl;
+		logFile << logStart << "RESPMOD Xaction::applyBodyReply : response char was '" << c << "'" << std::endl;
+	}
+	if (bodyWantedAt) {
+		service->metrics.bodyScan.record(MonotonicMicros() - bodyWantedAt);
+		bodyWantedAt = 0;
 	}
-	if(c == FLAG_USE_VIRGIN || c == FLAG_MODIFY) {
-		s = write(socketHandle, &FLAG_MSG_RECVD, 1);
+	service->metrics.verdict(c);
+	verdictKnown = true;
+	if (committed) {
+		// streaming: the client has the headers and all but the held back tail
+		if (c != FLAG_USE_VIRGIN) {
+			// too late for a block page; make sure the client does not get a complete response
+			buffer.clear();
+			throw libecap::TextException(service->runErrorPrefix + "ecapguardian modified a response that was streamed already, aborting it");
+		}
 		if(debug) {
-	                logFile << logStart << "RESPMOD Xaction::start : wrote FLAG_MSG_RECVD" << std::endl;
-		}
-        } else {
-                std::string error("RESPMOD Xaction::start : did not receive proper response flag.  Received '");
-                error.append(c, 1);
-                error.append("' insted of expected 'v' or 's'");
-                throw libecap::TextException(error);
-        }
+			logFile << logStart << "RESPMOD Xaction::applyBodyReply : releasing the held back body" << std::endl;
+		}
+		passVb(); // or abMake() is yet to come and does it
+		return;
+	}
 	if(c == FLAG_USE_VIRGIN) {
 		if(debug) {
-	                logFile << logStart << "RESPMOD Xaction::noteVbContentDone : Telling host to use original cached response body" << std::endl;
+	                logFile << logStart << "RESPMOD Xaction::applyBodyReply : Telling host to use original cached response body" << std::endl;
 		}
 		hostx->useAdapted(sharedPointerToVirginHeaders);
+		return;
 	}
-	if(c == FLAG_MODIFY) {  // Modify as in block or re-write
-		libecap::shared_ptr<libecap::Message> ptr;
-		libecap::Area headers;
-		libecap::Area responseBody;
-		std::string modifiedHeader;
-		if(debug) {
-			logFile << logStart << "REQMOD Xaction::noteVbContentDone : modifying response (blocked or modified)" << std::endl;
+
+	// Modify as in block or re-write (the reply parser accepts nothing else)
+	Must(c == FLAG_MODIFY);
+	stopVb(); // ecapguardian may have seen a prefix only
+	libecap::shared_ptr<libecap::Message> ptr;
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::applyBodyReply : modifying response (blocked or modified)" << std::endl;
+		logFile << logStart << "RESPMOD Xaction::applyBodyReply : Modified Header read in: " << std::endl << reply.header.c_str() << std::endl;
+	}
+	//The modified response body replaces the virgin one
+	buffer.clear();
+	buffer.adopt(reply.body);
+	//Now the funky part - make adapted headers and tell host to use adapted
+	//This "libecap::MyHost().newResponse();" is found in registry.h
+	ptr = libecap::MyHost().newResponse();
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::applyBodyReply : Made new response message" << std::endl;
+	}
+	ptr->header().parse(libecap::Area::FromTempString(reply.header));
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::applyBodyReply : Parsed headers into request satisfaction message" << std::endl;
+	}
+	ptr->addBody();  // This is just a flag saying that the message has a body.
+			// The body is pulled via abMake() and abContent()
+	//Need to use the correct message pointer - duh
+	//abMake() tells the host that the body is all there
+	hostx->useAdapted(ptr);
+}
+
+void Adapter::Xaction::noteVbContentAvailable() {
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::noteVbContentAvailable" << std::endl;
+	}
+	Must(receivingVb == opOn);
+	if (verdictKnown) {
+		passVb();
+		return;
+	}
+	if (scanCut) {
+		return; // the host keeps it until the verdict on the scanned prefix
+	}
+	if (service->async_verdicts) {
+		pumpVb();
+		return;
+	}
+	if (overLimit()) {
+		oversize();
+		return;
+	}
+	// get all vb in this chunk, or as much as ecapguardian may still see
+	const libecap::Area vb = hostx->vbContent(0, scanLimit ? scanLimit - scanned : libecap::nsize);
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::noteVbContentAvailable : chunk was size: " << vb.size << std::endl;
+	}
+	// The only copy we make is the one kept for a 'v' verdict, the socket
+	// gets the chunk straight from the host's memory (behind the v2 frame header)
+	buffer.append(vb.start, vb.size);
+	const std::string frame = FrameHeader(FRAME_BODY, vb.size);
+	struct iovec iov[2];
+	int iovcnt = 0;
+	if (protocolVersion == PROTOCOL_V2) {
+		iov[iovcnt].iov_base = const_cast<char*>(frame.data());
+		iov[iovcnt++].iov_len = frame.size();
+	}
+	iov[iovcnt].iov_base = const_cast<char*>(vb.start);
+	iov[iovcnt++].iov_len = vb.size;
+	try {
+		service->writeAll(*backend, socketHandle, iov, iovcnt, "response body", debug ? &logFile : 0);
+	} catch (const Timeout &timeout) {
+		hostx->vbContentShift(vb.size); // buffered already
+		if (timedOut(timeout)) {
+			return;
 		}
-		do{
-			if(debug) {
-				logFile << logStart << "REQMOD Xaction::noteVbContentDone : Blockpage Header Input Do loop" << std::endl;
-			}
-			s = read(socketHandle, buf, BUF_SIZE);
-			if(debug) {
-				logFile << logStart << "REQMOD Xaction::noteVbContentDone : Read " << s << " header bytes." <<std::endl;
-			}
-			modifiedHeader.append(buf, s);
-			if(modifiedHeader.rfind(FLAG_END) != std::string::npos){
-				if(debug) {
-					logFile << logStart << "REQMOD Xaction::noteVbContentDone : End Header signal received - removing it from the header" << std::endl;
-				}
-				//Rip out the last three chars: \n\0\0
-				t = modifiedHeader.rfind(FLAG_END_REMOVE);
-				if(t != std::string::npos){
-					modifiedHeader.replace(t, FLAG_END_REMOVE.length(), "");
-				}
-				s = 0;
-			}
-		} while(s > 0);
+		throw;
+	}
+	scanned += vb.size;
+	hostx->vbContentShift(vb.size); // 'shift' means 'delete', the area is not used past here
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::noteVbContentAvailable : Finished writing this chunk" << std::endl;
+	}
+	releaseVb();
+	if (overLimit()) {
+		oversize();
+	}
+}
+
+// Streaming: once more than stream_hold_back bytes are buffered, the host
+// gets the virgin headers and may take everything but the last
+// stream_hold_back bytes, which wait for the verdict. A late 'm' can then
+// only abort the transaction, leaving the client with a truncated body.
+void Adapter::Xaction::releaseVb() {
+	if (!streaming || verdictKnown || buffer.size() <= service->stream_hold_back) {
+		return;
+	}
+	if (!committed) {
 		if(debug) {
-			logFile << logStart << "REQMOD Xaction::noteVbContentDone : Modified Header read in: " << std::endl << modifiedHeader.c_str() << std::endl;
+			logFile << logStart << "RESPMOD Xaction::releaseVb : streaming the response before the verdict" << std::endl;
 		}
-		//Next, send the 'headers received' signal to the server
-		s = write(socketHandle, &FLAG_MSG_RECVD, 1);
-		//Now, read in the modified response body
-		buffer.clear();
-		do{
-			if(debug) {
-				logFile << logStart << "REQMOD Xaction::noteVbContentDone : Modified Page Do Loop" << std::endl;
+		committed = true;
+		hostx->useAdapted(sharedPointerToVirginHeaders); // the host calls abMake() for the body
+		return;
+	}
+	if (sendingAb == opOn) {
+		hostx->noteAbContentAvailable();
+	}
+}
+
+// Once the verdict is in, everything in buffer is the host's. If vb is still
+// coming (a 'v' verdict on a scanned prefix, or oversize_action=pass) it
+// goes the same way, with at most max_buffer_bytes waiting for the host.
+void Adapter::Xaction::passVb() {
+	if (verdictKnown && receivingVb == opOn) {
+		const size_type limit = service->max_buffer_bytes;
+		const size_type room = !limit ? libecap::nsize : buffer.size() < limit ? limit - buffer.size() : 0;
+		if (room) {
+			const libecap::Area vb = hostx->vbContent(0, room);
+			const size_type size = vb.size;
+			if (size) {
+				buffer.append(vb.start, size);
+				hostx->vbContentShift(size);
 			}
-			s = read(socketHandle, buf, BUF_SIZE);
-			if(debug) {
-				logFile << logStart << "REQMOD Xaction::noteVbContentDone : Read " << s << " modified page bytes" << std::endl;
+		}
+		if (vbDone && !hostx->vbContent(0, libecap::nsize).size) {
+			stopVb();
+		}
+	}
+	if (sendingAb != opOn) {
+		return; // abMake() comes back here
+	}
+	if (released()) {
+		hostx->noteAbContentAvailable();
+	}
+	if (verdictKnown && receivingVb != opOn) {
+		sendingAb = opComplete;
+		hostx->noteAbContentDone(true);
+	}
+}
+
+bool Adapter::Xaction::overLimit() {
+	return scanLimit && scanned >= scanLimit && hostx->vbContent(0, libecap::nsize).size;
+}
+
+// The body turned out bigger than ecapguardian or our buffer may take
+void Adapter::Xaction::oversize() {
+	if(debug) {
+		logFile << logStart << "RESPMOD Xaction::oversize : scanned " << scanned << " bytes, buffered " << buffer.size() << std::endl;
+	}
+	scanCut = true;
+	if ((prefixHint || service->oversize_action == Service::oaScanPrefix) && protocolVersion == PROTOCOL_V2) {
+		// ecapguardian gets an early end of body and judges what it has seen
+		const std::string frame = FrameHeader(FRAME_END_OF_BODY, 0, 0, stream);
+		if (service->async_verdicts) {
+			service->loop.send(exchange, frame, std::string::npos);
+			service->loop.endOutput(exchange);
+			if (bodyReplyReady) {
+				applyBodyReply(exchange->reply);
 			}
-			buffer.append(buf, s);
-			if(buffer.rfind(FLAG_END) != std::string::npos){
-				if(debug) {
-					logFile << logStart << "REQMOD Xaction::noteVbContentDone : End Body signal received - removing it from the body" << std::endl;
-				}
-				//Rip out the last three chars of the flag
-				t = buffer.rfind(FLAG_END_REMOVE);
-				if(t != std::string::npos){
-					buffer.replace(t, FLAG_END_REMOVE.length(), "");
-				}
-				s = 0;
+			return;
+		}
+		struct iovec iov;
+		iov.iov_base = const_cast<char*>(frame.data());
+		iov.iov_len = frame.size();
+		Reply reply(Reply::rkRespmodBody, protocolVersion);
+		reply.maxSize = service->max_reply_size;
+		reply.acks = ServiceCore::Acks(protocolFeatures);
+		try {
+			service->writeAll(*backend, socketHandle, &iov, 1, "end of body frame", debug ? &logFile : 0);
+			readReply(reply);
+		} catch (const Timeout &timeout) {
+			if (timedOut(timeout)) {
+				return;
 			}
-		} while(s > 0);
-		//Tell the server that we've received the modified response body
-		s = write(socketHandle, &FLAG_MSG_RECVD, 1);
-		//Now the funky part - make adapted headers and tell host to use adapted
-		//This "libecap::MyHost().newResponse();" is found in registry.h
-		if(debug) {
-			logFile << logStart << "REQMOD Xaction::noteVbContentDone : Sent MSG_RECVD flag" << std::endl;
+			throw;
 		}
-		ptr = libecap::MyHost().newResponse();
-		if(debug) {
-			logFile << logStart << "REQMOD Xaction::noteVbContentDone : Made new response message" << std::endl;
+		applyBodyReply(reply);
+		return;
+	}
+
+	// v1 has no way to end the body early, so scan_prefix passes it like pass does
+	giveUpScan(service->oversize_action == Service::oaBlock, "The response is too big to be scanned.");
+}
+
+// No body verdict is coming: the response goes to the client unscanned, or
+// is replaced by our own page. The connection is in the middle of an
+// exchange and cannot be reused.
+void Adapter::Xaction::giveUpScan(bool block, const std::string &reason) {
+	if (exchange) {
+		service->loop.cancel(exchange);
+	}
+	exchangeDone = false;
+	scanCut = true; // ecapguardian gets no more vb
+	if (block) {
+		if (committed) {
+			buffer.clear();
+			throw libecap::TextException(service->runErrorPrefix + "streamed response cannot be blocked any more (" + reason + "), aborting it");
 		}
-		headers = libecap::Area::FromTempString(modifiedHeader);
+		useBlockPage(reason);
+		return;
+	}
+	verdictKnown = true;
+	if (!committed) {
+		committed = true;
+		hostx->useAdapted(sharedPointerToVirginHeaders); // the host calls abMake() for the body
+	}
+	passVb();
+}
+
+// Replaces the response with a page of our own
+void Adapter::Xaction::useBlockPage(const std::string &reason) {
+	stopVb();
+	std::string header;
+	std::string body;
+	ForbiddenPage(reason, header, body);
+	buffer.clear();
+	buffer.adopt(body);
+	verdictKnown = true;
+	libecap::shared_ptr<libecap::Message> ptr = libecap::MyHost().newResponse();
+	ptr->header().parse(libecap::Area::FromTempString(header));
+	ptr->addBody();
+	hostx->useAdapted(ptr);
+}
+
+// ecapguardian made no progress for one of the *_timeout options. Returns
+// false if timeout_action=error, and the transaction is to fail.
+bool Adapter::Xaction::timedOut(const Timeout &timeout) {
+	service->noteTimeout(timeout, logFile.id());
+	exchangeDone = false; // cut short
+	if (service->timeout_action == ServiceCore::faError) {
+		return false;
+	}
+	const bool block = service->timeout_action == ServiceCore::faBlock;
+	const std::string reason = "The content filter did not answer in time.";
+	if (receivingVb != opUndecided) {
+		giveUpScan(block, reason);
+		return true;
+	}
+	// still waiting for the header verdict
+	if (exchange) {
+		service->loop.cancel(exchange);
+	}
+	return fallBack(service->timeout_action, reason);
+}
+
+// Answers without a verdict from ecapguardian. Returns false for faError.
+bool Adapter::Xaction::fallBack(ServiceCore::FallbackAction action, const std::string &reason) {
+	if (action == ServiceCore::faBlock) {
+		receivingVb = opNever;
+		useBlockPage(reason);
+		return true;
+	}
+	if (action == ServiceCore::faBypass) {
+		sendingAb = opNever;
+		lastHostCall()->useVirgin();
+		return true;
+	}
+	return false;
+}
+
+Adapter::size_type Adapter::Xaction::released() const {
+	if (verdictKnown) {
+		return buffer.size();
+	}
+	const size_type holdBack = service->stream_hold_back;
+	return streaming && buffer.size() > holdBack ? buffer.size() - holdBack : 0;
+}
+
+// async_verdicts: moves whatever virgin body the host has over to the event
+// loop. While the loop is behind by async_write_queue bytes the host keeps
+// the body (and stops reading from the server when its buffer fills up).
+void Adapter::Xaction::pumpVb() {
+	if (waitingForDrain || scanCut) {
+		return; // noteExchangeDrained() will come back here, or we are done sending
+	}
+	if (overLimit()) {
+		oversize();
+		return;
+	}
+	const libecap::Area vb = hostx->vbContent(0, scanLimit ? scanLimit - scanned : libecap::nsize);
+	const size_type size = vb.size;
+	if (size) {
 		if(debug) {
-			logFile << logStart << "REQMOD Xaction::noteVbContentDone : Made Headers 'Area'" << std::endl;
+			logFile << logStart << "RESPMOD Xaction::pumpVb : queueing chunk of size: " << size << std::endl;
 		}
-		ptr->header().parse(headers);
-		if(debug) {
-			logFile << logStart << "REQMOD Xaction::noteVbContentDone : Parsed headers into request satisfaction message" << std::endl;
+		// the event loop writes later, after the host reused the area, so it
+		// needs its own copy; it is moved into the output queue, not copied again
+		std::string chunk(vb.start, size);
+		buffer.append(vb.start, size);
+		scanned += size;
+		hostx->vbContentShift(size);
+		// v2: the frame header is a separate piece of output, the loop gathers
+		// it into the same sendmsg()
+		const bool queued = service->loop.send(exchange, std::move(chunk), service->async_write_queue,
+			protocolVersion == PROTOCOL_V2 ? FrameHeader(FRAME_BODY, size, 0, stream) : std::string());
+		releaseVb();
+		if (!queued) {
+			waitingForDrain = true;
+			return;
 		}
-		ptr->addBody();  // This is just a flag saying that the message has a body.
-				// The body is pulled via abMake() and abContent()
-		if(debug) {
-			logFile << logStart << "REQMOD Xaction::noteVbContentDone : Added body flag to request satisfaction message" << std::endl;
+	}
+	if (overLimit()) {
+		oversize();
+		return;
+	}
+	if (vbDone) {
+		if (protocolVersion == PROTOCOL_V2) {
+			// queued regardless of the limit, there is nothing after it
+			service->loop.send(exchange, FrameHeader(FRAME_END_OF_BODY, 0, 0, stream), std::string::npos);
+		}
+		service->loop.endOutput(exchange);
+		stopVb();
+		if (bodyReplyReady) {
+			applyBodyReply(exchange->reply);
 		}
-		//Need to use the correct message pointer - duh
-		hostx->useAdapted(ptr);
-		hostx->noteAbContentDone(true);
 	}
 }
 
-void Adapter::Xaction::noteVbContentAvailable() {
+// Called from Service::resume() when the event loop finished the header
+// or the body exchange
+void Adapter::Xaction::noteExchangeReady() {
 	if(debug) {
-		logFile << logStart << "RESPMOD Xaction::noteVbContentAvailable" << std::endl;
+		logFile << logStart << "RESPMOD Xaction::noteExchangeReady" << std::endl;
 	}
-	long startFrom = 0;
-	Must(receivingVb == opOn);
-	const libecap::Area vb = hostx->vbContent(0, libecap::nsize); // get all vb in this chunk
-	std::string chunk = vb.toString();
-	if(debug) {
-		logFile << logStart << "RESPMOD Xaction::noteVbContentAvailable : chunk was size: " << chunk.size() << std::endl;
+	if (!hostx) {
+		return; // stopped meanwhile
+	}
+	try {
+		try {
+			service->checkExchange(*backend, *exchange);
+		} catch (const Timeout &timeout) {
+			if (timedOut(timeout)) {
+				return;
+			}
+			throw;
+		}
+		if (exchange->reply.kind == Reply::rkRespmodHeaders) {
+			exchangeDone = exchange->reply.clean();
+			applyHeadersReply(exchange->reply);
+			return;
+		}
+		bodyReplyReady = true;
+		if (receivingVb != opOn || scanCut) {
+			exchangeDone = exchange->reply.clean();
+			applyBodyReply(exchange->reply);
+		}
+		// else ecapguardian made up its mind before getting the whole body;
+		// pumpVb() applies the verdict once the host is done with the body
+	} catch (const std::exception &e) {
+		// there is no host call on the stack to catch this, so abort the transaction here
+		service->logger.log(Logger::llError, logFile.id(), std::string("RESPMOD Xaction::noteExchangeReady : ") + e.what());
+		if (hostx) {
+			lastHostCall()->adaptationAborted();
+		}
 	}
-	buffer += chunk;
-	hostx->vbContentShift(vb.size); // 'shift' means 'delete' since we have a copy
+}
 
-	size_t vb_chunk_written = 0;
-        do {
-                ssize_t s = write(socketHandle, chunk.c_str() + vb_chunk_written, chunk.size() - vb_chunk_written);
-                vb_chunk_written = vb_chunk_written + s;
-		if(debug) {
-		        logFile << logStart << "RESPMOD Xaction::noteVbContentAvailable : Wrote " << s << " bytes out of " << chunk.size() << " bytes total in chunk, "
-        	                 << vb_chunk_written << " written in total" << std::endl;
+// Called from Service::resume() when the event loop caught up with the body
+void Adapter::Xaction::noteExchangeDrained() {
+	if (!hostx || receivingVb != opOn) {
+		return;
+	}
+	waitingForDrain = false;
+	try {
+		pumpVb();
+		if (!waitingForDrain && !vbDone) {
+			hostx->vbMakeMore(); // we are ready for more
+		}
+	} catch (const std::exception &e) {
+		service->logger.log(Logger::llError, logFile.id(), std::string("RESPMOD Xaction::noteExchangeDrained : ") + e.what());
+		if (hostx) {
+			lastHostCall()->adaptationAborted();
 		}
-        } while (vb_chunk_written < chunk.size());
-	if(debug) {
-		logFile << logStart << "RESPMOD Xaction::noteVbContentAvailable : Finished writing this chunk" << std::endl;
 	}
 }
 
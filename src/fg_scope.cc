@@ -0,0 +1,141 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <libecap/common/errors.h>
+
+#include "fg_scope.h"
+
+Adapter::AffixTrie::AffixTrie(bool aSuffixes): nodes(1), suffixes(aSuffixes) {
+}
+
+void Adapter::AffixTrie::add(const std::string &affix) {
+	size_t node = 0;
+	for (size_t i = 0; i < affix.size(); ++i) {
+		const char c = suffixes ? affix[affix.size() - 1 - i] : affix[i];
+		std::map<char, size_t>::const_iterator next = nodes[node].next.find(c);
+		if (next == nodes[node].next.end()) {
+			nodes.push_back(Node());
+			nodes[node].next[c] = nodes.size() - 1;
+			node = nodes.size() - 1;
+		} else {
+			node = next->second;
+		}
+	}
+	nodes[node].terminal = true;
+}
+
+void Adapter::AffixTrie::clear() {
+	nodes.assign(1, Node());
+}
+
+bool Adapter::AffixTrie::matches(const char *text, size_t size) const {
+	size_t node = 0;
+	for (size_t i = 0; i < size; ++i) {
+		if (nodes[node].terminal) {
+			return true;
+		}
+		const char c = suffixes ? text[size - 1 - i] : text[i];
+		std::map<char, size_t>::const_iterator next = nodes[node].next.find(c);
+		if (next == nodes[node].next.end()) {
+			return false;
+		}
+		node = next->second;
+	}
+	return nodes[node].terminal;
+}
+
+Adapter::UrlScope::UrlScope() {
+}
+
+Adapter::UrlScope::~UrlScope() {
+	clear();
+}
+
+bool Adapter::UrlScope::setOne(const libecap::Name &name, const std::string &value) {
+	const std::string image = name.image();
+	if (image.compare(0, 10, "scope_url_") == 0) {
+		return setOne(allow, image.substr(10), value);
+	}
+	if (image.compare(0, 9, "skip_url_") == 0) {
+		return setOne(skip, image.substr(9), value);
+	}
+	return false;
+}
+
+bool Adapter::UrlScope::setOne(Rules &rules, const std::string &kind, const std::string &value) {
+	if (kind == "prefixes" || kind == "suffixes") {
+		AffixTrie &trie = kind == "prefixes" ? rules.prefixes : rules.suffixes;
+		std::string item;
+		for (size_t i = 0; i <= value.size(); ++i) {
+			if (i == value.size() || value[i] == ',') {
+				if (!item.empty()) {
+					trie.add(item);
+				}
+				item.clear();
+			} else if (value[i] != ' ' && value[i] != '\t') {
+				item += value[i];
+			}
+		}
+		return true;
+	}
+	if (kind == "regex") {
+		rules.regexSource = value;
+		return true;
+	}
+	return false;
+}
+
+void Adapter::UrlScope::compile(const std::string &errorPrefix) {
+	compile(allow, errorPrefix);
+	compile(skip, errorPrefix);
+}
+
+void Adapter::UrlScope::compile(Rules &rules, const std::string &errorPrefix) {
+	if (rules.regexSet) {
+		regfree(&rules.regex);
+		rules.regexSet = false;
+	}
+	if (rules.regexSource.empty()) {
+		return;
+	}
+	const int error = regcomp(&rules.regex, rules.regexSource.c_str(), REG_EXTENDED | REG_NOSUB);
+	if (error) {
+		char message[256];
+		regerror(error, &rules.regex, message, sizeof(message));
+		throw libecap::TextException(errorPrefix + "bad URL regex '" + rules.regexSource + "': " + message);
+	}
+	rules.regexSet = true;
+}
+
+void Adapter::UrlScope::clear() {
+	clear(allow);
+	clear(skip);
+}
+
+void Adapter::UrlScope::clear(Rules &rules) {
+	rules.prefixes.clear();
+	rules.suffixes.clear();
+	rules.regexSource.clear();
+	if (rules.regexSet) {
+		regfree(&rules.regex);
+		rules.regexSet = false;
+	}
+}
+
+bool Adapter::UrlScope::Rules::matches(const char *url) const {
+	const size_t size = strlen(url);
+	const size_t path = strcspn(url, "?"); // suffixes ignore the query
+	return prefixes.matches(url, size) || suffixes.matches(url, path) ||
+		(regexSet && regexec(&regex, url, 0, 0, 0) == 0);
+}
+
+bool Adapter::UrlScope::wants(const char *url) const {
+	if (!allow.empty() && !allow.matches(url)) {
+		return false;
+	}
+	return skip.empty() || !skip.matches(url);
+}
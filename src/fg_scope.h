@@ -0,0 +1,88 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_SCOPE_H
+#define FG_SCOPE_H
+
+#include <regex.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <libecap/common/forward.h>
+#include <libecap/common/name.h>
+
+namespace Adapter {
+
+// A set of strings compiled into a trie, answering "does any of them start
+// (or end) the text" in one pass over the text, however many there are.
+class AffixTrie {
+	public:
+		explicit AffixTrie(bool suffixes = false);
+
+		void add(const std::string &affix);
+		void clear();
+		bool empty() const { return nodes.size() == 1; }
+
+		// whether one of the strings is a prefix (suffix) of text
+		bool matches(const char *text, size_t size) const;
+		bool matches(const std::string &text) const { return matches(text.data(), text.size()); }
+
+	private:
+		struct Node {
+			Node(): terminal(false) {}
+			std::map<char, size_t> next; // child index by character
+			bool terminal; // a string ends here
+		};
+
+		std::vector<Node> nodes; // nodes[0] is the root
+		bool suffixes; // strings are stored and matched back to front
+};
+
+// Which URLs an adapter wants to see (Service::wantsUrl), from the
+// scope_url_* (allow) and skip_url_* (deny) options. A URL is wanted when it
+// matches some allow rule, or there are none, and no skip rule.
+//
+// Prefix and suffix lists are comma separated and matched case-sensitively,
+// suffixes against the URL without its query string; the regex options take
+// one POSIX extended regex each. Everything is
+// compiled when the configuration is done, not per transaction.
+class UrlScope {
+	public:
+		UrlScope();
+		~UrlScope();
+
+		// takes the option if it is one of ours
+		bool setOne(const libecap::Name &name, const std::string &value);
+		// builds the matchers; throws libecap::TextException on a bad regex
+		void compile(const std::string &errorPrefix);
+		void clear();
+
+		bool wants(const char *url) const;
+
+	private:
+		struct Rules {
+			Rules(): suffixes(true), regexSet(false) {}
+			AffixTrie prefixes;
+			AffixTrie suffixes;
+			std::string regexSource;
+			regex_t regex;
+			bool regexSet; // regex is compiled
+			bool empty() const { return prefixes.empty() && suffixes.empty() && !regexSet; }
+			bool matches(const char *url) const;
+		};
+
+		static bool setOne(Rules &rules, const std::string &kind, const std::string &value);
+		static void compile(Rules &rules, const std::string &errorPrefix);
+		static void clear(Rules &rules);
+
+		Rules allow;
+		Rules skip;
+
+		UrlScope(const UrlScope &); // not implemented
+		UrlScope &operator =(const UrlScope &); // not implemented
+};
+
+} // namespace Adapter
+
+#endif
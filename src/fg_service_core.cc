@@ -0,0 +1,520 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include <libecap/common/errors.h>
+#include <libecap/common/names.h>
+#include <libecap/host/xaction.h>
+
+#include "fg_config.h"
+#include "fg_service_core.h"
+
+Adapter::ServiceCore::ServiceCore(const std::string &aMode):
+	mode(aMode),
+	cfgErrorPrefix("FilterGizmo " + aMode + " Adapter: configuration error: "),
+	runErrorPrefix("FilterGizmo " + aMode + " Adapter: Runtime Error: "),
+	lastCorrelationId(0) {
+	resetOptions();
+}
+
+Adapter::ServiceCore::FallbackAction Adapter::ServiceCore::parseFallback(const libecap::Name &name, const std::string &value) const {
+	if (value == "error") {
+		return faError;
+	} else if (value == "bypass") {
+		return faBypass;
+	} else if (value == "block") {
+		return faBlock;
+	}
+	throw libecap::TextException(cfgErrorPrefix +
+		name.image() + " expects error, bypass or block, got '" + value + "'");
+}
+
+std::string Adapter::ServiceCore::lowerMode() const {
+	std::string lower = mode;
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	return lower;
+}
+
+void Adapter::ServiceCore::resetOptions() {
+	ecapguardian_listen_socket.clear();
+	balance = Balancer::bmLeastOutstanding;
+	pool_min_size = 0;
+	pool_max_size = 0;
+	pool_idle_timeout = 60;
+	protocol_version = PROTOCOL_V1;
+	read_buffer_size = 64*1024;
+	max_reply_size = Reply::DEFAULT_MAX_SIZE;
+	connect_timeout = 5000;
+	verdict_timeout = 0;
+	body_timeout = 0;
+	timeout_action = faError;
+	breaker_failures = 0;
+	breaker_slow = 0;
+	breaker_probe_interval = 1000;
+	breaker_action = faBypass;
+	correlation_option.clear();
+	no_acks = true;
+	urlScope.clear();
+	async_verdicts = false;
+	async_resume_delay = 1;
+	multiplex = false;
+	multiplex_connections = 2;
+	stats_socket.clear();
+	stats_file.clear();
+	stats_interval = 10;
+	log_file = "/tmp/fg_" + lowerMode() + ".log";
+	log_level = Logger::llNone;
+	log_json = false;
+	log_sample_rate = 1;
+	log_queue_size = 8192;
+}
+
+bool Adapter::ServiceCore::setOne(const libecap::Name &name, const std::string &value) {
+	if (name == "ecapguardian_listen_socket"){
+		if (value.empty()) {
+			throw libecap::TextException(cfgErrorPrefix +
+				"empty ecapguardian_listen_socket value is not allowed");
+		}
+		// a comma separated list, and the option may be repeated
+		const std::vector<std::string> paths = ParseList(value, false);
+		ecapguardian_listen_socket.insert(ecapguardian_listen_socket.end(), paths.begin(), paths.end());
+	} else if(name == "balance") {
+		if (value == "least_outstanding") {
+			balance = Balancer::bmLeastOutstanding;
+		} else if (value == "two_choices") {
+			balance = Balancer::bmTwoChoices;
+		} else if (value == "client_ip") {
+			balance = Balancer::bmClientIp;
+		} else {
+			throw libecap::TextException(cfgErrorPrefix +
+				"balance expects least_outstanding, two_choices or client_ip, got '" + value + "'");
+		}
+	} else if(name == "debug") {
+		log_level = Logger::llDebug;
+	} else if(name == "log_level") {
+		if (!Logger::ParseLevel(value, log_level)) {
+			throw libecap::TextException(cfgErrorPrefix +
+				"log_level expects none, error, info or debug, got '" + value + "'");
+		}
+	} else if(name == "log_file") {
+		log_file = value;
+	} else if(name == "log_format") {
+		if (value != "text" && value != "json") {
+			throw libecap::TextException(cfgErrorPrefix +
+				"log_format expects text or json, got '" + value + "'");
+		}
+		log_json = value == "json";
+	} else if(name == "log_sample_rate") {
+		log_sample_rate = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "log_queue_size") {
+		log_queue_size = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "pool_min_size") {
+		pool_min_size = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "pool_max_size") {
+		pool_max_size = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "pool_idle_timeout") {
+		pool_idle_timeout = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "protocol_version") {
+		protocol_version = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "read_buffer_size") {
+		read_buffer_size = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "max_reply_size") {
+		max_reply_size = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "connect_timeout") {
+		connect_timeout = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "verdict_timeout") {
+		verdict_timeout = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "body_timeout") {
+		body_timeout = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "timeout_action") {
+		timeout_action = parseFallback(name, value);
+	} else if(name == "breaker_failures") {
+		breaker_failures = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "breaker_slow") {
+		breaker_slow = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "breaker_probe_interval") {
+		breaker_probe_interval = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "breaker_action") {
+		breaker_action = parseFallback(name, value);
+	} else if(name == "correlation_option") {
+		correlation_option = value;
+	} else if(name == "no_acks") {
+		no_acks = ParseBool(cfgErrorPrefix, name, value);
+	} else if(name == "async_verdicts") {
+		async_verdicts = ParseBool(cfgErrorPrefix, name, value);
+	} else if(name == "async_resume_delay") {
+		async_resume_delay = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "multiplex") {
+		multiplex = ParseBool(cfgErrorPrefix, name, value);
+	} else if(name == "multiplex_connections") {
+		multiplex_connections = ParseSize(cfgErrorPrefix, name, value);
+	} else if(name == "stats_socket") {
+		stats_socket = value;
+	} else if(name == "stats_file") {
+		stats_file = value;
+	} else if(name == "stats_interval") {
+		stats_interval = ParseSize(cfgErrorPrefix, name, value);
+	} else if(urlScope.setOne(name, value)) {
+		; // a URL scoping rule
+	} else {
+		return false;
+	}
+	return true;
+}
+
+void Adapter::ServiceCore::applyOptions() {
+	if (pool_min_size > pool_max_size) {
+		throw libecap::TextException(cfgErrorPrefix +
+			"pool_min_size must not exceed pool_max_size");
+	}
+	if (protocol_version < PROTOCOL_V1 || protocol_version > PROTOCOL_V2) {
+		throw libecap::TextException(cfgErrorPrefix +
+			"protocol_version must be 1 or 2");
+	}
+	if (read_buffer_size < 512) {
+		throw libecap::TextException(cfgErrorPrefix +
+			"read_buffer_size must be at least 512");
+	}
+	if (breaker_probe_interval < 1 || breaker_probe_interval > INT_MAX) {
+		throw libecap::TextException(cfgErrorPrefix +
+			"breaker_probe_interval must be between 1 and " + std::to_string(INT_MAX));
+	}
+	if (max_reply_size < 1024) {
+		throw libecap::TextException(cfgErrorPrefix +
+			"max_reply_size must be at least 1024");
+	}
+	if (!correlation_option.empty() && protocol_version < PROTOCOL_V2) {
+		throw libecap::TextException(cfgErrorPrefix +
+			"correlation_option needs protocol_version 2");
+	}
+	if (multiplex && (protocol_version < PROTOCOL_V2 || !async_verdicts)) {
+		throw libecap::TextException(cfgErrorPrefix +
+			"multiplex needs protocol_version 2 and async_verdicts");
+	}
+	if (multiplex_connections < 1) {
+		throw libecap::TextException(cfgErrorPrefix +
+			"multiplex_connections must be at least 1");
+	}
+	if (connect_timeout > INT_MAX || verdict_timeout > INT_MAX || body_timeout > INT_MAX) {
+		throw libecap::TextException(cfgErrorPrefix +
+			"connect_timeout, verdict_timeout and body_timeout must be at most " + std::to_string(INT_MAX));
+	}
+	urlScope.compile(cfgErrorPrefix);
+	// after the fork, in every Squid worker
+	correlationPrefix = std::to_string(getpid()) + "." + std::to_string(time(NULL)) + ".";
+	// fresh backends, started (if the old ones ran) once configured
+	const bool running = balancer.running();
+	balancer.configure(ecapguardian_listen_socket, balance);
+	const std::vector<Balancer::Pointer> &backends = balancer.backends();
+	std::string socketList;
+	for (size_t i = 0; i < backends.size(); ++i) {
+		Backend *backend = backends[i].get();
+		backend->pool.configure(backend->socketPath, pool_min_size, pool_max_size, pool_idle_timeout, async_verdicts,
+			protocol_version, offeredFeatures(), connect_timeout, verdict_timeout, body_timeout);
+		backend->breaker.configure(breaker_failures, breaker_slow * 1000, breaker_probe_interval,
+			[backend]() { return backend->pool.probe(); }, &metrics);
+		socketList += (i ? "," : "") + backend->socketPath;
+	}
+	if (running) {
+		balancer.start();
+	}
+	readBuffer.assign(read_buffer_size, 0);
+	loop.configure(read_buffer_size, verdict_timeout, body_timeout, &logger, runErrorPrefix);
+	if (!async_verdicts) {
+		loop.stop();
+	}
+	stats.configure(&metrics, "adapter=\"" + lowerMode() + "\"", stats_socket, stats_file, stats_interval);
+	logger.configure(log_file, log_level, log_json, log_sample_rate, log_queue_size);
+	logger.log(Logger::llInfo, 0, mode + " service configured, ecapguardian_listen_socket=" + socketList +
+		", protocol_version=" + std::to_string(protocol_version) + ", async_verdicts=" + (async_verdicts ? "on" : "off") +
+		", multiplex=" + (multiplex ? "on" : "off"));
+}
+
+void Adapter::ServiceCore::startThreads() {
+	balancer.start();
+	stats.start();
+	logger.start();
+}
+
+void Adapter::ServiceCore::stopThreads() {
+	loop.stop();
+	balancer.stop();
+	stats.stop();
+	logger.stop();
+}
+
+// The host is about to sleep for up to 'timeout'. The event loop cannot wake
+// it up, so keep the nap short while body transfers or verdicts are pending.
+void Adapter::ServiceCore::shortenNap(timeval &timeout) const {
+	if (!async_verdicts || !loop.busy()) {
+		return;
+	}
+	const long delay = async_resume_delay * 1000; // microseconds
+	if (timeout.tv_sec > 0 || timeout.tv_usec > delay) {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = delay;
+	}
+}
+
+// Tells the transactions what the event loop finished since the last call
+void Adapter::ServiceCore::notifyClients() const {
+	std::vector<ExchangePointer> drained;
+	std::vector<ExchangePointer> done;
+	loop.takeReady(drained, done);
+	// checked one by one: an earlier notification may have destroyed a later transaction
+	for (std::vector<ExchangePointer>::iterator i = drained.begin(); i != drained.end(); ++i) {
+		if (AsyncClient *client = (*i)->client) {
+			client->noteExchangeDrained();
+		}
+	}
+	for (std::vector<ExchangePointer>::iterator i = done.begin(); i != done.end(); ++i) {
+		if (AsyncClient *client = (*i)->client) {
+			client->noteExchangeReady();
+		}
+	}
+}
+
+uint32_t Adapter::ServiceCore::offeredFeatures() const {
+	return (correlation_option.empty() ? 0 : FEATURE_CORRELATION) | (multiplex ? FEATURE_MULTIPLEX : 0) |
+		(no_acks ? FEATURE_NO_ACKS : 0) | (mode == "RESPMOD" ? FEATURE_SCAN_HINTS : 0);
+}
+
+// "<pid>.<start time>.<counter>": ecapguardian serves all the Squid workers
+std::string Adapter::ServiceCore::newCorrelationId() const {
+	return correlationPrefix + std::to_string(lastCorrelationId.fetch_add(1, std::memory_order_relaxed) + 1);
+}
+
+Adapter::Balancer::Pointer Adapter::ServiceCore::pickBackend(libecap::host::Xaction &hostx) const {
+	if (!balancer.byClientIp()) {
+		return balancer.pick(std::string());
+	}
+	const libecap::Area clientIp = hostx.option(libecap::metaClientIp);
+	return balancer.pick(clientIp.toString());
+}
+
+// A stream on a multiplexed connection, a pooled connection if there is one
+// idle, a new one otherwise
+int Adapter::ServiceCore::checkout(Balancer::Pointer &backend, int &protocolVersion, uint32_t &protocolFeatures,
+	ChannelPointer &channel, uint32_t &stream) const {
+	const uint64_t connectStart = MonotonicMicros();
+	const size_t first = backend->index;
+	for (size_t tried = 1; ; ++tried) {
+		if (multiplex && (channel = openStream(*backend, stream))) {
+			backend->outstanding.fetch_add(1, std::memory_order_relaxed);
+			metrics.connect.record(MonotonicMicros() - connectStart);
+			protocolVersion = PROTOCOL_V2;
+			protocolFeatures = channel->features;
+			return channel->socketHandle;
+		}
+		const int socket = backend->pool.checkout(protocolVersion, protocolFeatures);
+		if (socket >= 0) {
+			if (protocolFeatures & FEATURE_MULTIPLEX) {
+				// a new channel; it never goes back to the pool
+				channel.reset(new Channel(socket, protocolFeatures, &metrics));
+				try {
+					loop.attach(channel);
+				} catch (...) {
+					channel.reset(); // closes the socket
+					throw;
+				}
+				backend->channels.push_back(channel);
+				++channel->load;
+				stream = channel->newStream();
+			}
+			backend->outstanding.fetch_add(1, std::memory_order_relaxed);
+			metrics.connect.record(MonotonicMicros() - connectStart);
+			return socket;
+		}
+		const int savedErrno = errno;
+		metrics.connectFailures.fetch_add(1, std::memory_order_relaxed);
+		backend->breaker.failure();
+		// another backend may do, but not one that failed for this transaction already
+		const Balancer::Pointer next = tried < balancer.backends().size() ? balancer.next(*backend) : Balancer::Pointer();
+		if (next && next->index != first) {
+			backend = next;
+			continue;
+		}
+		if (savedErrno == ETIMEDOUT) {
+			throw Timeout(runErrorPrefix + "Timed out connecting to ecapguardian_listen_socket '" +
+				backend->socketPath + "' after connect_timeout=" + std::to_string(connect_timeout) + "ms", Metrics::phConnect);
+		}
+		throw libecap::TextException(runErrorPrefix + "Failed to connect to ecapguardian_listen_socket '" +
+			backend->socketPath + "'. errno: " + strerror(savedErrno));
+	}
+}
+
+// The least loaded channel of backend that is not broken, with a new stream
+// open on it; null when a new channel should be connected first
+Adapter::ChannelPointer Adapter::ServiceCore::openStream(Backend &backend, uint32_t &stream) const {
+	std::vector<ChannelPointer> &channels = backend.channels;
+	ChannelPointer best;
+	for (std::vector<ChannelPointer>::iterator i = channels.begin(); i != channels.end();) {
+		if ((*i)->broken) {
+			i = channels.erase(i);
+			continue;
+		}
+		if (!best || (*i)->load < best->load) {
+			best = *i;
+		}
+		++i;
+	}
+	// busy channels get company until there are multiplex_connections
+	if (!best || (best->load && channels.size() < multiplex_connections)) {
+		return ChannelPointer();
+	}
+	++best->load;
+	stream = best->newStream();
+	return best;
+}
+
+void Adapter::ServiceCore::release(const Balancer::Pointer &backend, int socket, int protocolVersion, uint32_t protocolFeatures, bool reusable,
+	const ChannelPointer &channel, uint32_t stream) const {
+	if (!backend || socket < 0) {
+		return;
+	}
+	backend->outstanding.fetch_sub(1, std::memory_order_relaxed);
+	if (channel) {
+		loop.closeStream(channel, stream, reusable);
+		return;
+	}
+	backend->pool.release(socket, protocolVersion, protocolFeatures, reusable);
+}
+
+// Blocking read of the whole ecapguardian reply, acknowledging the
+// verdict, header and body parts as ecapguardian expects. A v2 header or
+// body is read straight into the reply, as much at a time as the socket has.
+bool Adapter::ServiceCore::readReply(Backend &backend, int socket, Reply &reply, std::ostream *trace) const {
+	bool acksSent = true;
+	while (!reply.complete()) {
+		if (reply.needsAck()) {
+			acksSent = write(socket, reply.ack().data(), reply.ack().size()) == static_cast<ssize_t>(reply.ack().size()) && acksSent;
+			metrics.bytesSent.fetch_add(reply.ack().size(), std::memory_order_relaxed);
+			if (trace) {
+				*trace << logStart << mode << " readReply : wrote the ack" << std::endl;
+			}
+			reply.acked();
+			continue;
+		}
+		const ssize_t s = ReadInto(socket, reply, &readBuffer[0], readBuffer.size());
+		if (s > 0) {
+			metrics.bytesReceived.fetch_add(s, std::memory_order_relaxed);
+		}
+		if (trace) {
+			*trace << logStart << mode << " readReply : Read " << s << " reply bytes" << std::endl;
+		}
+		if (s <= 0 || reply.failed()) {
+			const int savedErrno = errno;
+			backend.breaker.failure();
+			errno = savedErrno;
+		}
+		if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			throw Timeout(runErrorPrefix + "No reply from ecapguardian for verdict_timeout=" +
+				std::to_string(verdict_timeout) + "ms", Metrics::phVerdict);
+		}
+		if (s <= 0) {
+			throw libecap::TextException(runErrorPrefix + "ecapguardian reply ended early, read returned " + std::to_string(s) +
+				(s < 0 ? std::string(". errno: ") + strerror(errno) : std::string()));
+		}
+		if (reply.failed()) {
+			throw libecap::TextException(runErrorPrefix + reply.error);
+		}
+	}
+	return acksSent;
+}
+
+void Adapter::ServiceCore::checkWritten(Backend &backend, ssize_t sent, size_t expected, const std::string &name) const {
+	if (sent < 0 || static_cast<size_t>(sent) != expected) {
+		const int savedErrno = errno;
+		backend.breaker.failure();
+		errno = savedErrno;
+	}
+	if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		throw Timeout(runErrorPrefix + "ecapguardian took no '" + name + "' data for body_timeout=" +
+			std::to_string(body_timeout) + "ms", Metrics::phBody);
+	}
+	if (sent < 0) {
+		throw libecap::TextException(runErrorPrefix + "errno on '" + name + "' write to ecapguardian. errno: " + strerror(errno));
+	}
+	if (static_cast<size_t>(sent) != expected) {
+		throw libecap::TextException(runErrorPrefix + "Failed '" + name + "' write to ecapguardian. Wrote "
+			+ std::to_string(sent) + " instead of " + std::to_string(expected));
+	}
+}
+
+// Blocking write of all the buffers, however many writev() calls it takes;
+// the iovecs are advanced past what was written
+void Adapter::ServiceCore::writeAll(Backend &backend, int socket, struct iovec *iov, int iovcnt, const std::string &name, std::ostream *trace) const {
+	const size_t total = IovSize(iov, iovcnt);
+	size_t written = 0;
+	while (written < total) {
+		ssize_t s = writev(socket, iov, iovcnt);
+		if (s < 0) {
+			checkWritten(backend, s, total - written, name);
+		}
+		metrics.bytesSent.fetch_add(s, std::memory_order_relaxed);
+		written += s;
+		if (trace) {
+			*trace << logStart << mode << " writeAll : Wrote " << s << " bytes out of " << total << " bytes total of "
+				<< name << ", " << written << " written in total" << std::endl;
+		}
+		while (iovcnt > 0 && static_cast<size_t>(s) >= iov->iov_len) {
+			s -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = static_cast<char*>(iov->iov_base) + s;
+			iov->iov_len -= s;
+		}
+	}
+}
+
+void Adapter::ServiceCore::checkExchange(Backend &backend, const AsyncExchange &x) const {
+	if (x.error || x.reply.failed()) {
+		backend.breaker.failure();
+	}
+	if (x.error == ETIMEDOUT) {
+		if (x.stalledIn == Metrics::phBody) {
+			throw Timeout(runErrorPrefix + "ecapguardian took no data for body_timeout=" +
+				std::to_string(body_timeout) + "ms", Metrics::phBody);
+		}
+		throw Timeout(runErrorPrefix + "No reply from ecapguardian for verdict_timeout=" +
+			std::to_string(verdict_timeout) + "ms", Metrics::phVerdict);
+	}
+	if (x.error) {
+		throw libecap::TextException(runErrorPrefix + "ecapguardian exchange failed. errno: " +
+			(x.error < 0 ? std::string("EOF") : std::string(strerror(x.error))));
+	}
+	if (x.reply.failed()) {
+		throw libecap::TextException(runErrorPrefix + x.reply.error);
+	}
+}
+
+void Adapter::ServiceCore::noteRoundTrip(Backend &backend, uint64_t micros) const {
+	metrics.headerRoundTrip.record(micros);
+	backend.breaker.success(micros);
+}
+
+void Adapter::ServiceCore::noteTimeout(const Timeout &timeout, uint64_t xaction) const {
+	static const char *const ACTIONS[] = { "error", "bypass", "block" };
+	metrics.timeout(timeout.phase);
+	logger.log(Logger::llError, xaction, std::string(timeout.what()) + ", timeout_action=" + ACTIONS[timeout_action]);
+}
+
+void Adapter::ForbiddenPage(const std::string &reason, std::string &header, std::string &body) {
+	body = "<html><head><title>Blocked</title></head><body><h1>Blocked</h1><p>" +
+		reason + "</p></body></html>\n";
+	header = "HTTP/1.1 403 Forbidden\r\n"
+		"Content-Type: text/html\r\n"
+		"Content-Length: " + std::to_string(body.size()) + "\r\n"
+		"Cache-Control: no-store\r\n"
+		"\r\n";
+}
@@ -0,0 +1,215 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_SERVICE_CORE_H
+#define FG_SERVICE_CORE_H
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <libecap/common/area.h>
+#include <libecap/common/errors.h>
+#include <libecap/common/name.h>
+#include <libecap/common/named_values.h>
+#include <libecap/common/forward.h>
+
+#include "fg_balancer.h"
+#include "fg_circuit_breaker.h"
+#include "fg_connection_pool.h"
+#include "fg_event_loop.h"
+#include "fg_logger.h"
+#include "fg_metrics.h"
+#include "fg_protocol.h"
+#include "fg_reply.h"
+#include "fg_scope.h"
+
+namespace Adapter {
+
+using libecap::size_type;
+
+// Thrown when ecapguardian made no progress for connect_timeout,
+// verdict_timeout or body_timeout; the adapter then applies timeout_action
+class Timeout: public libecap::TextException {
+	public:
+		Timeout(const std::string &message, Metrics::Phase aPhase):
+			libecap::TextException(message), phase(aPhase) {}
+
+		Metrics::Phase phase;
+};
+
+// The header and body of the 403 page the adapters serve on their own
+// account (oversize_action=block, timeout_action=block)
+void ForbiddenPage(const std::string &reason, std::string &header, std::string &body);
+
+// The part of an adapter Service that does not depend on the vectoring
+// point: the ecapguardian connections, the event loop, the instrumentation
+// and the trace log, the options that tune them, and the blocking I/O the
+// transactions do over those connections. Built into libfg_core together
+// with the rest of the engine and linked into both adapters, so they share
+// one I/O stack.
+class ServiceCore {
+	public:
+		// mode is "REQMOD" or "RESPMOD"; it goes into error messages and
+		// picks the default log_file and the stats label
+		explicit ServiceCore(const std::string &aMode);
+
+		// Configuration: setOne() returns false for options it does not know,
+		// which the adapter then handles or rejects
+		bool setOne(const libecap::Name &name, const std::string &value);
+		void resetOptions(); // back to the defaults, before reconfiguring
+		void applyOptions(); // checks and applies what setOne() collected
+
+		// Lifecycle of the pool, event loop, stats and logger threads
+		void startThreads();
+		void stopThreads();
+
+		// Asynchronous transactions (async_verdicts)
+		void shortenNap(timeval &timeout) const; // for Service::suspend()
+		void notifyClients() const; // for Service::resume()
+
+		// The backend for a new transaction, null while all their circuit
+		// breakers are open
+		Balancer::Pointer pickBackend(libecap::host::Xaction &hostx) const;
+
+		// Blocking exchanges; trace, when not null, gets debug lines.
+		// All throw libecap::TextException (starting with runErrorPrefix),
+		// or Timeout when the socket timeouts expire. Failures count
+		// against the backend's circuit breaker.
+		// checkout() returns a connected socket; if backend cannot be
+		// reached it moves on to the next healthy one. With multiplex it
+		// opens a stream on one of the backend's channels instead, and the
+		// socket is the channel's, which only the event loop writes to.
+		int checkout(Balancer::Pointer &backend, int &protocolVersion, uint32_t &protocolFeatures,
+			ChannelPointer &channel, uint32_t &stream) const;
+		// closes the socket, or keeps it for the next transaction; closes
+		// the stream on a channel
+		void release(const Balancer::Pointer &backend, int socket, int protocolVersion, uint32_t protocolFeatures, bool reusable,
+			const ChannelPointer &channel, uint32_t stream) const;
+		bool readReply(Backend &backend, int socket, Reply &reply, std::ostream *trace) const; // false if an ack failed
+		void writeAll(Backend &backend, int socket, struct iovec *iov, int iovcnt, const std::string &name, std::ostream *trace) const;
+		void checkWritten(Backend &backend, ssize_t sent, size_t expected, const std::string &name) const;
+		// the same for an exchange the event loop finished
+		void checkExchange(Backend &backend, const AsyncExchange &x) const;
+		// counts and logs a Timeout before the adapter applies timeout_action
+		void noteTimeout(const Timeout &timeout, uint64_t xaction) const;
+
+		const std::string mode;
+		const std::string cfgErrorPrefix;
+		const std::string runErrorPrefix;
+
+		// one path per ecapguardian backend, and how transactions are spread
+		// over them (balance=least_outstanding|two_choices|client_ip)
+		std::vector<std::string> ecapguardian_listen_socket;
+		Balancer::Method balance;
+		mutable Balancer balancer; // transactions only see a const Service
+
+		// persistent ecapguardian connections, per backend (off unless
+		// pool_max_size is set)
+		size_type pool_min_size;
+		size_type pool_max_size;
+		size_type pool_idle_timeout; // seconds
+
+		// the scope_url_* and skip_url_* rules for wantsUrl()
+		UrlScope urlScope;
+
+		// highest wire protocol version to offer ecapguardian, see fg_protocol.h
+		size_type protocol_version;
+
+		// bytes read from ecapguardian at a time, on top of the frame
+		// payloads that v2 reads straight into place
+		size_type read_buffer_size;
+
+		// what becomes of a transaction that cannot have its verdict:
+		// it fails, goes on unscanned, or gets a block page
+		typedef enum { faError, faBypass, faBlock } FallbackAction;
+
+		// milliseconds without progress before giving up on ecapguardian
+		// (0: never), and what becomes of the transaction then
+		size_type connect_timeout; // connect() and the hello
+		size_type verdict_timeout; // waiting for a reply
+		size_type body_timeout; // writing headers and bodies
+		FallbackAction timeout_action;
+
+		// stop asking a backend after breaker_failures failures in a row
+		// (0: never) until a probe gets through again, see fg_circuit_breaker.h
+		size_type breaker_failures;
+		size_type breaker_slow; // milliseconds; a slower verdict counts as a failure (0: none)
+		size_type breaker_probe_interval; // milliseconds
+		FallbackAction breaker_action; // for transactions while all breakers are open
+		// a verdict came from backend, this long after the header went
+		void noteRoundTrip(Backend &backend, uint64_t micros) const;
+
+		// biggest header or body ecapguardian may send back; the reply
+		// fails beyond it, whatever length a v2 frame announces
+		size_type max_reply_size;
+
+		// offer FEATURE_NO_ACKS, so that v2 replies come without ack round trips
+		bool no_acks;
+		// whether replies on a connection with these features are acked
+		static bool Acks(uint32_t protocolFeatures) {
+			return !(protocolFeatures & (FEATURE_NO_ACKS | FEATURE_MULTIPLEX));
+		}
+
+		// the transaction option (Squid: adaptation_masterx_shared_names)
+		// that carries a REQMOD correlation ID over to RESPMOD; empty: off
+		std::string correlation_option;
+		uint32_t offeredFeatures() const; // FEATURE_* bits for the hello
+		std::string newCorrelationId() const; // unique across workers and restarts
+
+		// wait for verdicts on the event loop thread instead of blocking the host
+		bool async_verdicts;
+		size_type async_resume_delay; // milliseconds, see shortenNap()
+		mutable EventLoop loop;
+
+		// run the transactions as streams over up to multiplex_connections
+		// shared connections per backend (FEATURE_MULTIPLEX); needs
+		// async_verdicts and protocol_version 2
+		bool multiplex;
+		size_type multiplex_connections;
+
+		// instrumentation, published by stats_socket and/or stats_file
+		std::string stats_socket;
+		std::string stats_file;
+		size_type stats_interval; // seconds between stats_file updates
+		mutable Metrics metrics;
+		StatsExporter stats;
+
+		// trace log, see fg_logger.h; the debug option means log_level=debug
+		std::string log_file;
+		Logger::Level log_level;
+		bool log_json; // log_format=json
+		size_type log_sample_rate; // trace one in this many transactions
+		size_type log_queue_size; // records
+		mutable Logger logger;
+
+	private:
+		std::string lowerMode() const; // "reqmod" or "respmod"
+		ChannelPointer openStream(Backend &backend, uint32_t &stream) const;
+		FallbackAction parseFallback(const libecap::Name &name, const std::string &value) const;
+
+		std::string correlationPrefix; // process ID and start time
+		mutable std::atomic<uint64_t> lastCorrelationId;
+		mutable std::vector<char> readBuffer; // read_buffer_size, for readReply() on the host thread
+};
+
+
+// Calls setOne() of the adapter Service for each host-provided
+// configuration option. See Service::configure().
+template <class Configurable>
+class Cfgtor: public libecap::NamedValueVisitor {
+	public:
+		Cfgtor(Configurable &aSvc): svc(aSvc) {}
+		virtual void visit(const libecap::Name &name, const libecap::Area &value) {
+			svc.setOne(name, value);
+		}
+		Configurable &svc;
+};
+
+} // namespace Adapter
+
+#endif
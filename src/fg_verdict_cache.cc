@@ -0,0 +1,93 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#include <functional>
+
+#include "fg_verdict_cache.h"
+
+const size_t Adapter::VerdictCache::SHARDS;
+
+Adapter::VerdictCache::VerdictCache(): ttl(0) {
+}
+
+void Adapter::VerdictCache::configure(size_t capacity, time_t aTtl) {
+	ttl = aTtl;
+	// small caches get fewer shards, each shard gets a slot at least
+	const size_t count = capacity == 0 ? 0 : capacity < SHARDS ? capacity : SHARDS;
+	std::vector<Shard> fresh(count);
+	for (size_t i = 0; i < count; ++i) {
+		fresh[i].slots.resize(capacity / count + (i < capacity % count ? 1 : 0));
+		fresh[i].hand = 0;
+	}
+	shards.swap(fresh);
+}
+
+Adapter::VerdictCache::Shard &Adapter::VerdictCache::shardFor(const std::string &key) {
+	return shards[std::hash<std::string>()(key) % shards.size()];
+}
+
+bool Adapter::VerdictCache::lookup(const std::string &key) {
+	if (!enabled()) {
+		return false;
+	}
+	Shard &shard = shardFor(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	std::unordered_map<std::string, size_t>::iterator i = shard.index.find(key);
+	if (i == shard.index.end()) {
+		return false;
+	}
+	Slot &slot = shard.slots[i->second];
+	if (slot.expires <= time(NULL)) {
+		slot.key.clear();
+		shard.index.erase(i);
+		return false;
+	}
+	slot.referenced = true;
+	return true;
+}
+
+void Adapter::VerdictCache::insert(const std::string &key) {
+	if (!enabled() || key.empty()) {
+		return;
+	}
+	const time_t now = time(NULL);
+	Shard &shard = shardFor(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	std::unordered_map<std::string, size_t>::iterator i = shard.index.find(key);
+	if (i != shard.index.end()) {
+		shard.slots[i->second].expires = now + ttl;
+		return;
+	}
+	const size_t n = victim(shard, now);
+	Slot &slot = shard.slots[n];
+	if (!slot.key.empty()) {
+		shard.index.erase(slot.key);
+	}
+	slot.key = key;
+	slot.expires = now + ttl;
+	slot.referenced = false;
+	shard.index[key] = n;
+}
+
+// Finds a slot to reuse: a free or expired one, or the first one the hand
+// reaches without its referenced mark (clearing marks on the way).
+size_t Adapter::VerdictCache::victim(Shard &shard, time_t now) {
+	for (;;) {
+		const size_t n = shard.hand;
+		shard.hand = (shard.hand + 1) % shard.slots.size();
+		Slot &slot = shard.slots[n];
+		if (slot.key.empty() || slot.expires <= now || !slot.referenced) {
+			return n;
+		}
+		slot.referenced = false;
+	}
+}
+
+void Adapter::VerdictCache::clear() {
+	for (size_t i = 0; i < shards.size(); ++i) {
+		std::lock_guard<std::mutex> lock(shards[i].mutex);
+		shards[i].index.clear();
+		shards[i].slots.assign(shards[i].slots.size(), Slot());
+		shards[i].hand = 0;
+	}
+}
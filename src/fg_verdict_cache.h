@@ -0,0 +1,60 @@
+/*
+	Copyright Jacob Carter 2015 - 2016
+*/
+#ifndef FG_VERDICT_CACHE_H
+#define FG_VERDICT_CACHE_H
+
+#include <time.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Adapter {
+
+// Remembers recent "use virgin" verdicts so that the same request does not
+// have to go to ecapguardian again before the entry expires.
+//
+// Keys are opaque strings built by the adapter (see the REQMOD Service).
+// The entries are spread over shards by key hash, each shard with its own
+// lock and a fixed number of slots recycled by the CLOCK algorithm: a hit
+// marks the slot, and the clock hand spares marked slots once.
+class VerdictCache {
+	public:
+		VerdictCache();
+
+		// capacity == 0 disables the cache; drops all entries
+		void configure(size_t capacity, time_t ttl);
+		bool enabled() const { return !shards.empty(); }
+
+		bool lookup(const std::string &key);
+		void insert(const std::string &key);
+		void clear();
+
+	private:
+		struct Slot {
+			Slot(): expires(0), referenced(false) {}
+			std::string key; // empty for a free slot
+			time_t expires;
+			bool referenced;
+		};
+
+		struct Shard {
+			std::mutex mutex;
+			std::unordered_map<std::string, size_t> index; // slot by key
+			std::vector<Slot> slots;
+			size_t hand; // next eviction candidate
+		};
+
+		Shard &shardFor(const std::string &key);
+		static size_t victim(Shard &shard, time_t now);
+
+		std::vector<Shard> shards;
+		time_t ttl;
+
+		static const size_t SHARDS = 16;
+};
+
+} // namespace Adapter
+
+#endif